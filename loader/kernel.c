@@ -8,11 +8,20 @@
 
 static uint8_t stack[4096];
 
+#define AP_STACK_SIZE (8 * 1024)
+
+struct stivale2_header_tag_smp smp_hdr_tag = {
+    .tag = {
+        .identifier = STIVALE2_HEADER_TAG_SMP_ID,
+        .next = 0
+    },
+    .flags = 0
+};
 
 struct stivale2_header_tag_framebuffer framebuffer_hdr_tag = {
     .tag = {
         .identifier = STIVALE2_HEADER_TAG_FRAMEBUFFER_ID,
-        .next = 0
+        .next = (uintptr_t)&smp_hdr_tag
     },
     .framebuffer_width  = 0,
     .framebuffer_height = 0,
@@ -53,12 +62,47 @@ uint64_t __rdmsr(uint32_t msr) {
 
 extern size_t base;
 
+static uint64_t* pagemap;
+
+// the aps start here on the bootloader page tables, switch to ours and
+// wait for virtdbg to tell us where to go
+static void ap_entry(struct stivale2_smp_info* info) {
+    virtdbg_ap_wakeup_t* wakeup = (void*)info->extra_argument;
+
+    asm volatile (
+        "mov %0, %%cr3"
+        :
+        : "r" (pagemap)
+        : "memory"
+    );
+
+    while (wakeup->goto_address == 0) {
+        asm volatile ("pause" : : : "memory");
+    }
+
+    asm volatile (
+        "mov %[stack], %%rsp\n"
+        "call *%[function]\n"
+        "cli\n"
+        "hlt\n"
+        : :
+          [function] "r" (wakeup->goto_address),
+          [stack]    "r" (wakeup->target_stack),
+          "D" (wakeup)
+        : "memory" );
+
+    for (;;) {
+        asm ("hlt");
+    }
+}
+
 void _start(struct stivale2_struct *stivale2_struct) {
     struct stivale2_struct_tag_memmap *memmap_tag =
         stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_MEMMAP_ID);
 
     struct stivale2_struct_tag_framebuffer *fb_hdr_tag;
     fb_hdr_tag = stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_FRAMEBUFFER_ID);
+    struct stivale2_struct_tag_smp *smp_tag = stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_SMP_ID);
     struct stivale2_struct_tag_modules *modules_tag = stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_MODULES_ID);
     struct stivale2_module *module = &modules_tag->modules[0];
 
@@ -67,7 +111,7 @@ void _start(struct stivale2_struct *stivale2_struct) {
     pmm_init(memmap_tag->memmap, memmap_tag->entries);
 
     void* virtdbg_phys = pmm_allocz_aligned(virtdbg_size, 0x1000);
-    uint64_t* pagemap = pmm_allocz_aligned(PAGE_SIZE, PAGE_SIZE);
+    pagemap = pmm_allocz_aligned(PAGE_SIZE, PAGE_SIZE);
     vmm_init(pagemap, memmap_tag->memmap, memmap_tag->entries);
 
 
@@ -78,7 +122,15 @@ void _start(struct stivale2_struct *stivale2_struct) {
     void *stack = pmm_allocz_aligned(8 * 1024, 16);
     //this is where virtdbg_end should be set, all things that the debugger will have to access are allocated before this
     struct virtdbg_args args = {0};
-    args.initial_guest_state = pmm_allocz_aligned(sizeof(initial_guest_state_t), 1);
+    size_t cpu_count = smp_tag != NULL ? smp_tag->cpu_count : 1;
+    args.initial_guest_state = pmm_allocz_aligned(sizeof(initial_guest_state_t) * cpu_count, 1);
+    args.ap_wakeup = pmm_allocz_aligned(sizeof(virtdbg_ap_wakeup_t) * cpu_count, 1);
+    args.memmap_count = memmap_tag->entries;
+    args.memmap = pmm_allocz_aligned(sizeof(virtdbg_memmap_entry_t) * memmap_tag->entries, 1);
+    memcpy(args.memmap, memmap_tag->memmap, sizeof(virtdbg_memmap_entry_t) * memmap_tag->entries);
+    for (size_t i = 1; i < cpu_count; i++) {
+        args.ap_wakeup[i].target_stack = (uintptr_t)pmm_allocz_aligned(AP_STACK_SIZE, 16) + AP_STACK_SIZE;
+    }
     size_t allocation_end = base;
 
     memcpy((void*)KERNEL_OFFSET, (void*)module->begin, virtdbg_size);
@@ -93,7 +145,7 @@ void _start(struct stivale2_struct *stivale2_struct) {
 
     args.stolen_memory_base = (size_t)virtdbg_phys;
     args.virtdbg_end = allocation_end;
-    args.stolen_memory_end = allocation_end + 0x200000;
+    args.stolen_memory_end = allocation_end + VIRTDBG_HEAP_BASE_SIZE + VIRTDBG_HEAP_PER_CPU_SIZE * cpu_count;
 
     uint64_t cr0, cr3, cr4;
 
@@ -127,8 +179,31 @@ void _start(struct stivale2_struct *stivale2_struct) {
     st.efer = __rdmsr(0xc0000080);
     st.rflags = 1 << 1;
     *(volatile uint8_t*)(0x1000) = 0xf4;
-    args.initial_guest_state_count = 0;
+
+    // the boot cpu is always the first, the rest are parked
+    // until virtdbg wakes them up
+    args.initial_guest_state_count = cpu_count;
     args.initial_guest_state[0] = st;
+    if (smp_tag != NULL) {
+        args.initial_guest_state[0].apic_id = smp_tag->bsp_lapic_id;
+
+        size_t ap = 1;
+        for (size_t i = 0; i < smp_tag->cpu_count; i++) {
+            struct stivale2_smp_info* info = &smp_tag->smp_info[i];
+            if (info->lapic_id == smp_tag->bsp_lapic_id) {
+                continue;
+            }
+
+            // the aps wait for a SIPI from the guest, like on a real
+            // machine, so they have no state of their own
+            args.initial_guest_state[ap] = (initial_guest_state_t){ .apic_id = info->lapic_id };
+
+            info->target_stack = args.ap_wakeup[ap].target_stack;
+            info->extra_argument = (uintptr_t)&args.ap_wakeup[ap];
+            info->goto_address = (uintptr_t)ap_entry;
+            ap++;
+        }
+    }
 
     for (size_t i = 0; i < 128; i++) {
         fb_addr[i] = 0xff;
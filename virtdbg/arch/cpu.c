@@ -39,3 +39,32 @@ bool are_interrupts_enabled() {
     );
     return flags.IF == 1;
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Time
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t cpu_tsc_frequency() {
+    uint32_t regs[4];
+
+    __cpuid(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+
+    // tsc/crystal ratio and the crystal frequency
+    if (max_leaf >= 0x15) {
+        __cpuid(0x15, 0, regs);
+        if (regs[0] != 0 && regs[1] != 0 && regs[2] != 0) {
+            return (uint64_t)regs[2] * regs[1] / regs[0];
+        }
+    }
+
+    // the base frequency in MHz is close enough
+    if (max_leaf >= 0x16) {
+        __cpuid(0x16, 0, regs);
+        if (regs[0] != 0) {
+            return (uint64_t)regs[0] * 1000000;
+        }
+    }
+
+    return 0;
+}
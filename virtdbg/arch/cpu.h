@@ -2,6 +2,7 @@
 #define __VIRTDBG_CPU_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Other cpu related operations
@@ -47,5 +48,14 @@ void enable_interrupts();
  */
 bool are_interrupts_enabled();
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Time
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The frequency of the tsc from cpuid, zero if the cpu does not tell
+ */
+uint64_t cpu_tsc_frequency();
+
 
 #endif //__VIRTDBG_CPU_H__
@@ -2,6 +2,7 @@
 #include <util/list.h>
 #include <util/defs.h>
 #include "gdt.h"
+#include "intrin.h"
 
 #include "idt.h"
 
@@ -278,6 +279,11 @@ void common_exception_handler(exception_context_t* ctx) {
     err_t err = NO_ERROR;
     bool handled = false;
 
+    // an accessor that expects to fault
+    if (intrin_fixup_fault(ctx->int_num, &ctx->rip)) {
+        return;
+    }
+
     // run all of the exception hooks
     for (list_entry_t* entry = m_exception_handlers.next; entry != &m_exception_handlers; entry = entry->next) {
         exception_handler_t* item = CR(entry, exception_handler_t, link);
@@ -1,4 +1,5 @@
 #include <arch/intrin.h>
+#include <arch/idt.h>
 
 uint64_t __rdmsr(uint32_t msr) {
     uint32_t val1, val2;
@@ -17,6 +18,81 @@ void __wrmsr (uint32_t msr, uint64_t Value) {
     : "c" (msr), "a" (val1), "d" (val2));
 }
 
+//
+// The safe accessors clear the result before the instruction and set it after
+// it, a #GP on the instruction resumes right past the set. They have a single
+// copy each so the labels are unique.
+//
+extern char rdmsr_safe_insn[], rdmsr_safe_resume[];
+extern char wrmsr_safe_insn[], wrmsr_safe_resume[];
+extern char memcpy_safe_insn[], memcpy_safe_resume[];
+
+__attribute__((noinline, noclone))
+bool __rdmsr_safe(uint32_t msr, uint64_t* value) {
+    uint32_t val1 = 0, val2 = 0;
+    uint8_t ok;
+    __asm__ __volatile__(
+    "movb $0, %[ok]\n"
+    ".global rdmsr_safe_insn\n"
+    "rdmsr_safe_insn: rdmsr\n"
+    "movb $1, %[ok]\n"
+    ".global rdmsr_safe_resume\n"
+    "rdmsr_safe_resume:\n"
+    : "+a" (val1), "+d" (val2), [ok] "=&r" (ok)
+    : "c" (msr));
+    *value = ((uint64_t) val1) | (((uint64_t)val2) << 32u);
+    return ok;
+}
+
+__attribute__((noinline, noclone))
+bool __wrmsr_safe(uint32_t msr, uint64_t value) {
+    uint32_t val1 = value, val2 = value >> 32;
+    uint8_t ok;
+    __asm__ __volatile__(
+    "movb $0, %[ok]\n"
+    ".global wrmsr_safe_insn\n"
+    "wrmsr_safe_insn: wrmsr\n"
+    "movb $1, %[ok]\n"
+    ".global wrmsr_safe_resume\n"
+    "wrmsr_safe_resume:\n"
+    : [ok] "=&r" (ok)
+    : "c" (msr), "a" (val1), "d" (val2)
+    : "memory");
+    return ok;
+}
+
+__attribute__((noinline, noclone))
+bool __memcpy_safe(void* dst, const void* src, size_t size) {
+    uint8_t ok;
+    __asm__ __volatile__(
+    "movb $0, %[ok]\n"
+    ".global memcpy_safe_insn\n"
+    "memcpy_safe_insn: rep movsb\n"
+    "movb $1, %[ok]\n"
+    ".global memcpy_safe_resume\n"
+    "memcpy_safe_resume:\n"
+    : [ok] "=&r" (ok), "+D" (dst), "+S" (src), "+c" (size)
+    :
+    : "memory");
+    return ok;
+}
+
+bool intrin_fixup_fault(uint8_t vector, uint64_t* rip) {
+    // the msrs #GP on a bad msr or value, the copy #GP on a non-canonical
+    // address and #PF on an unmapped one
+    if (vector == EXCEPT_GP_FAULT && *rip == (uintptr_t)rdmsr_safe_insn) {
+        *rip = (uintptr_t)rdmsr_safe_resume;
+        return true;
+    } else if (vector == EXCEPT_GP_FAULT && *rip == (uintptr_t)wrmsr_safe_insn) {
+        *rip = (uintptr_t)wrmsr_safe_resume;
+        return true;
+    } else if ((vector == EXCEPT_GP_FAULT || vector == EXCEPT_PAGE_FAULT) && *rip == (uintptr_t)memcpy_safe_insn) {
+        *rip = (uintptr_t)memcpy_safe_resume;
+        return true;
+    }
+    return false;
+}
+
 ia32_cr4_t __readcr4(void) {
     uint64_t value;
     __asm__ __volatile__ (
@@ -84,3 +160,13 @@ void __lgdt(descriptor_t gdt) {
 void __lidt(descriptor_t idt) {
     asm volatile("lidt %[idt]": [idt]"=m"(idt));
 }
+
+uint64_t __rdtsc(void) {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32u) | low;
+}
+
+void __cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    asm volatile("cpuid" : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3]) : "a"(leaf), "c"(subleaf));
+}
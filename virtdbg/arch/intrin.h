@@ -1,6 +1,8 @@
 #ifndef __VIRTDBG_INTRIN_H__
 #define __VIRTDBG_INTRIN_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <virtdbg.h>
 
@@ -36,6 +38,25 @@ uint64_t __rdmsr(uint32_t msr);
 
 void __wrmsr (uint32_t msr, uint64_t Value);
 
+/**
+ * Like __rdmsr and __wrmsr, but return false instead of taking down the
+ * host when the msr does not exist or the value is not allowed
+ */
+bool __rdmsr_safe(uint32_t msr, uint64_t* value);
+bool __wrmsr_safe(uint32_t msr, uint64_t value);
+
+/**
+ * Copy memory that may not be mapped, returns false if the copy faulted
+ * part way, whatever was copied until then stays
+ */
+bool __memcpy_safe(void* dst, const void* src, size_t size);
+
+/**
+ * If the fault came from one of the safe accessors move the rip to where
+ * the accessor reports the failure, returns false for any other fault
+ */
+bool intrin_fixup_fault(uint8_t vector, uint64_t* rip);
+
 typedef union {
     struct {
         uint32_t  VME:1;          ///< Virtual-8086 Mode Extensions.
@@ -116,5 +137,7 @@ descriptor_t __sgdt();
 descriptor_t __sidt();
 void __lgdt(descriptor_t gdt);
 void __lidt(descriptor_t idt);
+uint64_t __rdtsc(void);
+void __cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]);
 
 #endif //__VIRTDBG_INTRIN_H__
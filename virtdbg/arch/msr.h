@@ -1,6 +1,50 @@
 #ifndef __VIRTDBG_MSR_H__
 #define __VIRTDBG_MSR_H__
 
+#define MSR_IA32_SYSENTER_CS                     0x00000174
+#define MSR_IA32_SYSENTER_ESP                    0x00000175
+#define MSR_IA32_SYSENTER_EIP                    0x00000176
+#define MSR_IA32_DEBUGCTL                        0x000001D9
+#define MSR_IA32_PAT                             0x00000277
+#define MSR_IA32_STAR                            0xC0000081
+#define MSR_IA32_LSTAR                           0xC0000082
+#define MSR_IA32_FS_BASE                         0xC0000100
+#define MSR_IA32_GS_BASE                         0xC0000101
+#define MSR_IA32_KERNEL_GS_BASE                  0xC0000102
+
+#define MSR_IA32_MTRRCAP                         0x000000FE
+typedef union msr_mtrrcap {
+    struct {
+        uint64_t variable_count : 8;
+        uint64_t fixed_supported : 1;
+        uint64_t _reserved0 : 1;
+        uint64_t wc_supported : 1;
+        uint64_t smrr_supported : 1;
+        uint64_t _reserved1 : 52;
+    };
+    uint64_t raw;
+} msr_mtrrcap_t;
+
+#define MSR_IA32_MTRR_PHYSBASE(n)                (0x00000200 + (n) * 2)
+#define MSR_IA32_MTRR_PHYSMASK(n)                (0x00000201 + (n) * 2)
+#define MSR_IA32_MTRR_PHYSMASK_VALID             (1ull << 11)
+#define MSR_IA32_MTRR_FIX64K_00000               0x00000250
+#define MSR_IA32_MTRR_FIX16K_80000               0x00000258
+#define MSR_IA32_MTRR_FIX16K_A0000               0x00000259
+#define MSR_IA32_MTRR_FIX4K_C0000                0x00000268
+
+#define MSR_IA32_MTRR_DEF_TYPE                   0x000002FF
+typedef union msr_mtrr_def_type {
+    struct {
+        uint64_t type : 8;
+        uint64_t _reserved0 : 2;
+        uint64_t fixed_enable : 1;
+        uint64_t enable : 1;
+        uint64_t _reserved1 : 52;
+    };
+    uint64_t raw;
+} msr_mtrr_def_type_t;
+
 #define MSR_IA32_EFER                            0xC0000080
 typedef union msr_efer {
     struct {
@@ -69,11 +113,44 @@ typedef union msr_vmx_misc {
 #define MSR_IA32_VMX_VMCS_ENUM                   0x0000048A
 #define MSR_IA32_VMX_PROCBASED_CTLS2             0x0000048B
 #define MSR_IA32_VMX_EPT_VPID_CAP                0x0000048C
+typedef union msr_vmx_ept_vpid_cap {
+    struct {
+        uint64_t execute_only : 1;
+        uint64_t _reserved0 : 5;
+        uint64_t page_walk_length_4 : 1;
+        uint64_t _reserved1 : 1;
+        uint64_t memory_type_uc : 1;
+        uint64_t _reserved2 : 5;
+        uint64_t memory_type_wb : 1;
+        uint64_t _reserved3 : 1;
+        uint64_t pde_2mb_pages : 1;
+        uint64_t pdpte_1gb_pages : 1;
+        uint64_t _reserved4 : 2;
+        uint64_t invept : 1;
+        uint64_t ept_accessed_dirty : 1;
+        uint64_t advanced_exit_info : 1;
+        uint64_t _reserved5 : 2;
+        uint64_t invept_single_context : 1;
+        uint64_t invept_all_context : 1;
+        uint64_t _reserved6 : 5;
+        uint64_t invvpid : 1;
+        uint64_t _reserved7 : 7;
+        uint64_t invvpid_individual_address : 1;
+        uint64_t invvpid_single_context : 1;
+        uint64_t invvpid_all_context : 1;
+        uint64_t invvpid_single_context_retain_globals : 1;
+        uint64_t _reserved8 : 20;
+    };
+    uint64_t raw;
+} msr_vmx_ept_vpid_cap_t;
+_Static_assert(sizeof(msr_vmx_ept_vpid_cap_t) == sizeof(uint64_t), "invalid size for msr_vmx_ept_vpid_cap_t");
+
 #define MSR_IA32_VMX_TRUE_PINBASED_CTLS          0x0000048D
 #define MSR_IA32_VMX_TRUE_PROCBASED_CTLS         0x0000048E
 #define MSR_IA32_VMX_TRUE_EXIT_CTLS              0x0000048F
 #define MSR_IA32_VMX_TRUE_ENTRY_CTLS             0x00000490
 #define MSR_IA32_VMX_VMFUNC                      0x00000491
+#define MSR_IA32_VMX_VMFUNC_EPTP_SWITCHING       (1ull << 0)
 
 
 #endif //__VIRTDBG_MSR_H__
@@ -2,7 +2,6 @@
 #include <arch/io.h>
 #include <stdint.h>
 
-#define SERIAL_BASE 0x3F8
 #define LSR         (SERIAL_BASE + 0x05)
 #define TXRDY       0x20
 #define RXDA        0x01
@@ -34,6 +33,14 @@ char serial_getc() {
     return io_read_8(SERIAL_BASE);
 }
 
+bool serial_try_getc(char* c) {
+    if (!(io_read_8(LSR) & RXDA)) {
+        return false;
+    }
+    *c = io_read_8(SERIAL_BASE);
+    return true;
+}
+
 void serial_output_cb(char c, void* ctx) {
     serial_putc(c);
 }
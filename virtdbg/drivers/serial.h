@@ -3,6 +3,12 @@
 
 #include <stdbool.h>
 
+/**
+ * The serial port we own (COM1), the guest never gets to touch it
+ */
+#define SERIAL_BASE         0x3F8
+#define SERIAL_PORT_COUNT   8
+
 /**
  * Init the serial driver
  */
@@ -18,6 +24,11 @@ void serial_putc(char c);
  */
 char serial_getc();
 
+/**
+ * Get a char from serial if one came in, never waits
+ */
+bool serial_try_getc(char* c);
+
 /**
  * Called by trace for outputting characters
  */
@@ -7,10 +7,85 @@
 #include <arch/gdt.h>
 #include <arch/idt.h>
 #include <vmx/vmm.h>
+#include <vmx/vcpu.h>
+#include <vmx/msr_bitmap.h>
+#include <vmx/io_bitmap.h>
+#include <vmx/cpuid.h>
+#include <vmx/profiler.h>
+#include <vmx/timer.h>
+#include <vmx/mem_type.h>
+#include <vmx/watch.h>
+#include <vmx/breakpoint.h>
+#include <vmx/heatmap.h>
+#include <vmx/dirty.h>
+#include <vmx/guest_mem.h>
 #include <mm/pmm.h>
 #include "virtdbg.h"
 #include <arch/io.h>
 #include <gdb/gdb.h>
+#include <arch/intrin.h>
+#include <arch/cpu.h>
+
+/**
+ * The initial guest states of all the cpus, indexed by the vcpu id
+ */
+static initial_guest_state_t* m_initial_guest_states;
+
+/**
+ * Allocate the vcpu of the given cpu, everything else is
+ * done by the cpu itself
+ */
+static err_t create_vcpu(uint8_t id, vcpu_t** out) {
+    err_t err = NO_ERROR;
+
+    vcpu_t* vcpu = pallocz_aligned(sizeof(vcpu_t), CACHELINE_SIZE);
+    CHECK_ERROR(vcpu != NULL, ERROR_OUT_OF_RESOURCES);
+    vcpu->id = id;
+    g_vcpus[id] = vcpu;
+    *out = vcpu;
+
+cleanup:
+    return err;
+}
+
+/**
+ * Enter vmx operation and launch the guest on the current cpu
+ */
+static err_t start_vcpu(vcpu_t* vcpu) {
+    err_t err = NO_ERROR;
+
+    if (EPT_FAULT_STORM) {
+        ept_fault_storm(vcpu->id, g_vcpu_count);
+    }
+
+    CHECK_AND_RETHROW(vmxon());
+    CHECK_AND_RETHROW(init_vmcs(vcpu, &m_initial_guest_states[vcpu->id]));
+
+cleanup:
+    return err;
+}
+
+/**
+ * Where the application processors are sent once the boot cpu has
+ * setup the shared state
+ */
+__attribute__((noreturn))
+static void ap_start(virtdbg_ap_wakeup_t* wakeup) {
+    err_t err = NO_ERROR;
+    vcpu_t* vcpu = (vcpu_t*)wakeup->extra_argument;
+
+    // the tables are shared, just load them
+    init_gdt();
+    __lidt(g_idt);
+
+    CHECK_AND_RETHROW(start_vcpu(vcpu));
+
+cleanup:
+    TRACE("Failed to start cpu #%d", vcpu->id);
+    while (1) {
+        cpu_sleep();
+    }
+}
 
 __attribute__((section(".init"), used))
 void _start(virtdbg_args_t* args) {
@@ -42,14 +117,56 @@ void _start(virtdbg_args_t* args) {
     //
     // Do the hypervisor setup
     //
+    CHECK_AND_RETHROW(init_vmm());
+    CHECK_AND_RETHROW(init_mem_types());
     CHECK_AND_RETHROW(init_ept());
 
+    // the guest can't touch our own memory
+    CHECK_AND_RETHROW(ept_hide_range(args->stolen_memory_base, args->stolen_memory_end - args->stolen_memory_base));
+
+    // map everything we know about before the guest starts, only the
+    // holes are left to the ept violation handler
+    size_t mapped = 0;
+    CHECK_AND_RETHROW(ept_map_memmap(args->memmap, args->memmap_count, &mapped));
+    TRACE("\tprepopulated %lu entries (%lu MB)", args->memmap_count, mapped / (1024 * 1024));
+
     TRACE("ept initialized");
 
-    CHECK_AND_RETHROW(vmxon());
+    CHECK_AND_RETHROW(init_msr_bitmap());
+    CHECK_AND_RETHROW(init_io_bitmap());
+    CHECK_AND_RETHROW(init_cpuid());
+    CHECK_AND_RETHROW(init_timer());
+    CHECK_AND_RETHROW(init_profiler());
+    CHECK_AND_RETHROW(init_watch());
+    CHECK_AND_RETHROW(init_breakpoints());
+    CHECK_AND_RETHROW(init_heatmap(args->memmap, args->memmap_count));
+    CHECK_AND_RETHROW(init_dirty(args->memmap, args->memmap_count));
+    CHECK_AND_RETHROW(init_guest_mem(args->memmap, args->memmap_count));
+
+    //
+    // wake up all the other cpus so they can setup their vcpu in
+    // parallel to us, the boot cpu is always vcpu #0
+    //
+    CHECK(args->initial_guest_state_count > 0, "No initial guest states");
+    CHECK(args->initial_guest_state_count <= MAX_VCPUS, "Only %d cpus are supported, got %lu",
+          MAX_VCPUS, args->initial_guest_state_count);
+    m_initial_guest_states = args->initial_guest_state;
+    g_vcpu_count = args->initial_guest_state_count;
+    vmm_start_bringup(args->initial_guest_state_count);
+
+    for (size_t i = 1; i < args->initial_guest_state_count; i++) {
+        vcpu_t* vcpu = NULL;
+        CHECK_AND_RETHROW(create_vcpu(i, &vcpu));
+
+        virtdbg_ap_wakeup_t* wakeup = &args->ap_wakeup[i];
+        wakeup->extra_argument = (uintptr_t)vcpu;
+        memory_barrier();
+        wakeup->goto_address = (uintptr_t)ap_start;
+    }
 
-    vmcs_t v;
-    init_vmcs(&v, &args->initial_guest_state[0]);
+    vcpu_t* vcpu = NULL;
+    CHECK_AND_RETHROW(create_vcpu(0, &vcpu));
+    CHECK_AND_RETHROW(start_vcpu(vcpu));
 
 cleanup:
     TRACE("We done for now");
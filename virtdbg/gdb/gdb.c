@@ -1,41 +1,60 @@
 #include "gdb.h"
 
+#include <arch/cpu.h>
 #include <arch/idt.h>
 #include <drivers/serial.h>
 #include <util/string.h>
+#include <util/defs.h>
+#include <sync/lock.h>
+#include <vmx/profiler.h>
+#include <vmx/heatmap.h>
+#include <vmx/dirty.h>
+#include <vmx/guest_mem.h>
+#include <vmx/watch.h>
+#include <vmx/breakpoint.h>
+#include <vmx/timer.h>
+#include <vmx/vcpu.h>
+#include <stdatomic.h>
 
 /**
  * turn a number to a hex character
  */
 static char m_hex_to_str[] = "0123456789ABCDEF";
 
+/**
+ * The biggest packet gdb may send us, advertised in `qSupported` so memory
+ * transfers don't get split to tiny packets
+ */
+#define GDB_PACKET_SIZE 0x10000
+
+/**
+ * Only one vcpu can talk with gdb at a time, the packet buffers
+ * belong to whoever holds the lock
+ */
+static lock_t m_gdb_lock = INIT_LOCK();
+static char m_packet[GDB_PACKET_SIZE + 1];
+static char m_reply[GDB_PACKET_SIZE + 1];
+static uint8_t m_memory[GDB_PACKET_SIZE];
+
+/**
+ * Set once gdb asks for `QStartNoAckMode`, packets are not acked in either
+ * direction so every packet costs a single trip over the serial
+ */
+static bool m_no_ack = false;
+
 static size_t str_to_hex(char c) {
     if ('0' <= c && c <= '9') {
         return c - '0';
     } else if ('A' <= c && c <= 'F') {
-        return c - 'A';
+        return c - 'A' + 10;
     } else if ('a' <= c && c <= 'f') {
-        return c - 'a';
+        return c - 'a' + 10;
     } else {
         WARN("Got invalid char when expecting hex (`%c`)", c);
         return -1;
     }
 }
 
-/**
- * Read hex from serial
- */
-static size_t serial_read_hex(size_t count) {
-    size_t num = 0;
-
-    while (count--) {
-        num <<= 4;
-        num |= str_to_hex(serial_getc());
-    }
-
-    return num;
-}
-
 static size_t buf_read_hex(char* str) {
     size_t num = 0;
 
@@ -48,26 +67,296 @@ static size_t buf_read_hex(char* str) {
     return num;
 }
 
-static void buf_write_hex(uint64_t num, char* str) {
-    size_t off = 0;
-    while (off < 64) {
+/**
+ * Read a register value, it is sent as its bytes in memory order
+ */
+static uint64_t buf_read_register(char* str) {
+    uint64_t num = 0;
+    for (size_t off = 0; off < 64 && str[0] != '\0' && str[1] != '\0'; off += 8) {
+        num |= (uint64_t)((str_to_hex(str[0]) << 4) | str_to_hex(str[1])) << off;
+        str += 2;
+    }
+    return num;
+}
+
+/**
+ * Write the low bytes of a register value in memory order, returns
+ * where the value ends
+ */
+static char* buf_write_register(uint64_t num, size_t size, char* str) {
+    for (size_t off = 0; off < size * 8; off += 8) {
         *str++ = m_hex_to_str[(num >> (off + 4)) & 0xF];
         *str++ = m_hex_to_str[(num >> off) & 0xF];
-        off += 8;
     }
+    return str;
+}
+
+static bool str_starts_with(const char* str, const char* prefix) {
+    while (*prefix != '\0') {
+        if (*str++ != *prefix++) {
+            return false;
+        }
+    }
+    return true;
 }
 
+/**
+ * The bytes that came from gdb and were not parsed yet, the uart only
+ * buffers a few so it is drained to here whenever we look for input
+ */
+#define GDB_RX_RING_SIZE 4096
+
+static char m_rx_ring[GDB_RX_RING_SIZE];
+static size_t m_rx_head = 0;
+static size_t m_rx_tail = 0;
 
 /**
- * Send a packet to the gdb client
+ * Set by whoever reads the ring, either a stopped vcpu talking with
+ * gdb or a running one looking for a break
  */
-static void gdb_send_packet(char* packet_data) {
-    // calculate the checksum
+static atomic_flag m_rx_busy = ATOMIC_FLAG_INIT;
+
+/**
+ * How often the running guest looks for a break, the uart is slow to
+ * read so not on every exit
+ */
+static uint64_t m_poll_cycles;
+static atomic_uint_fast64_t m_next_poll_tsc = 0;
+
+/**
+ * Set from the first stop until gdb detaches, every vcpu exits on the poll
+ * interval meanwhile so a guest that doesn't exit on its own can still be
+ * stopped, protected by the gdb lock
+ */
+static bool m_attached = false;
+
+/**
+ * Move whatever the uart has to the ring, never waits
+ */
+static void gdb_rx_fill() {
+    char c;
+    while (m_rx_head - m_rx_tail < GDB_RX_RING_SIZE && serial_try_getc(&c)) {
+        m_rx_ring[m_rx_head++ % GDB_RX_RING_SIZE] = c;
+    }
+}
+
+/**
+ * Look at the next byte without taking it, returns false if nothing came yet
+ */
+static bool gdb_rx_peek(char* c) {
+    if (m_rx_head == m_rx_tail) {
+        gdb_rx_fill();
+        if (m_rx_head == m_rx_tail) {
+            return false;
+        }
+    }
+    *c = m_rx_ring[m_rx_tail % GDB_RX_RING_SIZE];
+    return true;
+}
+
+typedef enum gdb_parse_state {
+    // between packets, waiting for a `$`
+    GDB_PARSE_IDLE,
+    GDB_PARSE_DATA,
+    // after a `}`, the next byte is xored with 0x20
+    GDB_PARSE_ESCAPE,
+    // after a `*`, the next byte is the repeat count plus 29
+    GDB_PARSE_REPEAT,
+    GDB_PARSE_CHECKSUM_HIGH,
+    GDB_PARSE_CHECKSUM_LOW,
+} gdb_parse_state_t;
+
+typedef enum gdb_event {
+    GDB_EVENT_NONE,
+    // a whole packet is in the packet buffer and was not acked yet
+    GDB_EVENT_PACKET,
+    // the checksum was wrong or the packet did not fit
+    GDB_EVENT_BAD_PACKET,
+    GDB_EVENT_ACK,
+    GDB_EVENT_NACK,
+    // a ctrl-c between packets
+    GDB_EVENT_BREAK,
+} gdb_event_t;
+
+/**
+ * Decodes packets a byte at a time, so it can stop at any point and pick
+ * up once more bytes come in
+ */
+typedef struct gdb_parser {
+    gdb_parse_state_t state;
+    char* data;
+    size_t size;
+    size_t length;
+    bool overflow;
+
+    // the last byte as it came in, a repeat copies it
+    char last;
+
+    // of everything between the `$` and the `#`
+    uint8_t checksum;
+    uint8_t expected_checksum;
+} gdb_parser_t;
+
+static gdb_parser_t m_parser = {
+    .state = GDB_PARSE_IDLE,
+    .data = m_packet,
+    .size = sizeof(m_packet) - 1,
+};
+
+static void gdb_parser_put(gdb_parser_t* parser, char c) {
+    if (parser->length < parser->size) {
+        parser->data[parser->length++] = c;
+    } else {
+        parser->overflow = true;
+    }
+}
+
+/**
+ * Feed a single byte to the parser, returns what it completed
+ */
+static gdb_event_t gdb_parse_byte(gdb_parser_t* parser, char c) {
+    switch (parser->state) {
+        case GDB_PARSE_IDLE: {
+            switch (c) {
+                case '$': {
+                    parser->state = GDB_PARSE_DATA;
+                    parser->length = 0;
+                    parser->overflow = false;
+                    parser->checksum = 0;
+                } break;
+                case '+': return GDB_EVENT_ACK;
+                case '-': return GDB_EVENT_NACK;
+                case 0x03: return GDB_EVENT_BREAK;
+                default: break;
+            }
+        } break;
+
+        case GDB_PARSE_DATA: {
+            if (c == '#') {
+                parser->state = GDB_PARSE_CHECKSUM_HIGH;
+                break;
+            }
+
+            parser->checksum += c;
+            if (c == '}') {
+                parser->state = GDB_PARSE_ESCAPE;
+            } else if (c == '*') {
+                parser->state = GDB_PARSE_REPEAT;
+            } else {
+                parser->last = c;
+                gdb_parser_put(parser, c);
+            }
+        } break;
+
+        case GDB_PARSE_ESCAPE: {
+            parser->checksum += c;
+            parser->last = c;
+            gdb_parser_put(parser, c ^ 0x20);
+            parser->state = GDB_PARSE_DATA;
+        } break;
+
+        case GDB_PARSE_REPEAT: {
+            // the run is expanded before the escapes, so the
+            // repeated byte is taken as is
+            parser->checksum += c;
+            for (int i = 0; i < (uint8_t)c - 29; i++) {
+                gdb_parser_put(parser, parser->last);
+            }
+            parser->state = GDB_PARSE_DATA;
+        } break;
+
+        case GDB_PARSE_CHECKSUM_HIGH: {
+            parser->expected_checksum = str_to_hex(c) << 4;
+            parser->state = GDB_PARSE_CHECKSUM_LOW;
+        } break;
+
+        case GDB_PARSE_CHECKSUM_LOW: {
+            parser->expected_checksum |= str_to_hex(c) & 0xF;
+            parser->state = GDB_PARSE_IDLE;
+
+            if (parser->overflow || parser->checksum != parser->expected_checksum) {
+                return GDB_EVENT_BAD_PACKET;
+            }
+            parser->data[parser->length] = '\0';
+            return GDB_EVENT_PACKET;
+        }
+    }
+
+    return GDB_EVENT_NONE;
+}
+
+/**
+ * Wait for gdb to ack the packet we sent, returns false if it wants it
+ * again. A new packet starting means gdb took ours, it is left for
+ * the receive so the packet buffer is not touched.
+ */
+static bool gdb_wait_ack() {
+    for (;;) {
+        char c;
+        if (!gdb_rx_peek(&c)) {
+            cpu_pause();
+            continue;
+        }
+
+        if (m_parser.state == GDB_PARSE_IDLE && c == '$') {
+            return true;
+        }
+        m_rx_tail++;
+
+        switch (gdb_parse_byte(&m_parser, c)) {
+            case GDB_EVENT_ACK: return true;
+            case GDB_EVENT_NACK: return false;
+            default: break;
+        }
+    }
+}
+
+/**
+ * The longest run a single `*` can encode, the count is sent as a
+ * printable character
+ */
+#define GDB_MAX_REPEAT ('~' - 29)
+
+/**
+ * Output the packet data with runs of the same character encoded
+ * as `<char>*<repeat + 29>`, returns the checksum of what was sent
+ */
+static uint8_t gdb_put_run_length(const char* data, size_t length) {
     uint8_t checksum = 0;
-    for (char* ptr = packet_data; *ptr != '\0'; ptr++) {
-        checksum += *ptr;
+
+    size_t i = 0;
+    while (i < length) {
+        char c = data[i];
+        size_t repeat = 0;
+        while (i + repeat + 1 < length && data[i + repeat + 1] == c && repeat < GDB_MAX_REPEAT) {
+            repeat++;
+        }
+
+        // the counts of 6 and 7 would be sent as `#` and `$`
+        if (repeat == 6 || repeat == 7) {
+            repeat = 5;
+        }
+
+        serial_putc(c);
+        checksum += c;
+        i++;
+
+        // shorter runs are cheaper as they are
+        if (repeat >= 3) {
+            serial_putc('*');
+            serial_putc(repeat + 29);
+            checksum += '*' + repeat + 29;
+            i += repeat;
+        }
     }
 
+    return checksum;
+}
+
+/**
+ * Send a packet to the gdb client, the data may be binary
+ */
+static void gdb_send_packet_length(const char* packet_data, size_t length) {
     // try some times
     uint8_t retries = 10;
     do {
@@ -78,104 +367,540 @@ static void gdb_send_packet(char* packet_data) {
         // packet prefix
         serial_putc('$');
 
-        // output the data
-        for (char* ptr = packet_data; *ptr != '\0'; ptr++) {
-            serial_putc(*ptr);
-        }
+        // output the data, the checksum is of the encoded data
+        uint8_t checksum = gdb_put_run_length(packet_data, length);
 
         // output the checksum
         serial_putc('#');
         serial_putc(m_hex_to_str[checksum >> 4]);
         serial_putc(m_hex_to_str[checksum & 0xF]);
-    } while(serial_getc() != '+');
+    } while(!m_no_ack && !gdb_wait_ack());
 }
 
 /**
- * Receive a packet from the gdb client
+ * Send a packet to the gdb client
  */
-static err_t gdb_receive_packet(char* packet_data, size_t packet_data_size) {
-    err_t err = NO_ERROR;
-    uint8_t expected_checksum = 0;
-    size_t off = 0;
+static void gdb_send_packet(const char* packet_data) {
+    size_t length = 0;
+    while (packet_data[length] != '\0') {
+        length++;
+    }
+    gdb_send_packet_length(packet_data, length);
+}
 
-    // check parameters
-    CHECK(packet_data != NULL);
+/**
+ * Wait for the next packet from gdb, acks and breaks that come in while
+ * the target is stopped mean nothing and are dropped. Returns the length
+ * of the packet, the data may be binary.
+ */
+static size_t gdb_receive_packet() {
+    for (;;) {
+        char c;
+        if (!gdb_rx_peek(&c)) {
+            cpu_pause();
+            continue;
+        }
+        m_rx_tail++;
 
-    // wait for the start of a packet
-    while (serial_getc() != '$');
+        gdb_event_t event = gdb_parse_byte(&m_parser, c);
+        if (event == GDB_EVENT_BAD_PACKET) {
+            if (m_no_ack) {
+                // without acks gdb won't resend, and any reply would be
+                // taken as the result of a command we never saw, drop it
+                // and let gdb time out on it
+                WARN("gdb: Got invalid packet, dropping it");
+            } else {
+                WARN("gdb: Got invalid packet, requesting it again");
+                serial_putc('-');
+            }
+        } else if (event == GDB_EVENT_PACKET) {
+            // a gdb that connects again starts over in ack mode
+            if (m_no_ack && str_starts_with(m_packet, "qSupported")) {
+                m_no_ack = false;
+            }
 
-retry:
-    // read the data itself
-    expected_checksum = 0;
-    off = 0;
-    do {
-        CHECK_ERROR(off < packet_data_size, ERROR_BUFFER_TOO_SMALL);
+            if (!m_no_ack) {
+                // ack that we got it
+                serial_putc('+');
+            }
 
-        // get the char until we get the checksum
-        char c = serial_getc();
-        if (c == '#') {
-            break;
+            return m_parser.length;
         }
+    }
+}
 
-        // calculate the checksum on the way while
-        // filling the data
-        expected_checksum += c;
-        packet_data[off++] = c;
-    } while(true);
+/**
+ * Send a line of text to the gdb console
+ */
+static void gdb_console_write(const char* line, void* ctx) {
+    char packet[1 + 256 + 2 + 1] = { 'O' };
+    size_t off = 1;
 
-    // put a zero terminator
-    packet_data[off] = '\0';
+    for (const char* ptr = line; *ptr != '\0' && off < sizeof(packet) - 3; ptr++) {
+        packet[off++] = m_hex_to_str[(uint8_t)*ptr >> 4];
+        packet[off++] = m_hex_to_str[*ptr & 0xF];
+    }
+    packet[off++] = '0';
+    packet[off++] = 'A';
+    packet[off] = '\0';
 
-    // check the checksum
-    uint8_t checksum = serial_read_hex(2);
-    if (checksum != expected_checksum) {
-        WARN("gdb: Got invalid checksum, requesting packet again");
+    gdb_send_packet(packet);
+}
 
-        // got invalid data for the checksum, tell the client
-        // to resend it
-        serial_putc('-');
-        goto retry;
+static size_t str_read_decimal(const char** str) {
+    size_t num = 0;
+    while (**str == ' ') {
+        (*str)++;
+    }
+    while ('0' <= **str && **str <= '9') {
+        num = num * 10 + (**str - '0');
+        (*str)++;
+    }
+    return num;
+}
+
+static void gdb_dirty_run(uintptr_t gpa, size_t pages, void* ctx) {
+    char line[64];
+    ksnprintf(line, sizeof(line), "%lx-%lx", gpa, gpa + pages * 0x1000);
+    gdb_console_write(line, NULL);
+}
+
+/**
+ * Handle a `monitor` command, the output goes to the gdb console
+ */
+static err_t gdb_monitor_command(const char* command) {
+    err_t err = NO_ERROR;
+
+    if (str_starts_with(command, "profile start")) {
+        // `profile start <hz> [depth]`
+        const char* args = command + sizeof("profile start") - 1;
+        size_t hz = str_read_decimal(&args);
+        size_t depth = str_read_decimal(&args);
+        CHECK_AND_RETHROW(profiler_start(hz, depth));
+    } else if (str_starts_with(command, "profile stop")) {
+        profiler_stop();
+    } else if (str_starts_with(command, "profile clear")) {
+        profiler_clear();
+    } else if (str_starts_with(command, "profile dump")) {
+        profiler_dump(gdb_console_write, NULL);
+    } else if (str_starts_with(command, "heatmap start")) {
+        // `heatmap start <interval ms>`
+        const char* args = command + sizeof("heatmap start") - 1;
+        size_t interval = str_read_decimal(&args);
+        CHECK_AND_RETHROW(heatmap_start(interval));
+    } else if (str_starts_with(command, "heatmap stop")) {
+        heatmap_stop();
+    } else if (str_starts_with(command, "heatmap clear")) {
+        heatmap_clear();
+    } else if (str_starts_with(command, "heatmap scan")) {
+        heatmap_scan();
+    } else if (str_starts_with(command, "heatmap dump")) {
+        heatmap_dump(gdb_console_write, NULL);
+    } else if (str_starts_with(command, "stats reset")) {
+        for (size_t i = 0; i < g_vcpu_count; i++) {
+            if (g_vcpus[i] != NULL) {
+                vmexit_stats_reset(&g_vcpus[i]->stats);
+            }
+        }
+    } else if (str_starts_with(command, "stats")) {
+        char line[64];
+        for (size_t i = 0; i < g_vcpu_count; i++) {
+            if (g_vcpus[i] == NULL) {
+                continue;
+            }
+            ksnprintf(line, sizeof(line), "# vcpu %lu", i);
+            gdb_console_write(line, NULL);
+            vmexit_stats_dump(&g_vcpus[i]->stats, gdb_console_write, NULL);
+        }
+    } else if (str_starts_with(command, "dirty start")) {
+        CHECK_AND_RETHROW(dirty_start());
+    } else if (str_starts_with(command, "dirty stop")) {
+        dirty_stop();
+    } else if (str_starts_with(command, "dirty fetch")) {
+        char line[64];
+        size_t pages = dirty_fetch_and_clear(gdb_dirty_run, NULL);
+        ksnprintf(line, sizeof(line), "%lu dirty pages", pages);
+        gdb_console_write(line, NULL);
     } else {
-        // ack that we got it
-        serial_putc('+');
+        gdb_console_write("commands: profile start <hz> [depth], profile stop, profile clear, profile dump", NULL);
+        gdb_console_write("          heatmap start <interval ms>, heatmap stop, heatmap clear, heatmap scan, heatmap dump", NULL);
+        gdb_console_write("          dirty start, dirty stop, dirty fetch", NULL);
+        gdb_console_write("          stats, stats reset", NULL);
     }
 
 cleanup:
-    if (IS_ERROR(err)) {
-        // send an error
-        serial_putc('-');
-    }
     return err;
 }
 
+/**
+ * Read memory of the stopped target, the guest memory is accessed through
+ * its page tables and the hypervisor's own memory directly
+ */
+static bool gdb_read_memory(vcpu_t* vcpu, uint64_t address, void* buffer, size_t size) {
+    if (vcpu == NULL) {
+        // gdb may ask for anything, don't fault on what is not mapped
+        return __memcpy_safe(buffer, (void*)address, size);
+    }
+    return guest_read(vmread(VMCS_FIELD_GUEST_CR3), address, buffer, size);
+}
+
+/**
+ * Write memory of the stopped target, a guest page with breakpoints gets
+ * its execute view updated as well
+ */
+static bool gdb_write_memory(vcpu_t* vcpu, uint64_t address, void* buffer, size_t size) {
+    if (vcpu == NULL) {
+        return __memcpy_safe((void*)address, buffer, size);
+    }
+
+    uint64_t cr3 = vmread(VMCS_FIELD_GUEST_CR3);
+    uint8_t* in = buffer;
+    while (size != 0) {
+        uintptr_t gpa;
+        if (!guest_translate(cr3, address, &gpa)) {
+            return false;
+        }
+
+        size_t chunk = MIN(size, 0x1000 - (address & 0xFFF));
+        memcpy((void*)gpa, in, chunk);
+        breakpoint_sync_page(gpa);
+
+        in += chunk;
+        address += chunk;
+        size -= chunk;
+    }
+
+    return true;
+}
+
+/**
+ * Parse the `<addr>,<length>` of a memory packet, returns the rest of the packet
+ */
+static char* gdb_read_range(char* ptr, uint64_t* address, size_t* length) {
+    *address = buf_read_hex(ptr);
+    while (*ptr != ',' && *ptr != '\0') {
+        ptr++;
+    }
+    if (*ptr != ',') {
+        return NULL;
+    }
+    ptr++;
+
+    *length = buf_read_hex(ptr);
+    while (str_to_hex(*ptr) != -1) {
+        ptr++;
+    }
+    return ptr;
+}
+
+/**
+ * Handle a `m<addr>,<length>` packet, the reply is cut to what fits in a
+ * single packet and gdb asks for the rest
+ */
+static void gdb_memory_read_command(char* data, vcpu_t* vcpu) {
+    uint64_t address;
+    size_t length;
+    if (gdb_read_range(&data[1], &address, &length) == NULL) {
+        gdb_send_packet("E01");
+        return;
+    }
+
+    length = MIN(length, GDB_PACKET_SIZE / 2);
+    if (!gdb_read_memory(vcpu, address, m_memory, length)) {
+        gdb_send_packet("E14");
+        return;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        m_reply[i * 2] = m_hex_to_str[m_memory[i] >> 4];
+        m_reply[i * 2 + 1] = m_hex_to_str[m_memory[i] & 0xF];
+    }
+    m_reply[length * 2] = '\0';
+    gdb_send_packet(m_reply);
+}
+
+/**
+ * Handle a `M<addr>,<length>:<hex data>` packet
+ */
+static void gdb_memory_write_command(char* data, vcpu_t* vcpu) {
+    uint64_t address;
+    size_t length;
+    char* hex = gdb_read_range(&data[1], &address, &length);
+    if (hex == NULL || *hex != ':' || length > sizeof(m_memory)) {
+        gdb_send_packet("E01");
+        return;
+    }
+    hex++;
+
+    for (size_t i = 0; i < length; i++) {
+        if (hex[0] == '\0' || hex[1] == '\0') {
+            gdb_send_packet("E01");
+            return;
+        }
+        m_memory[i] = (str_to_hex(hex[0]) << 4) | str_to_hex(hex[1]);
+        hex += 2;
+    }
+
+    gdb_send_packet(gdb_write_memory(vcpu, address, m_memory, length) ? "OK" : "E14");
+}
+
+/**
+ * Binary data escapes the characters that mean something
+ * to the protocol with a `}`
+ */
+static bool gdb_needs_escape(uint8_t c) {
+    return c == '#' || c == '$' || c == '}' || c == '*';
+}
+
+/**
+ * Handle a `x<addr>,<length>` packet, the reply is `b` followed by the raw
+ * bytes, cut to what fits in a single packet once escaped
+ */
+static void gdb_memory_read_binary_command(char* data, vcpu_t* vcpu) {
+    uint64_t address;
+    size_t length;
+    if (gdb_read_range(&data[1], &address, &length) == NULL) {
+        gdb_send_packet("E01");
+        return;
+    }
+
+    length = MIN(length, sizeof(m_memory) - 1);
+    if (!gdb_read_memory(vcpu, address, m_memory, length)) {
+        gdb_send_packet("E14");
+        return;
+    }
+
+    size_t off = 0;
+    m_reply[off++] = 'b';
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = m_memory[i];
+        if (gdb_needs_escape(c)) {
+            if (off + 2 > GDB_PACKET_SIZE) {
+                break;
+            }
+            m_reply[off++] = '}';
+            m_reply[off++] = c ^ 0x20;
+        } else {
+            if (off + 1 > GDB_PACKET_SIZE) {
+                break;
+            }
+            m_reply[off++] = c;
+        }
+    }
+    gdb_send_packet_length(m_reply, off);
+}
+
+/**
+ * Handle a `X<addr>,<length>:<binary data>` packet, a zero length
+ * is gdb checking that we support it
+ */
+static void gdb_memory_write_binary_command(char* data, size_t size, vcpu_t* vcpu) {
+    uint64_t address;
+    size_t length;
+    char* ptr = gdb_read_range(&data[1], &address, &length);
+    if (ptr == NULL || *ptr != ':' || length > sizeof(m_memory)) {
+        gdb_send_packet("E01");
+        return;
+    }
+    ptr++;
+
+    // the parser already took out the escapes
+    if ((size_t)(data + size - ptr) != length) {
+        gdb_send_packet("E01");
+        return;
+    }
+    memcpy(m_memory, ptr, length);
+
+    gdb_send_packet(gdb_write_memory(vcpu, address, m_memory, length) ? "OK" : "E14");
+}
+
+/**
+ * The registers in the order of the amd64 register numbers of gdb, the
+ * x87 and sse registers after them are not something we save
+ */
+#define GDB_REGISTER_RSP    7
+#define GDB_REGISTER_RIP    16
+#define GDB_REGISTER_RFLAGS 17
+#define GDB_REGISTER_CS     18
+#define GDB_REGISTER_GS     23
+#define GDB_REGISTER_COUNT  24
+
 static uint64_t* get_register_offset(exception_context_t* ctx, size_t reg) {
     switch (reg) {
         case 0: return &ctx->rax;
-        case 1: return &ctx->rcx;
-        case 2: return &ctx->rdx;
-        case 3: return &ctx->rbx;
-        case 4: return &ctx->rsp;
-        case 5: return &ctx->rbp;
-        case 6: return &ctx->rsi;
-        case 7: return &ctx->rdi;
-        case 8: return &ctx->rip;
-        case 9: return (uint64_t*)&ctx->rflags;
-        case 10: return &ctx->cs;
-        case 11: return &ctx->ss;
-        case 12: return &ctx->ds;
-        case 13: return &ctx->ds; // es
-        case 14: return &ctx->ds; // fs
-        case 15: return &ctx->ds; // gs
-        case 16: return &ctx->r8;
-        case 17: return &ctx->r9;
-        case 18: return &ctx->r10;
-        case 19: return &ctx->r11;
-        case 20: return &ctx->r12;
-        case 21: return &ctx->r13;
-        case 22: return &ctx->r14;
-        case 23: return &ctx->r15;
+        case 1: return &ctx->rbx;
+        case 2: return &ctx->rcx;
+        case 3: return &ctx->rdx;
+        case 4: return &ctx->rsi;
+        case 5: return &ctx->rdi;
+        case 6: return &ctx->rbp;
+        case 7: return &ctx->rsp;
+        case 8: return &ctx->r8;
+        case 9: return &ctx->r9;
+        case 10: return &ctx->r10;
+        case 11: return &ctx->r11;
+        case 12: return &ctx->r12;
+        case 13: return &ctx->r13;
+        case 14: return &ctx->r14;
+        case 15: return &ctx->r15;
+        case 16: return &ctx->rip;
+        case 17: return (uint64_t*)&ctx->rflags;
+        case 18: return &ctx->cs;
+        case 19: return &ctx->ss;
+        case 20: return &ctx->ds;
+        case 21: return &ctx->ds; // es
+        case 22: return &ctx->ds; // fs
+        case 23: return &ctx->ds; // gs
+        default: return NULL;
+    }
+}
+
+/**
+ * The guest general purpose registers are saved by us on every exit,
+ * the rest live in the vmcs
+ */
+static uint64_t* get_guest_register_offset(vcpu_t* vcpu, size_t reg) {
+    size_t offset;
+    switch (reg) {
+        case 0: offset = offsetof(guest_state_t, rax); break;
+        case 1: offset = offsetof(guest_state_t, rbx); break;
+        case 2: offset = offsetof(guest_state_t, rcx); break;
+        case 3: offset = offsetof(guest_state_t, rdx); break;
+        case 4: offset = offsetof(guest_state_t, rsi); break;
+        case 5: offset = offsetof(guest_state_t, rdi); break;
+        case 6: offset = offsetof(guest_state_t, rbp); break;
+        case 8: offset = offsetof(guest_state_t, r8); break;
+        case 9: offset = offsetof(guest_state_t, r9); break;
+        case 10: offset = offsetof(guest_state_t, r10); break;
+        case 11: offset = offsetof(guest_state_t, r11); break;
+        case 12: offset = offsetof(guest_state_t, r12); break;
+        case 13: offset = offsetof(guest_state_t, r13); break;
+        case 14: offset = offsetof(guest_state_t, r14); break;
+        case 15: offset = offsetof(guest_state_t, r15); break;
         default: return NULL;
     }
+
+    // the registers are packed but the state itself is aligned
+    return (uint64_t*)((uintptr_t)&vcpu->guest + offset);
+}
+
+/**
+ * The size gdb expects for the register, eflags and the segments are
+ * 32bit. Returns 0 for the registers gdb doesn't know about.
+ */
+static size_t get_register_size(size_t reg) {
+    if (reg < GDB_REGISTER_RFLAGS) {
+        return 8;
+    } else if (reg < GDB_REGISTER_COUNT) {
+        return 4;
+    } else if (reg < 32) {
+        // st0-st7
+        return 10;
+    } else if (reg < 40) {
+        // fctrl, fstat, ftag, fiseg, fioff, foseg, fooff, fop
+        return 4;
+    } else if (reg < 56) {
+        // xmm0-xmm15
+        return 16;
+    } else if (reg == 56) {
+        // mxcsr
+        return 4;
+    }
+    return 0;
+}
+
+/**
+ * The stopped target, the vcpu is NULL when debugging the hypervisor
+ * itself. Every register is fetched the first time gdb asks for it and
+ * only the modified ones are written back on resume.
+ */
+typedef struct gdb_stop {
+    exception_context_t* ctx;
+    vcpu_t* vcpu;
+    uint32_t valid;
+    uint32_t dirty;
+    uint64_t values[GDB_REGISTER_COUNT];
+
+    // gdb asked to step a single instruction
+    bool step;
+} gdb_stop_t;
+
+static uint64_t gdb_fetch_register(gdb_stop_t* stop, size_t reg) {
+    if (stop->vcpu == NULL) {
+        return *get_register_offset(stop->ctx, reg);
+    }
+
+    vcpu_t* vcpu = stop->vcpu;
+    uint64_t* gpr = get_guest_register_offset(vcpu, reg);
+    if (gpr != NULL) {
+        return *gpr;
+    }
+
+    switch (reg) {
+        case GDB_REGISTER_RSP: return guest_rsp(&vcpu->exit);
+        case GDB_REGISTER_RIP: return guest_rip(&vcpu->exit);
+        case GDB_REGISTER_RFLAGS: return guest_rflags(&vcpu->exit);
+        case 18: return vmread(VMCS_FIELD_GUEST_CS_SELECTOR);
+        case 19: return vmread(VMCS_FIELD_GUEST_SS_SELECTOR);
+        case 20: return vmread(VMCS_FIELD_GUEST_DS_SELECTOR);
+        case 21: return vmread(VMCS_FIELD_GUEST_ES_SELECTOR);
+        case 22: return vmread(VMCS_FIELD_GUEST_FS_SELECTOR);
+        case 23: return vmread(VMCS_FIELD_GUEST_GS_SELECTOR);
+        default: return 0;
+    }
+}
+
+static uint64_t gdb_read_register(gdb_stop_t* stop, size_t reg) {
+    if (!(stop->valid & (1u << reg))) {
+        stop->values[reg] = gdb_fetch_register(stop, reg);
+        stop->valid |= 1u << reg;
+    }
+    return stop->values[reg];
+}
+
+/**
+ * Returns false for the registers we can't change, a segment
+ * is more than its selector
+ */
+static bool gdb_write_register(gdb_stop_t* stop, size_t reg, uint64_t value) {
+    if (reg >= GDB_REGISTER_COUNT || (GDB_REGISTER_CS <= reg && reg <= GDB_REGISTER_GS)) {
+        return false;
+    }
+
+    stop->values[reg] = value;
+    stop->valid |= 1u << reg;
+    stop->dirty |= 1u << reg;
+    return true;
+}
+
+/**
+ * Write the modified registers back to the target
+ */
+static void gdb_flush_registers(gdb_stop_t* stop) {
+    for (size_t reg = 0; reg < GDB_REGISTER_COUNT; reg++) {
+        if (!(stop->dirty & (1u << reg))) {
+            continue;
+        }
+
+        uint64_t value = stop->values[reg];
+        if (stop->vcpu == NULL) {
+            *get_register_offset(stop->ctx, reg) = value;
+            continue;
+        }
+
+        vcpu_t* vcpu = stop->vcpu;
+        uint64_t* gpr = get_guest_register_offset(vcpu, reg);
+        if (gpr != NULL) {
+            *gpr = value;
+        } else if (reg == GDB_REGISTER_RSP) {
+            guest_set_rsp(&vcpu->exit, value);
+        } else if (reg == GDB_REGISTER_RIP) {
+            guest_set_rip(&vcpu->exit, value);
+        } else if (reg == GDB_REGISTER_RFLAGS) {
+            guest_set_rflags(&vcpu->exit, value);
+        }
+    }
+    stop->dirty = 0;
 }
 
 #define SIGILL      4
@@ -197,6 +922,274 @@ static void send_signal(int sig) {
     gdb_send_packet(packet);
 }
 
+/**
+ * Insert a watchpoint on guest virtual memory, every page of the range
+ * is translated on its own since they may be anywhere in physical memory
+ */
+static err_t gdb_insert_watchpoint(uint64_t address, size_t length, watch_type_t type) {
+    err_t err = NO_ERROR;
+    uint64_t cr3 = vmread(VMCS_FIELD_GUEST_CR3);
+
+    CHECK(length != 0);
+
+    uint64_t cur = address;
+    size_t left = length;
+    while (left != 0) {
+        size_t chunk = MIN(left, 0x1000 - (cur & 0xFFF));
+
+        uintptr_t gpa;
+        CHECK_ERROR(guest_translate(cr3, cur, &gpa), ERROR_NOT_FOUND);
+        CHECK_AND_RETHROW(watch_insert(address, gpa, chunk, type));
+
+        cur += chunk;
+        left -= chunk;
+    }
+
+cleanup:
+    if (IS_ERROR(err)) {
+        // take out the pages that did get in
+        watch_remove(address, type);
+    }
+    return err;
+}
+
+/**
+ * Insert a breakpoint on guest virtual memory, the int3 is only in the
+ * execute view of the page so the guest can't see it
+ */
+static err_t gdb_insert_breakpoint(uint64_t address) {
+    err_t err = NO_ERROR;
+
+    uintptr_t gpa;
+    CHECK_ERROR(guest_translate(vmread(VMCS_FIELD_GUEST_CR3), address, &gpa), ERROR_NOT_FOUND);
+    CHECK_AND_RETHROW(breakpoint_insert(address, gpa));
+
+cleanup:
+    return err;
+}
+
+static err_t gdb_remove_breakpoint(uint64_t address) {
+    err_t err = NO_ERROR;
+
+    uintptr_t gpa;
+    CHECK_ERROR(guest_translate(vmread(VMCS_FIELD_GUEST_CR3), address, &gpa), ERROR_NOT_FOUND);
+    CHECK_AND_RETHROW(breakpoint_remove(gpa));
+
+cleanup:
+    return err;
+}
+
+/**
+ * Handle a `Z`/`z` packet, only breakpoints and watchpoints on a stopped guest
+ * are supported, they are backed by the ept so there is no limit on how many
+ * there are
+ */
+static void gdb_watchpoint_command(char* data, vcpu_t* vcpu) {
+    // `Z<type>,<addr>,<kind>`
+    bool breakpoint = data[1] == '0';
+    watch_type_t type = 0;
+    switch (data[1]) {
+        case '2': type = WATCH_WRITE; break;
+        case '3': type = WATCH_READ; break;
+        case '4': type = WATCH_ACCESS; break;
+        default: break;
+    }
+
+    if (vcpu == NULL || (type == 0 && !breakpoint) || data[2] != ',') {
+        gdb_send_packet("");
+        return;
+    }
+
+    char* ptr = &data[3];
+    uint64_t address = buf_read_hex(ptr);
+    while (*ptr != ',' && *ptr != '\0') {
+        ptr++;
+    }
+    if (*ptr != ',') {
+        gdb_send_packet("E01");
+        return;
+    }
+    size_t length = buf_read_hex(ptr + 1);
+
+    err_t err;
+    if (breakpoint) {
+        // the kind is the size of the breakpoint, always a single int3 for us
+        err = data[0] == 'Z' ? gdb_insert_breakpoint(address) : gdb_remove_breakpoint(address);
+    } else if (data[0] == 'Z') {
+        err = gdb_insert_watchpoint(address, length, type);
+    } else {
+        err = watch_remove(address, type);
+    }
+    gdb_send_packet(IS_ERROR(err) ? "E01" : "OK");
+}
+
+/**
+ * Handle a single packet of gdb, returns true once gdb resumes the target.
+ * The vcpu is NULL when debugging the hypervisor itself.
+ */
+static bool gdb_dispatch_packet(gdb_stop_t* stop, char* data, size_t size) {
+    vcpu_t* vcpu = stop->vcpu;
+
+    switch (data[0]) {
+        case '?': {
+            //
+        } break;
+
+        case 'c': {
+            // `c [addr]`
+            // Continue at address, if no address is
+            // provided just continue
+            if (data[1] != '\0') {
+                gdb_write_register(stop, GDB_REGISTER_RIP, buf_read_hex(&data[1]));
+            }
+        } return true;
+
+        case 'g': {
+            // read general registers
+            char buffer[GDB_REGISTER_COUNT * 16 + 1] = { 0 };
+            char* ptr = buffer;
+            for (int i = 0; i < GDB_REGISTER_COUNT; i++) {
+                ptr = buf_write_register(gdb_read_register(stop, i), get_register_size(i), ptr);
+            }
+            gdb_send_packet(buffer);
+        } break;
+
+        case 'p': {
+            // `p<reg>`, a single register so `p $pc` doesn't
+            // fetch all of them
+            size_t reg = buf_read_hex(&data[1]);
+            size_t size = get_register_size(reg);
+            if (size == 0) {
+                gdb_send_packet("E01");
+                break;
+            }
+
+            char buffer[16 * 2 + 1] = { 0 };
+            if (reg < GDB_REGISTER_COUNT) {
+                buf_write_register(gdb_read_register(stop, reg), size, buffer);
+            } else {
+                // we don't save the fpu state, tell gdb it is unavailable
+                memset(buffer, 'x', size * 2);
+            }
+            gdb_send_packet(buffer);
+        } break;
+
+        case 'P': {
+            // `P<reg>=<value>`
+            char* ptr = &data[1];
+            size_t reg = buf_read_hex(ptr);
+            while (*ptr != '=' && *ptr != '\0') {
+                ptr++;
+            }
+
+            if (*ptr != '=' || !gdb_write_register(stop, reg, buf_read_register(ptr + 1))) {
+                gdb_send_packet("E01");
+            } else {
+                gdb_send_packet("OK");
+            }
+        } break;
+
+        case 'm': {
+            gdb_memory_read_command(data, vcpu);
+        } break;
+
+        case 'M': {
+            gdb_memory_write_command(data, vcpu);
+        } break;
+
+        case 'x': {
+            gdb_memory_read_binary_command(data, vcpu);
+        } break;
+
+        case 'X': {
+            gdb_memory_write_binary_command(data, size, vcpu);
+        } break;
+
+        case 'q': {
+            if (str_starts_with(data, "qSupported")) {
+                ksnprintf(m_reply, sizeof(m_reply), "PacketSize=%x;swbreak+;QStartNoAckMode+;binary-upload+", GDB_PACKET_SIZE);
+                gdb_send_packet(m_reply);
+            } else if (str_starts_with(data, "qRcmd,")) {
+                // the command is hex encoded, decode it in place
+                char* hex = &data[sizeof("qRcmd,") - 1];
+                char* command = hex;
+                size_t i = 0;
+                for (; hex[0] != '\0' && hex[1] != '\0'; i++) {
+                    command[i] = (str_to_hex(hex[0]) << 4) | str_to_hex(hex[1]);
+                    hex += 2;
+                }
+                command[i] = '\0';
+
+                if (IS_ERROR(gdb_monitor_command(command))) {
+                    gdb_send_packet("E01");
+                } else {
+                    gdb_send_packet("OK");
+                }
+            } else {
+                gdb_send_packet("");
+            }
+        } break;
+
+        case 'Q': {
+            if (str_starts_with(data, "QStartNoAckMode")) {
+                // the OK itself is still acked
+                gdb_send_packet("OK");
+                m_no_ack = true;
+            } else {
+                gdb_send_packet("");
+            }
+        } break;
+
+        case 'H': {
+            // switch to another thread, we don't have any so
+            // just return OK
+            gdb_send_packet("OK");
+        } break;
+
+        case 'D': {
+            // gdb is gone, the guest runs on its own again
+            timer_stop(TIMER_GDB);
+            m_attached = false;
+            gdb_send_packet("OK");
+        } return true;
+
+        case 's': {
+            // `s [addr]`
+            // Single step, if addr is specified resume at that address
+            if (data[1] != '\0') {
+                gdb_write_register(stop, GDB_REGISTER_RIP, buf_read_hex(&data[1]));
+            }
+            stop->step = true;
+        } return true;
+
+        case 'Z':
+        case 'z': {
+            gdb_watchpoint_command(data, vcpu);
+        } break;
+
+        default: {
+            // send an empty packet to show this
+            // is not supported
+            gdb_send_packet("");
+        } break;
+    }
+
+    return false;
+}
+
+/**
+ * Handle the packets of gdb until it resumes the target
+ */
+static void gdb_command_loop(gdb_stop_t* stop) {
+    for (;;) {
+        size_t size = gdb_receive_packet();
+        if (gdb_dispatch_packet(stop, m_packet, size)) {
+            break;
+        }
+    }
+    gdb_flush_registers(stop);
+}
+
 static err_t gdb_exception_handler(exception_context_t* ctx, bool* handled) {
     err_t err = NO_ERROR;
 
@@ -228,59 +1221,101 @@ static err_t gdb_exception_handler(exception_context_t* ctx, bool* handled) {
     send_signal(sig);
 
     // now handle any packet we get from gdb
-    for (;;) {
-        char data[256];
-        CHECK_AND_RETHROW(gdb_receive_packet(data, sizeof(data)));
-
-        // handle command
-        switch (data[0]) {
-            case '?': {
-                //
-            } break;
-
-            case 'c': {
-                // `c [addr]`
-                // Continue at address, if no address is
-                // provided just continue
-                if (data[1] != '\0') {
-                    ctx->rip = buf_read_hex(&data[1]);
-                }
-            } goto cleanup;
+    gdb_stop_t stop = { .ctx = ctx };
+    gdb_command_loop(&stop);
+    ctx->rflags.TF = stop.step;
 
-            case 'g': {
-                // read general registers
-                char buffer[24 * 16 + 1] = { 0 };
-                for (int i = 0; i < 24; i++) {
-                    buf_write_hex(*get_register_offset(ctx, i), &buffer[i * 8]);
-                }
-                gdb_send_packet(buffer);
-            } break;
+cleanup:
+    return err;
+}
 
-            case 'H': {
-                // switch to another thread, we don't have any so
-                // just return OK
-                gdb_send_packet("OK");
-            } break;
+static vmexit_action_t gdb_guest_step_done(vcpu_t* vcpu);
 
-            case 's': {
-                // `s [addr]`
-                // Single step, if addr is specified resume at that address
-                if (data[1] != '\0') {
-                    ctx->rip = buf_read_hex(&data[1]);
-                }
-                ctx->rflags.TF = true;
-            } break;
+/**
+ * Stop on the vcpu and let gdb look at the guest, the other
+ * vcpus keep running
+ */
+static void gdb_guest_stop(vcpu_t* vcpu, char* stop_reply) {
+    lock(&m_gdb_lock);
 
-            default: {
-                // send an empty packet to show this
-                // is not supported
-                gdb_send_packet("");
-            } break;
+    // wait for a vcpu that is looking for a break to be done
+    while (atomic_flag_test_and_set_explicit(&m_rx_busy, memory_order_acquire)) {
+        cpu_pause();
+    }
+
+    if (!m_attached) {
+        if (IS_ERROR(timer_start(TIMER_GDB, m_poll_cycles))) {
+            WARN("gdb: can't poll the guest with the preemption timer");
         }
+        m_attached = true;
     }
 
-cleanup:
-    return err;
+    gdb_stop_t stop = { .vcpu = vcpu };
+    gdb_send_packet(stop_reply);
+    gdb_command_loop(&stop);
+
+    // the guest would take the #DB of TF itself, step with the
+    // monitor trap flag instead
+    if (stop.step && IS_ERROR(vcpu_single_step(vcpu, gdb_guest_step_done))) {
+        WARN("gdb: can't single step the guest");
+    }
+
+    atomic_flag_clear_explicit(&m_rx_busy, memory_order_release);
+    unlock(&m_gdb_lock);
+}
+
+void gdb_poll(vcpu_t* vcpu, uint64_t tsc) {
+    uint64_t next = atomic_load_explicit(&m_next_poll_tsc, memory_order_relaxed);
+    if (tsc < next) {
+        return;
+    }
+
+    if (!atomic_compare_exchange_strong_explicit(&m_next_poll_tsc, &next, tsc + m_poll_cycles,
+                                                 memory_order_relaxed, memory_order_relaxed)) {
+        return;
+    }
+
+    // someone is already talking with gdb
+    if (atomic_flag_test_and_set_explicit(&m_rx_busy, memory_order_acquire)) {
+        return;
+    }
+
+    // gdb only sends a break while the guest runs, anything else is
+    // left over from the last stop and is dropped
+    bool stop = false;
+    char c;
+    while (!stop && gdb_rx_peek(&c)) {
+        m_rx_tail++;
+        stop = gdb_parse_byte(&m_parser, c) == GDB_EVENT_BREAK;
+    }
+
+    atomic_flag_clear_explicit(&m_rx_busy, memory_order_release);
+
+    if (stop) {
+        gdb_guest_stop(vcpu, "T02");
+    }
+}
+
+static vmexit_action_t gdb_guest_step_done(vcpu_t* vcpu) {
+    gdb_guest_stop(vcpu, "T05");
+    return VMEXIT_RESUME;
+}
+
+static void gdb_watch_hit(vcpu_t* vcpu, uint64_t address, watch_type_t type) {
+    const char* kind = "awatch";
+    if (type == WATCH_WRITE) {
+        kind = "watch";
+    } else if (type == WATCH_READ) {
+        kind = "rwatch";
+    }
+
+    char reply[64];
+    ksnprintf(reply, sizeof(reply), "T05%s:%lx;", kind, address);
+    gdb_guest_stop(vcpu, reply);
+}
+
+static void gdb_breakpoint_hit(vcpu_t* vcpu, uint64_t address) {
+    gdb_guest_stop(vcpu, "T05swbreak:;");
 }
 
 static exception_handler_t m_exception_handler = {
@@ -288,5 +1323,11 @@ static exception_handler_t m_exception_handler = {
 };
 
 void init_kernel_gdb() {
+    // look for a break every 10ms, guess a 3GHz tsc if the cpu won't tell
+    uint64_t tsc_hz = cpu_tsc_frequency();
+    m_poll_cycles = (tsc_hz != 0 ? tsc_hz : 3000000000ull) / 100;
+
     hook_exception_handler(&m_exception_handler);
+    watch_set_hit_handler(gdb_watch_hit);
+    breakpoint_set_hit_handler(gdb_breakpoint_hit);
 }
@@ -1,10 +1,19 @@
 #ifndef __VIRTDBG_GDB_H__
 #define __VIRTDBG_GDB_H__
 
+#include <vmx/vcpu.h>
+#include <stdint.h>
+
 /**
  * Initialize the kernel's gdb stub, allows to debug
  * the hypervisor itself
  */
 void init_kernel_gdb();
 
+/**
+ * Look for a break (ctrl-c) from gdb while the guest runs, called on
+ * every exit and turned into a stop on the vcpu that finds it
+ */
+void gdb_poll(vcpu_t* vcpu, uint64_t tsc);
+
 #endif //__VIRTDBG_GDB_H__
@@ -289,7 +289,13 @@ size_t kvsnprintf(char* buffer, size_t size, const char* fmt, va_list ap) {
             .buffer = buffer,
             .size = size,
     };
-    return kvcprintf((printf_callback_t) buffer_output_cb, &ctx, fmt, ap);
+    size_t retsize = kvcprintf((printf_callback_t) buffer_output_cb, &ctx, fmt, ap);
+
+    // terminate if the output did not fill the buffer
+    if (ctx.size != 0) {
+        *ctx.buffer = '\0';
+    }
+    return retsize;
 }
 
 size_t ksnprintf(char* buffer, size_t size, const char* fmt, ...) {
@@ -48,6 +48,47 @@ typedef struct initial_guest_state {
     descriptor_t idt;
 } __attribute__((packed)) initial_guest_state_t;
 
+/**
+ * The types of the memory map entries, same as stivale2
+ */
+#define VIRTDBG_MEMMAP_USABLE                   1
+#define VIRTDBG_MEMMAP_RESERVED                 2
+#define VIRTDBG_MEMMAP_ACPI_RECLAIMABLE         3
+#define VIRTDBG_MEMMAP_ACPI_NVS                 4
+#define VIRTDBG_MEMMAP_BAD_MEMORY               5
+#define VIRTDBG_MEMMAP_BOOTLOADER_RECLAIMABLE   0x1000
+#define VIRTDBG_MEMMAP_KERNEL_AND_MODULES       0x1001
+#define VIRTDBG_MEMMAP_FRAMEBUFFER              0x1002
+
+typedef struct virtdbg_memmap_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t _unused;
+} __attribute__((packed)) virtdbg_memmap_entry_t;
+
+/**
+ * A cpu the loader parked for the hypervisor, the cpu spins on goto_address
+ * with the hypervisor page tables loaded and once it is set calls it on the
+ * stack in target_stack with a pointer to this struct as the first argument.
+ *
+ * This must be in the stolen memory since the cpu may still be waiting when
+ * the boot cpu enters the guest.
+ */
+typedef struct virtdbg_ap_wakeup {
+    uint64_t target_stack;
+    volatile uint64_t goto_address;
+    uint64_t extra_argument;
+} __attribute__((packed)) virtdbg_ap_wakeup_t;
+
+/**
+ * The heap the loader should leave after virtdbg_end, the shared structures
+ * (ept, bitmaps, watch and breakpoint tables) plus the state of every cpu
+ * (vcpu, vmcs, stacks and profiler samples)
+ */
+#define VIRTDBG_HEAP_BASE_SIZE      0x200000
+#define VIRTDBG_HEAP_PER_CPU_SIZE   0x40000
+
 /**
  * This is passed to the hypervisor upon initialization, it does not have
  * to be in the hypervisor stolen memory, since once we enter the guest we
@@ -72,14 +113,24 @@ typedef struct virtdbg_args {
 
     // this is the end of the stolen memory, anything between the prev
     // variable to this can be used by the hypervisor for whatever
-    // dynamic memory it may need
+    // dynamic memory it may need, see VIRTDBG_HEAP_BASE_SIZE for
+    // how much it needs
     uint64_t stolen_memory_end;
 
     // the initial state of the guest that the virtdbg should create, this
     // should have a state for every initialized cpu, if the state is not
     // present virtdbg will assume that core has not been activated yet
-    uint8_t initial_guest_state_count;
+    uint64_t initial_guest_state_count;
     initial_guest_state_t* initial_guest_state;
+
+    // how to wake up the cpu of every initial guest state, the first
+    // entry belongs to the boot cpu and is ignored
+    virtdbg_ap_wakeup_t* ap_wakeup;
+
+    // the physical memory map of the machine, everything in it is
+    // mapped to the guest before it starts
+    uint64_t memmap_count;
+    virtdbg_memmap_entry_t* memmap;
 } __attribute__((packed)) virtdbg_args_t;
 
 #endif //__VIRTDBG_VIRTDBG_H__
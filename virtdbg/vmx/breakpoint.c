@@ -0,0 +1,385 @@
+#include <arch/idt.h>
+#include <mm/pmm.h>
+#include <sync/lock.h>
+#include <util/string.h>
+#include <vmx/ept.h>
+#include <vmx/guest_mem.h>
+#include <vmx/insn.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+
+#include "breakpoint.h"
+
+/**
+ * Both the breakpoints and their pages are kept in hash tables, so
+ * every exit is a single lookup
+ */
+#define BREAKPOINT_BUCKETS 256
+
+#define INT3 0xCC
+
+typedef struct breakpoint_page {
+    struct breakpoint_page* next;
+    uint64_t gpa;
+
+    // the copy the guest executes from, it has the int3s in it
+    uint8_t* shadow;
+
+    // the breakpoints on this page
+    struct breakpoint* breakpoints;
+} breakpoint_page_t;
+
+typedef struct breakpoint {
+    struct breakpoint* next;
+    struct breakpoint* page_next;
+    uint64_t gpa;
+    uint64_t address;
+} breakpoint_t;
+
+static lock_t m_breakpoint_lock = INIT_LOCK();
+static breakpoint_t* m_breakpoints[BREAKPOINT_BUCKETS];
+static breakpoint_page_t* m_pages[BREAKPOINT_BUCKETS];
+
+/**
+ * The pmm can't free, so removed entries are kept for reuse, the pages
+ * keep their shadow
+ */
+static breakpoint_t* m_free_breakpoints;
+static breakpoint_page_t* m_free_pages;
+
+static breakpoint_hit_handler_t m_hit_handler;
+
+static size_t address_bucket(uint64_t address) {
+    return (address ^ (address >> 12) ^ (address >> 24)) % BREAKPOINT_BUCKETS;
+}
+
+static breakpoint_t** find_breakpoint(uint64_t gpa) {
+    breakpoint_t** link = &m_breakpoints[address_bucket(gpa)];
+    while (*link != NULL && (*link)->gpa != gpa) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static breakpoint_page_t** find_page(uint64_t gpa) {
+    breakpoint_page_t** link = &m_pages[address_bucket(gpa)];
+    while (*link != NULL && (*link)->gpa != gpa) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * Copy part of the original page to the shadow and put the int3s in it back
+ */
+static void sync_shadow_range(breakpoint_page_t* page, size_t offset, size_t size) {
+    memcpy(page->shadow + offset, (void*)(page->gpa + offset), size);
+    for (breakpoint_t* breakpoint = page->breakpoints; breakpoint != NULL; breakpoint = breakpoint->page_next) {
+        size_t at = breakpoint->gpa & 0xFFF;
+        if (offset <= at && at < offset + size) {
+            page->shadow[at] = INT3;
+        }
+    }
+}
+
+static void sync_shadow(breakpoint_page_t* page) {
+    sync_shadow_range(page, 0, 0x1000);
+}
+
+/**
+ * Point the page at the shadow, and throw it away once it has no
+ * breakpoints, must hold the lock
+ */
+static err_t update_page(breakpoint_page_t** link) {
+    err_t err = NO_ERROR;
+    breakpoint_page_t* page = *link;
+
+    if (page->breakpoints != NULL) {
+        CHECK_AND_RETHROW(ept_claim_page(EPT_OWNER_BREAKPOINT, page->gpa, (uintptr_t)page->shadow, EPT_ACCESS_EXECUTE));
+    } else {
+        CHECK_AND_RETHROW(ept_claim_page(EPT_OWNER_BREAKPOINT, page->gpa, page->gpa, EPT_ACCESS_ALL));
+        *link = page->next;
+        page->next = m_free_pages;
+        m_free_pages = page;
+    }
+
+cleanup:
+    return err;
+}
+
+void breakpoint_set_hit_handler(breakpoint_hit_handler_t handler) {
+    m_hit_handler = handler;
+}
+
+err_t breakpoint_insert(uint64_t address, uint64_t gpa) {
+    err_t err = NO_ERROR;
+    lock(&m_breakpoint_lock);
+
+    // the int3 is only in the execute view, and we step over
+    // the accesses to the original
+    CHECK_ERROR(ept_execute_only_supported(), ERROR_UNSUPPORTED);
+    CHECK_ERROR(vcpu_single_step_supported(), ERROR_UNSUPPORTED);
+
+    breakpoint_t** breakpoint_link = find_breakpoint(gpa);
+    if (*breakpoint_link != NULL) {
+        goto cleanup;
+    }
+
+    breakpoint_t* breakpoint = m_free_breakpoints;
+    if (breakpoint != NULL) {
+        m_free_breakpoints = breakpoint->next;
+    } else {
+        breakpoint = palloc(sizeof(breakpoint_t));
+        CHECK_ERROR(breakpoint != NULL, ERROR_OUT_OF_RESOURCES);
+    }
+
+    breakpoint_page_t** page_link = find_page(gpa & ~0xFFFull);
+    if (*page_link == NULL) {
+        breakpoint_page_t* page = m_free_pages;
+        if (page != NULL) {
+            m_free_pages = page->next;
+        } else {
+            page = palloc(sizeof(breakpoint_page_t));
+            CHECK_ERROR(page != NULL, ERROR_OUT_OF_RESOURCES);
+            page->shadow = palloc_aligned(0x1000, 0x1000);
+            CHECK_ERROR(page->shadow != NULL, ERROR_OUT_OF_RESOURCES);
+        }
+
+        page->next = NULL;
+        page->gpa = gpa & ~0xFFFull;
+        page->breakpoints = NULL;
+        *page_link = page;
+    }
+    breakpoint_page_t* page = *page_link;
+
+    *breakpoint = (breakpoint_t){
+        .next = NULL,
+        .page_next = page->breakpoints,
+        .gpa = gpa,
+        .address = address,
+    };
+    *breakpoint_link = breakpoint;
+    page->breakpoints = breakpoint;
+
+    sync_shadow(page);
+    CHECK_AND_RETHROW(update_page(page_link));
+
+cleanup:
+    unlock(&m_breakpoint_lock);
+    return err;
+}
+
+err_t breakpoint_remove(uint64_t gpa) {
+    err_t err = NO_ERROR;
+    lock(&m_breakpoint_lock);
+
+    breakpoint_t** breakpoint_link = find_breakpoint(gpa);
+    breakpoint_t* breakpoint = *breakpoint_link;
+    CHECK_ERROR(breakpoint != NULL, ERROR_NOT_FOUND);
+    *breakpoint_link = breakpoint->next;
+
+    breakpoint_page_t** page_link = find_page(gpa & ~0xFFFull);
+    breakpoint_page_t* page = *page_link;
+    for (breakpoint_t** link = &page->breakpoints; *link != NULL; link = &(*link)->page_next) {
+        if (*link == breakpoint) {
+            *link = breakpoint->page_next;
+            break;
+        }
+    }
+
+    breakpoint->next = m_free_breakpoints;
+    m_free_breakpoints = breakpoint;
+
+    sync_shadow(page);
+    CHECK_AND_RETHROW(update_page(page_link));
+
+cleanup:
+    unlock(&m_breakpoint_lock);
+    return err;
+}
+
+void breakpoint_sync_page(uint64_t gpa) {
+    lock(&m_breakpoint_lock);
+
+    breakpoint_page_t* page = *find_page(gpa & ~0xFFFull);
+    if (page != NULL) {
+        sync_shadow(page);
+    }
+
+    unlock(&m_breakpoint_lock);
+}
+
+static vmexit_action_t breakpoint_step_done(vcpu_t* vcpu);
+
+/**
+ * Let the vcpu see the original pages for a single instruction, the other
+ * vcpus keep running from the shadow. The bytes it writes, if any, are
+ * copied to the shadow once it is done. Must hold the lock.
+ */
+static err_t step_over_page(vcpu_t* vcpu, uint64_t write_gpa, size_t write_size) {
+    err_t err = NO_ERROR;
+
+    if (write_size != 0) {
+        CHECK_ERROR(vcpu->breakpoints.write_count < BREAKPOINT_MAX_STEPS, ERROR_OUT_OF_RESOURCES);
+        vcpu->breakpoints.writes[vcpu->breakpoints.write_count++] = (breakpoint_write_t){
+            .gpa = write_gpa,
+            .size = write_size,
+        };
+    }
+    CHECK_AND_RETHROW(ept_step_unrestricted(vcpu));
+    CHECK_AND_RETHROW(vcpu_single_step(vcpu, breakpoint_step_done));
+
+cleanup:
+    return err;
+}
+
+/**
+ * Copy what the guest wrote to the original to the shadows, the write may
+ * have gone past the end of the page it faulted on
+ */
+static vmexit_action_t breakpoint_step_done(vcpu_t* vcpu) {
+    lock(&m_breakpoint_lock);
+
+    for (size_t i = 0; i < vcpu->breakpoints.write_count; i++) {
+        uint64_t address = vcpu->breakpoints.writes[i].gpa;
+        uint64_t end = address + vcpu->breakpoints.writes[i].size;
+        while (address < end) {
+            size_t chunk = MIN(end - address, 0x1000 - (address & 0xFFF));
+            breakpoint_page_t* page = *find_page(address & ~0xFFFull);
+            if (page != NULL) {
+                sync_shadow_range(page, address & 0xFFF, chunk);
+            }
+            address += chunk;
+        }
+    }
+    vcpu->breakpoints.write_count = 0;
+
+    unlock(&m_breakpoint_lock);
+    return VMEXIT_RESUME;
+}
+
+/**
+ * A read or write of a page with breakpoints, the execute view is not readable
+ * so the access is done on the original page
+ */
+static bool handle_breakpoint_access(vcpu_t* vcpu, uint64_t gpa, uint64_t qualification, vmexit_action_t* action) {
+    err_t err = NO_ERROR;
+    bool handled = false;
+    lock(&m_breakpoint_lock);
+
+    breakpoint_page_t** link = find_page(gpa & ~0xFFFull);
+    if (*link == NULL) {
+        goto cleanup;
+    }
+    handled = true;
+
+    // a stale execute view, the violation already flushed it
+    if (!(qualification & (EPT_VIOLATION_READ | EPT_VIOLATION_WRITE))) {
+        goto cleanup;
+    }
+
+    // a read leaves the shadow as it is, a write of an unknown size
+    // copies the whole page
+    uint64_t write_gpa = 0;
+    size_t write_size = 0;
+    if (qualification & EPT_VIOLATION_WRITE) {
+        write_gpa = gpa;
+        write_size = insn_access_size(vcpu);
+        if (write_size == 0) {
+            write_gpa = (*link)->gpa;
+            write_size = 0x1000;
+        }
+    }
+
+    CHECK_AND_RETHROW(step_over_page(vcpu, write_gpa, write_size));
+
+cleanup:
+    unlock(&m_breakpoint_lock);
+    ASSERT(!IS_ERROR(err), "Failed to step over a breakpoint page");
+
+    *action = VMEXIT_RESUME;
+    return handled;
+}
+
+/**
+ * Give the guest back an int3 that is not ours
+ */
+static void reinject_breakpoint(vcpu_t* vcpu) {
+    vmx_interruption_info_t info = {
+        .vector = EXCEPT_BREAKPOINT,
+        .type = VMX_INTERRUPTION_TYPE_SOFTWARE_EXCEPTION,
+        .valid = 1,
+    };
+    vmwrite(VMCS_FIELD_VM_ENTRY_INTR_INFO, info.raw);
+    vmwrite(VMCS_FIELD_VM_ENTRY_INSTRUCTION_LEN, vmexit_instruction_len(&vcpu->exit));
+}
+
+/**
+ * Run the original instruction under the int3 from the original page, if
+ * the breakpoint is still there. Any write it does to a breakpoint page
+ * is not seen by the shadow, that only matters for code that patches
+ * itself right where the breakpoint is.
+ */
+static err_t step_over_breakpoint(vcpu_t* vcpu, uint64_t cr3) {
+    err_t err = NO_ERROR;
+    lock(&m_breakpoint_lock);
+
+    uintptr_t gpa;
+    if (!guest_translate(cr3, guest_rip(&vcpu->exit), &gpa)) {
+        goto cleanup;
+    }
+
+    if (*find_page(gpa & ~0xFFFull) != NULL && *find_breakpoint(gpa) != NULL) {
+        CHECK_AND_RETHROW(step_over_page(vcpu, 0, 0));
+    }
+
+cleanup:
+    unlock(&m_breakpoint_lock);
+    return err;
+}
+
+/**
+ * The guest ran an int3, report it if it is one of ours and then run the
+ * original instruction from the original page
+ */
+static vmexit_action_t handle_breakpoint_exception(vcpu_t* vcpu) {
+    uint64_t cr3 = vmread(VMCS_FIELD_GUEST_CR3);
+
+    uintptr_t gpa;
+    uint64_t address = 0;
+    bool ours = false;
+    if (guest_translate(cr3, guest_rip(&vcpu->exit), &gpa)) {
+        lock(&m_breakpoint_lock);
+        breakpoint_t* breakpoint = *find_breakpoint(gpa);
+        if (breakpoint != NULL) {
+            address = breakpoint->address;
+            ours = true;
+        }
+        unlock(&m_breakpoint_lock);
+    }
+
+    if (!ours) {
+        reinject_breakpoint(vcpu);
+        return VMEXIT_RESUME;
+    }
+
+    if (m_hit_handler != NULL) {
+        m_hit_handler(vcpu, address);
+    }
+
+    // the debugger may have moved the guest or removed the breakpoint
+    err_t err = step_over_breakpoint(vcpu, cr3);
+    ASSERT(!IS_ERROR(err), "Failed to step over a breakpoint");
+
+    return VMEXIT_RESUME;
+}
+
+err_t init_breakpoints() {
+    err_t err = NO_ERROR;
+
+    CHECK_AND_RETHROW(ept_register_access_handler(handle_breakpoint_access));
+    CHECK_AND_RETHROW(vmexit_register_exception_handler(EXCEPT_BREAKPOINT, handle_breakpoint_exception));
+
+cleanup:
+    return err;
+}
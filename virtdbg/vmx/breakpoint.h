@@ -0,0 +1,66 @@
+#ifndef __VIRTDBG_BREAKPOINT_H__
+#define __VIRTDBG_BREAKPOINT_H__
+
+#include <util/except.h>
+#include <stdint.h>
+
+struct vcpu;
+
+/**
+ * The most breakpoint pages a single instruction can touch
+ */
+#define BREAKPOINT_MAX_STEPS 4
+
+/**
+ * The bytes of a breakpoint page the vcpu writes in its step
+ */
+typedef struct breakpoint_write {
+    uint64_t gpa;
+    uint32_t size;
+} breakpoint_write_t;
+
+/**
+ * The per-vcpu breakpoint state
+ */
+typedef struct breakpoint_vcpu {
+    breakpoint_write_t writes[BREAKPOINT_MAX_STEPS];
+    uint8_t write_count;
+} breakpoint_vcpu_t;
+
+/**
+ * Called when the guest is about to run an instruction with a breakpoint,
+ * the instruction runs once this returns
+ */
+typedef void (*breakpoint_hit_handler_t)(struct vcpu* vcpu, uint64_t address);
+
+/**
+ * Register the ept access handler and the #BP handler of the breakpoints
+ */
+err_t init_breakpoints();
+
+/**
+ * Set who gets the breakpoint hits
+ */
+void breakpoint_set_hit_handler(breakpoint_hit_handler_t handler);
+
+/**
+ * Put a breakpoint on the instruction at the guest physical address, the
+ * address is what gets reported on a hit.
+ *
+ * The guest never sees the int3, the page is split to an execute-only view
+ * that has the int3 in it and the original for reads and writes.
+ */
+err_t breakpoint_insert(uint64_t address, uint64_t gpa);
+
+/**
+ * Remove the breakpoint at the guest physical address
+ */
+err_t breakpoint_remove(uint64_t gpa);
+
+/**
+ * The original page was written from outside of the guest, copy it
+ * to the execute view again
+ */
+void breakpoint_sync_page(uint64_t gpa);
+
+#endif //__VIRTDBG_BREAKPOINT_H__
@@ -0,0 +1,155 @@
+#include <arch/intrin.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+
+#include "cpuid.h"
+
+#define CPUID_MAX_MASKS 32
+
+typedef struct cpuid_mask_entry {
+    uint32_t leaf;
+    uint32_t subleaf;
+    cpuid_reg_t reg;
+    uint32_t bits;
+} cpuid_mask_entry_t;
+
+static cpuid_mask_entry_t m_masks[CPUID_MAX_MASKS];
+static size_t m_mask_count = 0;
+
+static bool is_indexed_leaf(uint32_t leaf) {
+    switch (leaf) {
+        case 0x4:
+        case 0x7:
+        case 0xB:
+        case 0xD:
+        case 0xF:
+        case 0x10:
+        case 0x12:
+        case 0x14:
+        case 0x17:
+        case 0x18:
+        case 0x1B:
+        case 0x1D:
+        case 0x1F:
+        case 0x8000001D:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * Leaves with bits that follow the state of the guest, these always take
+ * the slow path:
+ *  - 0x1 has OSXSAVE from CR4 and the APIC enable from IA32_APIC_BASE
+ *  - 0x7 has OSPKE from CR4
+ *  - 0xD has the xsave area size of the features enabled in XCR0
+ */
+static bool is_guest_dependent_leaf(uint32_t leaf) {
+    return leaf == 0x1 || leaf == 0x7 || leaf == 0xD;
+}
+
+static void apply_masks(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    bool indexed = is_indexed_leaf(leaf);
+    for (size_t i = 0; i < m_mask_count; i++) {
+        cpuid_mask_entry_t* mask = &m_masks[i];
+        if (mask->leaf == leaf && (!indexed || mask->subleaf == subleaf)) {
+            regs[mask->reg] &= ~mask->bits;
+        }
+    }
+}
+
+err_t cpuid_mask(uint32_t leaf, uint32_t subleaf, cpuid_reg_t reg, uint32_t bits) {
+    err_t err = NO_ERROR;
+
+    CHECK(reg <= CPUID_EDX);
+    CHECK_ERROR(m_mask_count < CPUID_MAX_MASKS, ERROR_OUT_OF_RESOURCES);
+    m_masks[m_mask_count++] = (cpuid_mask_entry_t){
+        .leaf = leaf,
+        .subleaf = subleaf,
+        .reg = reg,
+        .bits = bits,
+    };
+
+cleanup:
+    return err;
+}
+
+static vmexit_action_t handle_cpuid(vcpu_t* vcpu);
+
+err_t init_cpuid() {
+    err_t err = NO_ERROR;
+
+    // we don't support nested virtualization
+    CHECK_AND_RETHROW(cpuid_mask(0x1, 0, CPUID_ECX, (1u << 5) | (1u << 6)));
+
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_CPUID, handle_cpuid));
+
+cleanup:
+    return err;
+}
+
+static void fill_range(vcpu_t* vcpu, size_t index, uint32_t base, uint32_t count) {
+    uint32_t regs[4];
+    __cpuid(base, 0, regs);
+    if (regs[0] < base) {
+        // the range is not supported at all
+        return;
+    }
+
+    uint32_t max = regs[0] - base + 1;
+    if (max > count) {
+        max = count;
+    }
+
+    for (uint32_t i = 0; i < max; i++) {
+        uint32_t leaf = base + i;
+        cpuid_entry_t* entry = &vcpu->cpuid[index + i];
+        if (is_guest_dependent_leaf(leaf)) {
+            continue;
+        }
+
+        // indexed leaves cache their first subleaf
+        __cpuid(leaf, 0, entry->regs);
+        apply_masks(leaf, 0, entry->regs);
+        entry->subleaf = 0;
+        entry->flags = CPUID_ENTRY_PRESENT;
+        if (is_indexed_leaf(leaf)) {
+            entry->flags |= CPUID_ENTRY_INDEXED;
+        }
+    }
+}
+
+void init_vcpu_cpuid(vcpu_t* vcpu) {
+    fill_range(vcpu, 0, 0, CPUID_BASIC_COUNT);
+    fill_range(vcpu, CPUID_BASIC_COUNT, CPUID_EXTENDED_BASE, CPUID_EXTENDED_COUNT);
+}
+
+/**
+ * The cpuid exits the fast path could not serve from the table
+ */
+static vmexit_action_t handle_cpuid(vcpu_t* vcpu) {
+    uint32_t leaf = vcpu->guest.rax;
+    uint32_t subleaf = vcpu->guest.rcx;
+
+    uint32_t regs[4];
+    __cpuid(leaf, subleaf, regs);
+    apply_masks(leaf, subleaf, regs);
+
+    // the cpu reports the bits of our CR4, not the guest's, XCR0 and
+    // IA32_APIC_BASE are never switched so those are right already
+    ia32_cr4_t cr4 = { .raw = vmread(VMCS_FIELD_GUEST_CR4) };
+    if (leaf == 0x1) {
+        regs[CPUID_ECX] = (regs[CPUID_ECX] & ~(1u << 27)) | (cr4.OSXSAVE << 27);
+    } else if (leaf == 0x7 && subleaf == 0) {
+        regs[CPUID_ECX] = (regs[CPUID_ECX] & ~(1u << 4)) | (cr4.PKE << 4);
+    }
+
+    vcpu->guest.rax = regs[CPUID_EAX];
+    vcpu->guest.rbx = regs[CPUID_EBX];
+    vcpu->guest.rcx = regs[CPUID_ECX];
+    vcpu->guest.rdx = regs[CPUID_EDX];
+
+    return VMEXIT_ADVANCE;
+}
@@ -0,0 +1,66 @@
+#ifndef __VIRTDBG_CPUID_H__
+#define __VIRTDBG_CPUID_H__
+
+#include <util/except.h>
+#include <stdint.h>
+
+struct vcpu;
+
+/**
+ * The leaves cached per vcpu, the basic leaves 0x0-0x1F followed by
+ * the extended leaves 0x80000000-0x8000001F
+ */
+#define CPUID_BASIC_COUNT       32
+#define CPUID_EXTENDED_BASE     0x80000000
+#define CPUID_EXTENDED_COUNT    32
+#define CPUID_ENTRY_COUNT       (CPUID_BASIC_COUNT + CPUID_EXTENDED_COUNT)
+
+/**
+ * The entry holds the response of the leaf
+ */
+#define CPUID_ENTRY_PRESENT     (1u << 0)
+
+/**
+ * The leaf has subleaves, the entry only holds the response for the
+ * subleaf in it and any other subleaf goes to the slow path
+ */
+#define CPUID_ENTRY_INDEXED     (1u << 1)
+
+typedef enum cpuid_reg {
+    CPUID_EAX,
+    CPUID_EBX,
+    CPUID_ECX,
+    CPUID_EDX,
+} cpuid_reg_t;
+
+/**
+ * A precomputed cpuid response, the layout is used by the fast
+ * path in vmx.asm
+ */
+typedef struct cpuid_entry {
+    uint32_t regs[4];
+    uint32_t flags;
+    uint32_t subleaf;
+    uint64_t _reserved;
+} cpuid_entry_t;
+_Static_assert(sizeof(cpuid_entry_t) == 32, "the fast path expects 32 byte entries");
+
+/**
+ * Setup the default feature masks, these hide the features the hypervisor
+ * can not give to the guest, and register the cpuid exit handler
+ */
+err_t init_cpuid();
+
+/**
+ * Clear the given bits from a cpuid register as seen by the guest, only
+ * affects the vcpus that are initialized from now on
+ */
+err_t cpuid_mask(uint32_t leaf, uint32_t subleaf, cpuid_reg_t reg, uint32_t bits);
+
+/**
+ * Build the cpuid table of the vcpu, must run on the cpu of the vcpu
+ * since some leaves are different between cpus
+ */
+void init_vcpu_cpuid(struct vcpu* vcpu);
+
+#endif //__VIRTDBG_CPUID_H__
@@ -0,0 +1,221 @@
+#include <arch/intrin.h>
+#include <arch/msr.h>
+#include <mm/pmm.h>
+#include <sync/lock.h>
+#include <util/defs.h>
+#include <vmx/ept.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+#include <vmx/vmm.h>
+
+#include "dirty.h"
+
+/**
+ * A bit for every 4KB page of the memory map
+ */
+static _Atomic(uint64_t)* m_bitmap;
+static size_t m_bitmap_words;
+static size_t m_page_count;
+
+static lock_t m_dirty_lock = INIT_LOCK();
+static atomic_bool m_running = false;
+
+static vmexit_action_t handle_log_full(vcpu_t* vcpu);
+
+err_t init_dirty(virtdbg_memmap_entry_t* entries, size_t count) {
+    uintptr_t top = 0;
+    for (size_t i = 0; i < count; i++) {
+        top = MAX(top, entries[i].base + entries[i].length);
+    }
+    m_page_count = ALIGN_UP(top, 0x1000) / 0x1000;
+    m_bitmap_words = ALIGN_UP(m_page_count, 64) / 64;
+
+    return vmexit_register_handler(VMEXIT_REASON_PML_FULL, handle_log_full);
+}
+
+/**
+ * Tell all the vcpus to apply the state on their next exit
+ */
+static void set_pending() {
+    for (size_t i = 0; i < g_vcpu_count; i++) {
+        vcpu_t* vcpu = g_vcpus[i];
+        if (vcpu != NULL) {
+            atomic_store_explicit(&vcpu->dirty.pending, true, memory_order_release);
+            vcpu_set_exit_work(vcpu);
+        }
+    }
+}
+
+err_t dirty_start() {
+    err_t err = NO_ERROR;
+    lock(&m_dirty_lock);
+
+    if (atomic_load_explicit(&m_running, memory_order_relaxed)) {
+        goto cleanup;
+    }
+
+    uint64_t allowed_procbased_ctls2 = __rdmsr(MSR_IA32_VMX_PROCBASED_CTLS2);
+    CHECK_ERROR(((vmx_procbased_ctls2_t){ .raw = allowed_procbased_ctls2 >> 32 }).enable_pml, ERROR_UNSUPPORTED);
+
+    if (m_bitmap == NULL) {
+        m_bitmap = pallocz(m_bitmap_words * sizeof(uint64_t));
+        CHECK_ERROR(m_bitmap != NULL, ERROR_OUT_OF_RESOURCES);
+    }
+
+    for (size_t i = 0; i < g_vcpu_count; i++) {
+        vcpu_t* vcpu = g_vcpus[i];
+        if (vcpu != NULL && vcpu->dirty.log == NULL) {
+            vcpu->dirty.log = pallocz_aligned(0x1000, 0x1000);
+            CHECK_ERROR(vcpu->dirty.log != NULL, ERROR_OUT_OF_RESOURCES);
+        }
+    }
+
+    // the cpu logs a page when it sets its dirty bit, so they must be on
+    // before any vcpu turns the log on
+    CHECK_AND_RETHROW(ept_enable_accessed_dirty());
+    ept_clear_dirty();
+
+    atomic_store_explicit(&m_running, true, memory_order_release);
+    set_pending();
+
+    TRACE("dirty: logging %lu pages", m_page_count);
+
+cleanup:
+    unlock(&m_dirty_lock);
+    return err;
+}
+
+void dirty_stop() {
+    lock(&m_dirty_lock);
+
+    if (atomic_load_explicit(&m_running, memory_order_relaxed)) {
+        // a vcpu that sees the eptp without the dirty bits also sees
+        // that it has to turn the log off
+        atomic_store_explicit(&m_running, false, memory_order_release);
+        set_pending();
+        ept_disable_accessed_dirty();
+    }
+
+    unlock(&m_dirty_lock);
+}
+
+/**
+ * Set the bits of all the pages in the range
+ */
+static void mark_dirty(uintptr_t gpa, uint64_t size) {
+    size_t page = gpa / 0x1000;
+    size_t end = MIN(page + size / 0x1000, m_page_count);
+
+    while (page < end) {
+        if ((page % 64) == 0 && end - page >= 64) {
+            atomic_store_explicit(&m_bitmap[page / 64], UINT64_MAX, memory_order_relaxed);
+            page += 64;
+        } else {
+            atomic_fetch_or_explicit(&m_bitmap[page / 64], 1ull << (page % 64), memory_order_relaxed);
+            page++;
+        }
+    }
+}
+
+/**
+ * Move the logged pages to the dirty set and empty the log, must
+ * run on the vcpu itself
+ */
+static void drain_log(vcpu_t* vcpu) {
+    uint64_t* log = vcpu->dirty.log;
+
+    // the index is the next free entry, it wraps around once the log is full
+    uint16_t index = vmread(VMCS_FIELD_GUEST_PML_INDEX);
+    size_t first = index < DIRTY_LOG_ENTRIES ? index + 1 : 0;
+
+    for (size_t i = first; i < DIRTY_LOG_ENTRIES; i++) {
+        // the dirty bit of a large page is only set by the first write
+        // to it, so all of it has to be treated as dirty
+        uint64_t size = ept_leaf_size(log[i]);
+        mark_dirty(log[i] & ~(size - 1), size);
+    }
+
+    vmwrite(VMCS_FIELD_GUEST_PML_INDEX, DIRTY_LOG_ENTRIES - 1);
+}
+
+void dirty_apply(vcpu_t* vcpu) {
+    atomic_store_explicit(&vcpu->dirty.pending, false, memory_order_relaxed);
+
+    vmx_procbased_ctls2_t procbased_ctls2 = { .raw = vmread(VMCS_FIELD_PROCBASED_CTLS2) };
+    if (procbased_ctls2.enable_pml) {
+        drain_log(vcpu);
+    }
+
+    bool enable = atomic_load_explicit(&m_running, memory_order_acquire);
+    if (enable == procbased_ctls2.enable_pml) {
+        return;
+    }
+
+    // the log can only be on with the dirty bits in the eptp, which the
+    // vcpu gets once it syncs the ept, try again on the next exit
+    if (enable && !(vmread(VMCS_FIELD_EPT_POINTER_FULL) & EPT_ACCESSED_DIRTY)) {
+        atomic_store_explicit(&vcpu->dirty.pending, true, memory_order_relaxed);
+        vcpu_set_exit_work(vcpu);
+        return;
+    }
+
+    if (enable) {
+        vmwrite(VMCS_FIELD_PML_ADDRESS_FULL, (uintptr_t)vcpu->dirty.log);
+        vmwrite(VMCS_FIELD_GUEST_PML_INDEX, DIRTY_LOG_ENTRIES - 1);
+    }
+
+    procbased_ctls2.enable_pml = enable;
+    vmwrite(VMCS_FIELD_PROCBASED_CTLS2, procbased_ctls2.raw);
+}
+
+size_t dirty_fetch_and_clear(void (*visitor)(uintptr_t gpa, size_t pages, void* ctx), void* ctx) {
+    size_t total = 0;
+    lock(&m_dirty_lock);
+
+    if (m_bitmap == NULL) {
+        goto cleanup;
+    }
+
+    // the next write to every page is logged from now on, so anything
+    // that gets logged after this shows up in the next fetch
+    ept_clear_dirty();
+    if (atomic_load_explicit(&m_running, memory_order_relaxed)) {
+        set_pending();
+    }
+
+    size_t run_start = 0;
+    size_t run_length = 0;
+    for (size_t i = 0; i < m_bitmap_words; i++) {
+        uint64_t word = atomic_exchange_explicit(&m_bitmap[i], 0, memory_order_relaxed);
+        for (size_t bit = 0; bit < 64; bit++) {
+            size_t page = i * 64 + bit;
+            if (word & (1ull << bit)) {
+                if (run_length == 0) {
+                    run_start = page;
+                }
+                run_length++;
+                total++;
+            } else if (run_length != 0) {
+                visitor(run_start * 0x1000, run_length, ctx);
+                run_length = 0;
+            }
+        }
+    }
+
+    if (run_length != 0) {
+        visitor(run_start * 0x1000, run_length, ctx);
+    }
+
+cleanup:
+    unlock(&m_dirty_lock);
+    return total;
+}
+
+/**
+ * The log is full, the write that caused the exit is logged
+ * again once the guest retries it
+ */
+static vmexit_action_t handle_log_full(vcpu_t* vcpu) {
+    drain_log(vcpu);
+    return VMEXIT_RESUME;
+}
@@ -0,0 +1,60 @@
+#ifndef __VIRTDBG_DIRTY_H__
+#define __VIRTDBG_DIRTY_H__
+
+#include <util/except.h>
+#include <virtdbg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+struct vcpu;
+
+/**
+ * The amount of entries in the page modification log of every vcpu,
+ * the cpu fills it from the last entry down
+ */
+#define DIRTY_LOG_ENTRIES 512
+
+/**
+ * The per-vcpu dirty logging state
+ */
+typedef struct dirty_vcpu {
+    // the page modification log, allocated on the first start
+    uint64_t* log;
+
+    // logging was started or stopped, or someone wants the log
+    // drained, applied by the vcpu itself on its next exit
+    atomic_bool pending;
+} dirty_vcpu_t;
+
+/**
+ * Size the dirty bitmap to cover all of the memory map and register
+ * the log full exit handler
+ */
+err_t init_dirty(virtdbg_memmap_entry_t* entries, size_t count);
+
+/**
+ * Start logging the pages the guest writes on all the vcpus, every vcpu
+ * only exits once for every DIRTY_LOG_ENTRIES newly dirty pages
+ */
+err_t dirty_start();
+
+/**
+ * Stop logging, the dirty set is kept until it is fetched
+ */
+void dirty_stop();
+
+/**
+ * Give all the runs of dirty pages to the visitor and clear them, the next
+ * write to every page is logged again. The vcpus are asked to drain their
+ * logs, whatever they logged since their last exit shows up in the
+ * next fetch. Returns the amount of dirty pages.
+ */
+size_t dirty_fetch_and_clear(void (*visitor)(uintptr_t gpa, size_t pages, void* ctx), void* ctx);
+
+/**
+ * Drain the log to the dirty set and apply a start or stop, must run
+ * on the vcpu itself
+ */
+void dirty_apply(struct vcpu* vcpu);
+
+#endif //__VIRTDBG_DIRTY_H__
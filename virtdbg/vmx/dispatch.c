@@ -0,0 +1,150 @@
+#include <vmx/vcpu.h>
+#include <arch/intrin.h>
+#include <arch/msr.h>
+
+#include "dispatch.h"
+
+/**
+ * The handlers registered by the subsystems, every vcpu starts
+ * with a copy of this
+ */
+static vmexit_handler_t m_vmexit_handlers[VMEXIT_REASONS_MAX];
+
+/**
+ * The handlers of the guest exceptions, only the exceptions 0-31 can
+ * be in the exception bitmap
+ */
+#define VMEXIT_EXCEPTIONS_MAX 32
+
+static vmexit_handler_t m_exception_handlers[VMEXIT_EXCEPTIONS_MAX];
+
+static vmexit_action_t handle_unregistered_exit(vcpu_t* vcpu) {
+    vmx_vmexit_reason_t reason = vmexit_reason(&vcpu->exit);
+    ASSERT(0, "Unhandled vmexit: %s (0x%04x)", vmexit_reason_str(reason.exit_reason), reason.exit_reason);
+    return VMEXIT_RESUME;
+}
+
+err_t vmexit_register_handler(uint16_t reason, vmexit_handler_t handler) {
+    err_t err = NO_ERROR;
+
+    CHECK(reason < VMEXIT_REASONS_MAX);
+    CHECK(handler != NULL);
+    CHECK(m_vmexit_handlers[reason] == NULL, "%s already has a handler", vmexit_reason_str(reason));
+    m_vmexit_handlers[reason] = handler;
+
+cleanup:
+    return err;
+}
+
+err_t vmexit_register_exception_handler(uint8_t vector, vmexit_handler_t handler) {
+    err_t err = NO_ERROR;
+
+    CHECK(vector < VMEXIT_EXCEPTIONS_MAX);
+    CHECK(handler != NULL);
+    CHECK(m_exception_handlers[vector] == NULL, "exception %d already has a handler", vector);
+    m_exception_handlers[vector] = handler;
+
+cleanup:
+    return err;
+}
+
+uint32_t vmexit_exception_bitmap() {
+    uint32_t bitmap = 0;
+    for (int vector = 0; vector < VMEXIT_EXCEPTIONS_MAX; vector++) {
+        if (m_exception_handlers[vector] != NULL) {
+            bitmap |= 1u << vector;
+        }
+    }
+    return bitmap;
+}
+
+vmexit_action_t vmexit_dispatch_exception(vcpu_t* vcpu, uint8_t vector) {
+    ASSERT(vector < VMEXIT_EXCEPTIONS_MAX && m_exception_handlers[vector] != NULL,
+           "Unhandled guest exception %d", vector);
+    return m_exception_handlers[vector](vcpu);
+}
+
+void init_vcpu_dispatch(vcpu_t* vcpu) {
+    for (int reason = 0; reason < VMEXIT_REASONS_MAX; reason++) {
+        vcpu_set_exit_handler(vcpu, reason, NULL);
+    }
+}
+
+err_t vcpu_set_exit_handler(vcpu_t* vcpu, uint16_t reason, vmexit_handler_t handler) {
+    err_t err = NO_ERROR;
+
+    CHECK(reason < VMEXIT_REASONS_MAX);
+
+    if (handler == NULL) {
+        handler = m_vmexit_handlers[reason];
+    }
+    if (handler == NULL) {
+        handler = handle_unregistered_exit;
+    }
+    vcpu->exit_handlers[reason] = handler;
+
+cleanup:
+    return err;
+}
+
+void vmexit_dispatch(vcpu_t* vcpu, uint16_t reason) {
+    ASSERT(reason < VMEXIT_REASONS_MAX, "unknown vmexit: 0x%04x", reason);
+
+    if (vcpu->exit_handlers[reason](vcpu) == VMEXIT_ADVANCE) {
+        vmexit_skip_instruction(&vcpu->exit);
+    }
+}
+
+bool vcpu_single_step_supported() {
+    uint64_t allowed_procbased_ctls = __rdmsr(MSR_IA32_VMX_PROCBASED_CTLS);
+    return ((vmx_procbased_ctls_t){ .raw = allowed_procbased_ctls >> 32 }).monitor_trap_flag;
+}
+
+static void set_monitor_trap_flag(bool enable) {
+    vmx_procbased_ctls_t procbased_ctls = { .raw = vmread(VMCS_FIELD_PROCBASED_CTLS) };
+    procbased_ctls.monitor_trap_flag = enable;
+    vmwrite(VMCS_FIELD_PROCBASED_CTLS, procbased_ctls.raw);
+}
+
+/**
+ * The guest did its single instruction, call everyone that waited for it,
+ * they may ask for another step
+ */
+static vmexit_action_t handle_single_step(vcpu_t* vcpu) {
+    vmexit_handler_t handlers[VMEXIT_MAX_STEP_HANDLERS];
+    size_t count = vcpu->step_handler_count;
+    for (size_t i = 0; i < count; i++) {
+        handlers[i] = vcpu->step_handlers[i];
+    }
+
+    vcpu->step_handler_count = 0;
+    set_monitor_trap_flag(false);
+    vcpu_set_exit_handler(vcpu, VMEXIT_REASON_MONITOR_TRAP_FLAG, NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        handlers[i](vcpu);
+    }
+
+    return VMEXIT_RESUME;
+}
+
+err_t vcpu_single_step(vcpu_t* vcpu, vmexit_handler_t handler) {
+    err_t err = NO_ERROR;
+
+    for (size_t i = 0; i < vcpu->step_handler_count; i++) {
+        if (vcpu->step_handlers[i] == handler) {
+            goto cleanup;
+        }
+    }
+
+    CHECK_ERROR(vcpu->step_handler_count < VMEXIT_MAX_STEP_HANDLERS, ERROR_OUT_OF_RESOURCES);
+    if (vcpu->step_handler_count == 0) {
+        CHECK_ERROR(vcpu_single_step_supported(), ERROR_UNSUPPORTED);
+        CHECK_AND_RETHROW(vcpu_set_exit_handler(vcpu, VMEXIT_REASON_MONITOR_TRAP_FLAG, handle_single_step));
+        set_monitor_trap_flag(true);
+    }
+    vcpu->step_handlers[vcpu->step_handler_count++] = handler;
+
+cleanup:
+    return err;
+}
@@ -0,0 +1,80 @@
+#ifndef __VIRTDBG_DISPATCH_H__
+#define __VIRTDBG_DISPATCH_H__
+
+#include <util/except.h>
+#include <vmx/vmm.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct vcpu;
+
+/**
+ * What to do with the guest once the handler returns
+ */
+typedef enum vmexit_action {
+    // resume the guest at the same instruction
+    VMEXIT_RESUME,
+
+    // the instruction was emulated, resume after it
+    VMEXIT_ADVANCE,
+} vmexit_action_t;
+
+typedef vmexit_action_t (*vmexit_handler_t)(struct vcpu* vcpu);
+
+/**
+ * The most handlers that can wait for the same single step
+ */
+#define VMEXIT_MAX_STEP_HANDLERS 4
+
+/**
+ * Register the handler of an exit reason on every vcpu that is initialized
+ * from now on, every reason can only have a single handler
+ */
+err_t vmexit_register_handler(uint16_t reason, vmexit_handler_t handler);
+
+/**
+ * Register the handler of a guest exception, the exception will cause an
+ * exit on every vcpu that is initialized from now on
+ */
+err_t vmexit_register_exception_handler(uint8_t vector, vmexit_handler_t handler);
+
+/**
+ * The exceptions that have a handler, for the exception bitmap
+ */
+uint32_t vmexit_exception_bitmap();
+
+/**
+ * Call the handler of the exception that caused the exit
+ */
+vmexit_action_t vmexit_dispatch_exception(struct vcpu* vcpu, uint8_t vector);
+
+/**
+ * Copy the registered handlers to the vcpu
+ */
+void init_vcpu_dispatch(struct vcpu* vcpu);
+
+/**
+ * Override the handler of an exit reason only on the given vcpu, passing
+ * NULL goes back to the registered handler
+ */
+err_t vcpu_set_exit_handler(struct vcpu* vcpu, uint16_t reason, vmexit_handler_t handler);
+
+/**
+ * Call the handler of the exit reason, and move the guest past the
+ * instruction if the handler asked for it
+ */
+void vmexit_dispatch(struct vcpu* vcpu, uint16_t reason);
+
+/**
+ * Check if the cpu has the monitor trap flag for single stepping the guest
+ */
+bool vcpu_single_step_supported();
+
+/**
+ * Let the guest run a single instruction and call the handler on the exit
+ * right after it, must run on the vcpu itself. Different users can ask for
+ * the same step, each handler is called once.
+ */
+err_t vcpu_single_step(struct vcpu* vcpu, vmexit_handler_t handler);
+
+#endif //__VIRTDBG_DISPATCH_H__
@@ -1,9 +1,19 @@
 #include <sync/lock.h>
 #include <mm/pmm.h>
+#include <arch/intrin.h>
+#include <arch/msr.h>
+#include <arch/cpu.h>
+#include <arch/idt.h>
+#include <util/defs.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+#include <vmx/mem_type.h>
 #include "ept.h"
 
 /**
- * The lock of the ept
+ * The lock of the ept, only taken by the slow paths that change present
+ * entries or the fine ranges, the fault path only installs entries
+ * with compare and swap
  */
 static lock_t m_ept_lock = INIT_LOCK();
 
@@ -12,6 +22,98 @@ static lock_t m_ept_lock = INIT_LOCK();
  */
 ept_entry_t* g_root_pa;
 
+/**
+ * The large page sizes the cpu supports
+ */
+static bool m_ept_1gb_pages;
+static bool m_ept_2mb_pages;
+static bool m_ept_execute_only;
+static bool m_invept_all_context;
+static bool m_ept_accessed_dirty;
+
+/**
+ * The cpu sets the accessed and dirty bits, part of the eptp, and the
+ * amount of users that want them
+ */
+static atomic_bool m_accessed_dirty_enabled = false;
+static size_t m_accessed_dirty_users = 0;
+
+/**
+ * The roots of the views, the root of the default view is g_root_pa
+ */
+static ept_entry_t* m_view_roots[EPT_MAX_VIEWS];
+static atomic_size_t m_view_count = 0;
+
+/**
+ * The eptp list of vmfunc, the views the guest may not switch to are
+ * left invalid so trying to switch to them exits
+ */
+static uint64_t* m_eptp_list;
+
+/**
+ * Ranges that must be mapped with 4KB pages
+ */
+#define EPT_MAX_FINE_RANGES 32
+
+static struct {
+    uintptr_t base;
+    uintptr_t end;
+} m_fine_ranges[EPT_MAX_FINE_RANGES];
+static atomic_size_t m_fine_range_count = 0;
+
+/**
+ * Tables that were allocated by a cpu that lost the race to install them,
+ * the pmm can't free so they are kept for the next install
+ */
+#define EPT_SPARE_TABLES 8
+
+static _Atomic(uintptr_t) m_spare_tables[EPT_SPARE_TABLES];
+
+atomic_uint_fast64_t g_ept_generation = 0;
+
+/**
+ * Changes that need a flush were made in the current batch, protected
+ * by the ept lock
+ */
+static bool m_flush_pending = false;
+
+/**
+ * The handlers of violations on mapped pages
+ */
+#define EPT_MAX_ACCESS_HANDLERS 4
+
+static ept_access_handler_t m_access_handlers[EPT_MAX_ACCESS_HANDLERS];
+static size_t m_access_handler_count = 0;
+
+/**
+ * The pages that were claimed by owners, the entry is only ever written
+ * from what is recorded here, protected by the ept lock
+ */
+#define EPT_OWNED_BUCKETS 256
+
+typedef struct ept_owned_page {
+    struct ept_owned_page* next;
+    uintptr_t gpa;
+    uintptr_t pa[EPT_OWNER_COUNT];
+    uint8_t access[EPT_OWNER_COUNT];
+} ept_owned_page_t;
+
+static ept_owned_page_t* m_owned_pages[EPT_OWNED_BUCKETS];
+
+/**
+ * The pmm can't free, so let go pages are kept for reuse
+ */
+static ept_owned_page_t* m_free_owned_pages;
+
+/**
+ * Our own memory, the guest has no access to it in any view
+ */
+static uintptr_t m_hidden_base;
+static uintptr_t m_hidden_end;
+
+static vmexit_action_t handle_ept_violation(vcpu_t* vcpu);
+static vmexit_action_t handle_vmfunc(vcpu_t* vcpu);
+
 err_t init_ept() {
     err_t err = NO_ERROR;
 
@@ -20,56 +122,1077 @@ err_t init_ept() {
     // allocate the top level page
     g_root_pa = pallocz_aligned(4096, 0x1000);
     CHECK_ERROR(g_root_pa != NULL, ERROR_OUT_OF_RESOURCES);
+    m_view_roots[EPT_DEFAULT_VIEW] = g_root_pa;
+    atomic_store_explicit(&m_view_count, 1, memory_order_release);
+
+    m_eptp_list = pallocz_aligned(0x1000, 0x1000);
+    CHECK_ERROR(m_eptp_list != NULL, ERROR_OUT_OF_RESOURCES);
+    m_eptp_list[EPT_DEFAULT_VIEW] = ept_view_eptp(EPT_DEFAULT_VIEW);
+
+    msr_vmx_ept_vpid_cap_t cap = { .raw = __rdmsr(MSR_IA32_VMX_EPT_VPID_CAP) };
+    m_ept_1gb_pages = cap.pdpte_1gb_pages;
+    m_ept_2mb_pages = cap.pde_2mb_pages;
+    m_ept_execute_only = cap.execute_only;
+    m_invept_all_context = cap.invept_all_context;
+    m_ept_accessed_dirty = cap.ept_accessed_dirty;
+    TRACE("\tlarge pages: 1GB=%d, 2MB=%d", m_ept_1gb_pages, m_ept_2mb_pages);
+
+    // the guest has no business stepping over our pages
+    ept_view_t view;
+    CHECK_AND_RETHROW(ept_create_view(false, &view));
+    CHECK(view == EPT_UNRESTRICTED_VIEW);
+
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_EPT_VIOLATION, handle_ept_violation));
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_VMFUNC, handle_vmfunc));
 
 cleanup:
     return err;
 }
 
-void invept() {
-    //invept the entire EPT, since doing so on a single address requires the VPCID which we don't need
+typedef enum invept_type {
+    INVEPT_SINGLE_CONTEXT = 1,
+    INVEPT_ALL_CONTEXT = 2,
+} invept_type_t;
+
+static void invept(invept_type_t type, uint64_t eptp) {
     struct descr {
         uint64_t eptp;
         uint64_t gpa;
     };
 
-    struct descr d = {(uintptr_t)g_root_pa | 6 | (4 - 1) << 3, 0};
-    uint64_t type = 1;
+    struct descr d = {eptp, 0};
+
+    asm volatile("invept %1, %0" : : "r"((uint64_t)type), "m"(d) : "memory");
+}
+
+/**
+ * Invept the entire EPT of all the views, since doing so on a single
+ * address requires the VPCID which we don't need
+ */
+static void invept_views() {
+    if (m_invept_all_context) {
+        invept(INVEPT_ALL_CONTEXT, 0);
+        return;
+    }
+
+    size_t count = atomic_load_explicit(&m_view_count, memory_order_acquire);
+    for (size_t view = 0; view < count; view++) {
+        invept(INVEPT_SINGLE_CONTEXT, ept_view_eptp(view));
+    }
+}
+
+/**
+ * Publish the changes of the current batch with a single generation bump,
+ * must hold the lock
+ */
+static void commit_batch() {
+    if (m_flush_pending) {
+        atomic_fetch_add_explicit(&g_ept_generation, 1, memory_order_release);
+        m_flush_pending = false;
+    }
+}
+
+void ept_sync(vcpu_t* vcpu) {
+    uint64_t generation = atomic_load_explicit(&g_ept_generation, memory_order_acquire);
+    if (vcpu->ept_generation != generation) {
+        invept_views();
+        vcpu->ept_generation = generation;
 
-    asm volatile("invept %1, %0" : : "r"(type), "m"(d) : "memory");
+        // accessed and dirty bits might have been turned on or off
+        ept_switch_view(vcpu, ept_current_view(vcpu));
+    }
+}
+
+/**
+ * Check if the tlb may have anything cached by the old entry that the new
+ * entry does not allow, only a mapping that goes away, moves or loses
+ * permissions does
+ */
+static bool needs_flush(ept_entry_t old_entry, ept_entry_t new_entry) {
+    if (!old_entry.r && !old_entry.w && !old_entry.x) {
+        // nothing can be cached for a non-present entry
+        return false;
+    }
+
+    if (old_entry.frame != new_entry.frame ||
+        old_entry.large_page != new_entry.large_page ||
+        old_entry.mem_type != new_entry.mem_type ||
+        old_entry.ignore_pat != new_entry.ignore_pat) {
+        return true;
+    }
+
+    // permissions only widened
+    return (old_entry.r && !new_entry.r) ||
+           (old_entry.w && !new_entry.w) ||
+           (old_entry.x && !new_entry.x);
+}
+
+static ept_entry_t load_entry(ept_entry_t* entry) {
+    return (ept_entry_t){ .raw = __atomic_load_n(&entry->raw, __ATOMIC_ACQUIRE) };
+}
+
+/**
+ * Replace a present entry and queue a flush if needed, must hold the lock
+ */
+static void write_entry(ept_entry_t* entry, ept_entry_t new_entry) {
+    if (needs_flush(load_entry(entry), new_entry)) {
+        m_flush_pending = true;
+    }
+    __atomic_store_n(&entry->raw, new_entry.raw, __ATOMIC_RELEASE);
+}
+
+static ept_entry_t* entry_table(ept_entry_t* entry) {
+    return (ept_entry_t*)((uintptr_t)entry->frame << 12);
+}
+
+static size_t entry_index(uintptr_t address, int level) {
+    return (address >> (12 + 9 * (level - 1))) & 0x1ff;
+}
+
+/**
+ * Give the views that own a copy of the table with the entry the new entry
+ * as well, unless the view has its own entry there. Must hold the lock.
+ */
+static void propagate_entry(uintptr_t address, int level, ept_entry_t new_entry) {
+    size_t count = atomic_load_explicit(&m_view_count, memory_order_acquire);
+    for (size_t view = 1; view < count; view++) {
+        ept_entry_t* cur = m_view_roots[view];
+        for (int cur_level = EPT_LEVELS; cur != NULL && cur_level > level; cur_level--) {
+            ept_entry_t entry = load_entry(&cur[entry_index(address, cur_level)]);
+
+            // a shared table already has the new entry
+            cur = entry.view_owned ? entry_table(&entry) : NULL;
+        }
+
+        if (cur != NULL) {
+            ept_entry_t* entry = &cur[entry_index(address, level)];
+            if (!load_entry(entry).view_owned) {
+                write_entry(entry, new_entry);
+            }
+        }
+    }
+}
+
+/**
+ * Replace a present entry of the default view, must hold the lock
+ */
+static void write_default_entry(ept_entry_t* entry, uintptr_t address, int level, ept_entry_t new_entry) {
+    write_entry(entry, new_entry);
+    propagate_entry(address, level, new_entry);
+}
+
+/**
+ * Fill a non-present entry, fails if someone else changed it first. Nothing
+ * is cached for a non-present entry so this never needs a flush.
+ */
+static bool install_entry(ept_entry_t* entry, ept_entry_t old_entry, ept_entry_t new_entry) {
+    return __atomic_compare_exchange_n(&entry->raw, &old_entry.raw, new_entry.raw,
+                                       false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static uintptr_t alloc_table() {
+    for (size_t i = 0; i < EPT_SPARE_TABLES; i++) {
+        uintptr_t table = atomic_exchange_explicit(&m_spare_tables[i], 0, memory_order_acquire);
+        if (table != 0) {
+            return table;
+        }
+    }
+    return (uintptr_t)pallocz_aligned(0x1000, 0x1000);
+}
+
+/**
+ * Give back a table that was never installed, it is still zeroed
+ */
+static void release_table(uintptr_t table) {
+    for (size_t i = 0; i < EPT_SPARE_TABLES; i++) {
+        uintptr_t expected = 0;
+        if (atomic_compare_exchange_strong_explicit(&m_spare_tables[i], &expected, table,
+                                                    memory_order_release, memory_order_relaxed)) {
+            return;
+        }
+    }
+
+    // all the slots are taken, the page is lost
+}
+
+/**
+ * Check if a leaf at the given level can map the address, the whole
+ * page must have a single memory type which is returned
+ */
+static bool can_map_at_level(uintptr_t address, int level, uint8_t* mem_type) {
+    if (level == 2 && !m_ept_2mb_pages) {
+        return false;
+    } else if (level == 3 && !m_ept_1gb_pages) {
+        return false;
+    } else if (level > 3) {
+        return false;
+    }
+
+    uintptr_t base = address & ~(EPT_LEVEL_SIZE(level) - 1);
+    uintptr_t end = base + EPT_LEVEL_SIZE(level);
+    if (level > 1) {
+        size_t count = atomic_load_explicit(&m_fine_range_count, memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            if (m_fine_ranges[i].base < end && base < m_fine_ranges[i].end) {
+                return false;
+            }
+        }
+    }
+
+    return mem_type_of(base, EPT_LEVEL_SIZE(level), mem_type);
+}
+
+/**
+ * Replace a large page of the default view with a table of the next level
+ * mapping the same memory with the same attributes
+ */
+static err_t split_large_page(ept_entry_t* entry, uintptr_t address, int level) {
+    err_t err = NO_ERROR;
+
+    ept_entry_t* table = pallocz_aligned(0x1000, 0x1000);
+    CHECK_ERROR(table != NULL, ERROR_OUT_OF_RESOURCES);
+
+    ept_entry_t large_page = load_entry(entry);
+    uint64_t child_frames = EPT_LEVEL_SIZE(level - 1) >> 12;
+    for (int i = 0; i < 512; i++) {
+        table[i] = large_page;
+        table[i].frame = large_page.frame + i * child_frames;
+        table[i].large_page = level - 1 > 1;
+    }
+
+    // the table is always rwx, the large page might still be cached
+    ept_entry_t new_entry = {
+        .r = 1,
+        .w = 1,
+        .x = 1,
+        .frame = (uintptr_t)table >> 12,
+    };
+    write_default_entry(entry, address, level, new_entry);
+
+cleanup:
+    return err;
+}
+
+/**
+ * Map the address with a leaf at the highest level up to max_level that is
+ * allowed, returns the level of the leaf that maps it. Safe to race with
+ * itself, each missing entry is installed by exactly one cpu.
+ */
+static err_t map_address(ept_entry_t* root, uintptr_t address, int max_level, int* out_level) {
+    err_t err = NO_ERROR;
+
+    ept_entry_t* cur = root;
+    int level = EPT_LEVELS;
+    while (true) {
+        ept_entry_t* entry = &cur[entry_index(address, level)];
+        ept_entry_t old_entry = load_entry(entry);
+
+        if (old_entry.raw != 0 && (level == 1 || old_entry.large_page)) {
+            // someone else already mapped it
+            *out_level = level;
+            break;
+        }
+
+        // a leaf without any access is still mapped, only its access was
+        // taken away, so look at the whole entry
+        if (old_entry.raw == 0) {
+            uint8_t mem_type;
+            bool leaf = level <= max_level && can_map_at_level(address, level, &mem_type);
+
+            ept_entry_t new_entry;
+            uintptr_t table = 0;
+            if (leaf) {
+                new_entry = (ept_entry_t){
+                    .r = 1,
+                    .w = 1,
+                    .x = 1,
+                    .mem_type = mem_type,
+                    .large_page = level > 1,
+                    .frame = (address & ~(EPT_LEVEL_SIZE(level) - 1)) >> 12,
+                };
+            } else {
+                table = alloc_table();
+                CHECK_ERROR(table != 0, ERROR_OUT_OF_RESOURCES);
+                new_entry = (ept_entry_t){
+                    .r = 1,
+                    .w = 1,
+                    .x = 1,
+                    .frame = table >> 12,
+                };
+            }
+
+            if (!install_entry(entry, old_entry, new_entry)) {
+                // lost the race, look again at what the winner installed
+                if (table != 0) {
+                    release_table(table);
+                }
+                continue;
+            }
+
+            if (leaf) {
+                *out_level = level;
+                break;
+            }
+
+            old_entry = new_entry;
+        }
+
+        cur = entry_table(&old_entry);
+        level--;
+    }
+
+cleanup:
+    return err;
 }
 
 err_t ept_map(uintptr_t address) {
     err_t err = NO_ERROR;
+
+    int level;
+    CHECK_AND_RETHROW(map_address(g_root_pa, address, EPT_LEVELS, &level));
+
+cleanup:
+    return err;
+}
+
+/**
+ * Map the range with the largest pages that fit in it
+ */
+static err_t map_range(uintptr_t base, uintptr_t end) {
+    err_t err = NO_ERROR;
+
+    uintptr_t address = base;
+    while (address < end) {
+        // the largest page that is aligned and does not go past the end
+        int max_level = 1;
+        while (max_level < EPT_LEVELS - 1) {
+            uint64_t size = EPT_LEVEL_SIZE(max_level + 1);
+            if ((address & (size - 1)) != 0 || end - address < size) {
+                break;
+            }
+            max_level++;
+        }
+
+        int level;
+        CHECK_AND_RETHROW(map_address(g_root_pa, address, max_level, &level));
+
+        // the leaf might be an existing larger page
+        address = (address & ~(EPT_LEVEL_SIZE(level) - 1)) + EPT_LEVEL_SIZE(level);
+    }
+
+cleanup:
+    return err;
+}
+
+err_t ept_map_memmap(virtdbg_memmap_entry_t* entries, size_t count, size_t* out_mapped) {
+    err_t err = NO_ERROR;
+    lock(&m_ept_lock);
+
+    // framebuffers are usually uncachable in the mtrrs and the pat makes
+    // them write combining, give them the right type no matter what
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].type == VIRTDBG_MEMMAP_FRAMEBUFFER) {
+            CHECK_AND_RETHROW(mem_type_override(entries[i].base, entries[i].length, MEM_TYPE_WC));
+        }
+    }
+
+    size_t mapped = 0;
+    for (size_t i = 0; i < count; i++) {
+        uintptr_t base = entries[i].base & ~0xFFFull;
+        uintptr_t end = ALIGN_UP(entries[i].base + entries[i].length, 0x1000);
+        CHECK_AND_RETHROW(map_range(base, end));
+        mapped += end - base;
+    }
+
+    if (out_mapped != NULL) {
+        *out_mapped = mapped;
+    }
+
+cleanup:
+    commit_batch();
+    unlock(&m_ept_lock);
+    return err;
+}
+
+/**
+ * Split all the large pages covering the address
+ */
+static err_t split_address(uintptr_t address) {
+    err_t err = NO_ERROR;
+
+    ept_entry_t* cur = g_root_pa;
+    for (int level = EPT_LEVELS; level > 1; level--) {
+        ept_entry_t* entry = &cur[entry_index(address, level)];
+        if (load_entry(entry).raw == 0) {
+            // not mapped yet, will be mapped with small pages
+            break;
+        }
+
+        if (load_entry(entry).large_page) {
+            CHECK_AND_RETHROW(split_large_page(entry, address, level));
+        }
+
+        ept_entry_t table = load_entry(entry);
+        cur = entry_table(&table);
+    }
+
+cleanup:
+    return err;
+}
+
+err_t ept_add_fine_range(uintptr_t base, size_t size) {
+    err_t err = NO_ERROR;
+    lock(&m_ept_lock);
+
+    // the fault path reads the ranges without the lock, publish the new
+    // range before splitting so no new large page can cover it
+    size_t count = atomic_load_explicit(&m_fine_range_count, memory_order_relaxed);
+    CHECK_ERROR(count < EPT_MAX_FINE_RANGES, ERROR_OUT_OF_RESOURCES);
+    uintptr_t end = ALIGN_UP(base + size, 0x1000);
+    base &= ~0xFFFull;
+    m_fine_ranges[count].base = base;
+    m_fine_ranges[count].end = end;
+    atomic_store_explicit(&m_fine_range_count, count + 1, memory_order_seq_cst);
+
+    for (uintptr_t address = base; address < end; address += 0x1000) {
+        CHECK_AND_RETHROW(split_address(address));
+    }
+
+cleanup:
+    // all the splits are flushed together
+    commit_batch();
+    unlock(&m_ept_lock);
+    return err;
+}
+
+bool ept_execute_only_supported() {
+    return m_ept_execute_only;
+}
+
+err_t ept_register_access_handler(ept_access_handler_t handler) {
+    err_t err = NO_ERROR;
+
+    CHECK(handler != NULL);
+    CHECK_ERROR(m_access_handler_count < EPT_MAX_ACCESS_HANDLERS, ERROR_OUT_OF_RESOURCES);
+    m_access_handlers[m_access_handler_count++] = handler;
+
+cleanup:
+    return err;
+}
+
+/**
+ * Get the leaf of an address that is mapped with a 4KB page
+ */
+static ept_entry_t* get_page_entry(uintptr_t gpa) {
+    ept_entry_t* cur = g_root_pa;
+    for (int level = EPT_LEVELS; level > 1; level--) {
+        ept_entry_t entry = load_entry(&cur[entry_index(gpa, level)]);
+        cur = entry_table(&entry);
+    }
+    return &cur[entry_index(gpa, 1)];
+}
+
+/**
+ * Map the page in the default view with a 4KB page, must hold the lock
+ */
+static err_t map_small_page(uintptr_t gpa) {
+    err_t err = NO_ERROR;
+
+    // a fault on a neighbour can map a large page over it
+    // right after we split, so try until it sticks
+    int level;
+    do {
+        CHECK_AND_RETHROW(split_address(gpa));
+        CHECK_AND_RETHROW(map_address(g_root_pa, gpa, 1, &level));
+    } while (level != 1);
+
+cleanup:
+    return err;
+}
+
+static err_t set_view_page(ept_view_t view, uintptr_t gpa, uintptr_t pa, uint8_t access);
+static err_t reset_view_page(ept_view_t view, uintptr_t gpa);
+
+/**
+ * Write the page to the default view, must hold the lock
+ */
+static err_t set_page(uintptr_t gpa, uintptr_t pa, uint8_t access, uint8_t unrestricted_access) {
+    err_t err = NO_ERROR;
+
+    CHECK_AND_RETHROW(map_small_page(gpa));
+
+    ept_entry_t* entry = get_page_entry(gpa);
+    ept_entry_t new_entry = load_entry(entry);
+    new_entry.frame = pa >> 12;
+    new_entry.r = (access & EPT_ACCESS_READ) != 0;
+    new_entry.w = (access & EPT_ACCESS_WRITE) != 0;
+    new_entry.x = (access & EPT_ACCESS_EXECUTE) != 0;
+    write_default_entry(entry, gpa, 1, new_entry);
+
+    // the unrestricted view keeps seeing the page as it was
+    if (pa == gpa && access == EPT_ACCESS_ALL) {
+        CHECK_AND_RETHROW(reset_view_page(EPT_UNRESTRICTED_VIEW, gpa));
+    } else {
+        CHECK_AND_RETHROW(set_view_page(EPT_UNRESTRICTED_VIEW, gpa, gpa, unrestricted_access));
+    }
+
+cleanup:
+    return err;
+}
+
+static ept_owned_page_t** find_owned_page(uintptr_t gpa) {
+    uint64_t frame = gpa >> 12;
+    ept_owned_page_t** link = &m_owned_pages[(frame ^ (frame >> 8) ^ (frame >> 16)) % EPT_OWNED_BUCKETS];
+    while (*link != NULL && (*link)->gpa != gpa) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+err_t ept_claim_page(ept_owner_t owner, uintptr_t gpa, uintptr_t pa, uint8_t access) {
+    err_t err = NO_ERROR;
     lock(&m_ept_lock);
 
-	int pteIdx   = (((address) >> 12) & 0x1ff);
-
-    ept_entry_t* cur = (ept_entry_t*)g_root_pa;
-    for (int i = 4; i > 1; i--) {
-        size_t idx = (((address) >> (12 + 9 * (i - 1))) & 0x1ff);
-        if (!(cur[idx].r)) {
-            uintptr_t alloc = (uintptr_t)pallocz_aligned(0x1000, 0x1000);
-            CHECK_ERROR(alloc != 0, ERROR_OUT_OF_RESOURCES);
-            cur[idx].frame = (alloc >> 12);
-            cur[idx].r = 1;
-            cur[idx].w = 1;
-            cur[idx].x = 1;
-            cur = (ept_entry_t*)alloc;
+    CHECK(owner < EPT_OWNER_COUNT);
+    gpa &= ~0xFFFull;
+    pa &= ~0xFFFull;
+
+    ept_owned_page_t** link = find_owned_page(gpa);
+    if (*link == NULL) {
+        if (pa == gpa && access == EPT_ACCESS_ALL) {
+            goto cleanup;
+        }
+
+        ept_owned_page_t* page = m_free_owned_pages;
+        if (page != NULL) {
+            m_free_owned_pages = page->next;
         } else {
-            cur = (ept_entry_t*)(((uintptr_t)cur[idx].frame) << 12);
+            page = palloc(sizeof(ept_owned_page_t));
+            CHECK_ERROR(page != NULL, ERROR_OUT_OF_RESOURCES);
+        }
+
+        page->next = NULL;
+        page->gpa = gpa;
+        for (size_t i = 0; i < EPT_OWNER_COUNT; i++) {
+            page->pa[i] = gpa;
+            page->access[i] = EPT_ACCESS_ALL;
+        }
+        *link = page;
+    }
+    ept_owned_page_t* page = *link;
+
+    // there is only a single frame to point at
+    for (size_t i = 0; i < EPT_OWNER_COUNT; i++) {
+        CHECK(i == owner || pa == gpa || page->pa[i] == gpa, "page %lx is already moved by another owner", gpa);
+    }
+    page->pa[owner] = pa;
+    page->access[owner] = access;
+
+    uintptr_t frame = gpa;
+    uint8_t page_access = EPT_ACCESS_ALL;
+    for (size_t i = 0; i < EPT_OWNER_COUNT; i++) {
+        if (page->pa[i] != gpa) {
+            frame = page->pa[i];
+        }
+        page_access &= page->access[i];
+    }
+    // stepping over a watch or a breakpoint never opens up our memory
+    CHECK_AND_RETHROW(set_page(gpa, frame, page_access, page->access[EPT_OWNER_VIRTDBG]));
+
+    // nobody wants anything from the page anymore
+    if (frame == gpa && page_access == EPT_ACCESS_ALL) {
+        *link = page->next;
+        page->next = m_free_owned_pages;
+        m_free_owned_pages = page;
+    }
+
+cleanup:
+    commit_batch();
+    unlock(&m_ept_lock);
+    return err;
+}
+
+err_t ept_hide_range(uintptr_t base, size_t size) {
+    err_t err = NO_ERROR;
+
+    CHECK(m_hidden_end == 0, "only a single range can be hidden");
+
+    uintptr_t end = ALIGN_UP(base + size, 0x1000);
+    base &= ~0xFFFull;
+    CHECK_AND_RETHROW(ept_add_fine_range(base, end - base));
+    for (uintptr_t address = base; address < end; address += 0x1000) {
+        CHECK_AND_RETHROW(ept_claim_page(EPT_OWNER_VIRTDBG, address, address, 0));
+    }
+
+    m_hidden_base = base;
+    m_hidden_end = end;
+
+cleanup:
+    return err;
+}
+
+uint64_t ept_view_eptp(ept_view_t view) {
+    uint64_t eptp = (uintptr_t)m_view_roots[view] | EPT_WB | EPT_PAGEWALK(EPT_LEVELS);
+    if (atomic_load_explicit(&m_accessed_dirty_enabled, memory_order_relaxed)) {
+        eptp |= EPT_ACCESSED_DIRTY;
+    }
+    return eptp;
+}
+
+uint64_t* ept_eptp_list() {
+    return m_eptp_list;
+}
+
+err_t ept_create_view(bool guest_switchable, ept_view_t* out_view) {
+    err_t err = NO_ERROR;
+    lock(&m_ept_lock);
+
+    size_t view = atomic_load_explicit(&m_view_count, memory_order_relaxed);
+    CHECK_ERROR(view < EPT_MAX_VIEWS, ERROR_OUT_OF_RESOURCES);
+
+    // start out sharing all the tables, anything the default view maps
+    // later is copied on the first fault in the view
+    ept_entry_t* root = (ept_entry_t*)alloc_table();
+    CHECK_ERROR(root != NULL, ERROR_OUT_OF_RESOURCES);
+    for (int i = 0; i < 512; i++) {
+        root[i] = load_entry(&g_root_pa[i]);
+    }
+
+    m_view_roots[view] = root;
+    atomic_store_explicit(&m_view_count, view + 1, memory_order_release);
+
+    if (guest_switchable) {
+        m_eptp_list[view] = ept_view_eptp(view);
+    }
+
+    *out_view = view;
+
+cleanup:
+    unlock(&m_ept_lock);
+    return err;
+}
+
+/**
+ * Get the leaf of the page in the view, the tables on the way are copied
+ * from the default view so the view owns them. Must hold the lock.
+ */
+static err_t own_view_page(ept_view_t view, uintptr_t gpa, ept_entry_t** out_entry) {
+    err_t err = NO_ERROR;
+
+    CHECK_AND_RETHROW(map_small_page(gpa));
+
+    ept_entry_t* cur = m_view_roots[view];
+    ept_entry_t* def = g_root_pa;
+    for (int level = EPT_LEVELS; level > 1; level--) {
+        ept_entry_t* entry = &cur[entry_index(gpa, level)];
+        ept_entry_t view_entry = load_entry(entry);
+        ept_entry_t default_entry = load_entry(&def[entry_index(gpa, level)]);
+
+        if (!view_entry.view_owned) {
+            ept_entry_t* table = (ept_entry_t*)alloc_table();
+            CHECK_ERROR(table != NULL, ERROR_OUT_OF_RESOURCES);
+
+            ept_entry_t* default_table = entry_table(&default_entry);
+            for (int i = 0; i < 512; i++) {
+                table[i] = load_entry(&default_table[i]);
+            }
+
+            view_entry = (ept_entry_t){
+                .r = 1,
+                .w = 1,
+                .x = 1,
+                .view_owned = 1,
+                .frame = (uintptr_t)table >> 12,
+            };
+            write_entry(entry, view_entry);
         }
+
+        cur = entry_table(&view_entry);
+        def = entry_table(&default_entry);
     }
 
-    cur[pteIdx].frame = address >> 12;
-    cur[pteIdx].r = 1;
-    cur[pteIdx].w = 1;
-    cur[pteIdx].x = 1;
-    cur[pteIdx].mem_type = EPT_WB;
+    *out_entry = &cur[entry_index(gpa, 1)];
+
+cleanup:
+    return err;
+}
+
+static err_t set_view_page(ept_view_t view, uintptr_t gpa, uintptr_t pa, uint8_t access) {
+    err_t err = NO_ERROR;
+
+    ept_entry_t* entry;
+    CHECK_AND_RETHROW(own_view_page(view, gpa, &entry));
+
+    // same memory type as the default view
+    ept_entry_t new_entry = load_entry(get_page_entry(gpa));
+    new_entry.frame = pa >> 12;
+    new_entry.r = (access & EPT_ACCESS_READ) != 0;
+    new_entry.w = (access & EPT_ACCESS_WRITE) != 0;
+    new_entry.x = (access & EPT_ACCESS_EXECUTE) != 0;
+    new_entry.view_owned = 1;
+    write_entry(entry, new_entry);
+
+cleanup:
+    return err;
+}
+
+static err_t reset_view_page(ept_view_t view, uintptr_t gpa) {
+    err_t err = NO_ERROR;
+
+    // the tables stay owned by the view, the pmm can't free them anyways
+    ept_entry_t* cur = m_view_roots[view];
+    for (int level = EPT_LEVELS; level > 1; level--) {
+        ept_entry_t entry = load_entry(&cur[entry_index(gpa, level)]);
+        if (!entry.view_owned) {
+            // the page is already shared
+            goto cleanup;
+        }
+        cur = entry_table(&entry);
+    }
+
+    write_entry(&cur[entry_index(gpa, 1)], load_entry(get_page_entry(gpa)));
+
+cleanup:
+    return err;
+}
+
+err_t ept_view_set_page(ept_view_t view, uintptr_t gpa, uintptr_t pa, uint8_t access) {
+    err_t err = NO_ERROR;
+    lock(&m_ept_lock);
+
+    CHECK(view != EPT_DEFAULT_VIEW && view < atomic_load(&m_view_count));
+    CHECK_AND_RETHROW(set_view_page(view, gpa & ~0xFFFull, pa, access));
+
+cleanup:
+    commit_batch();
+    unlock(&m_ept_lock);
+    return err;
+}
+
+err_t ept_view_reset_page(ept_view_t view, uintptr_t gpa) {
+    err_t err = NO_ERROR;
+    lock(&m_ept_lock);
 
-    invept();
+    CHECK(view != EPT_DEFAULT_VIEW && view < atomic_load(&m_view_count));
+    CHECK_AND_RETHROW(reset_view_page(view, gpa & ~0xFFFull));
 
 cleanup:
+    commit_batch();
     unlock(&m_ept_lock);
     return err;
 }
 
+ept_view_t ept_current_view(vcpu_t* vcpu) {
+    ept_entry_t* root = (ept_entry_t*)(vmread(VMCS_FIELD_EPT_POINTER_FULL) & ~0xFFFull);
+    if (root == g_root_pa) {
+        return EPT_DEFAULT_VIEW;
+    }
+
+    size_t count = atomic_load_explicit(&m_view_count, memory_order_acquire);
+    for (size_t view = 1; view < count; view++) {
+        if (m_view_roots[view] == root) {
+            return view;
+        }
+    }
+
+    ASSERT(false, "vcpu is not in any view");
+    return EPT_DEFAULT_VIEW;
+}
+
+void ept_switch_view(vcpu_t* vcpu, ept_view_t view) {
+    vmwrite(VMCS_FIELD_EPT_POINTER_FULL, ept_view_eptp(view));
+}
+
+static vmexit_action_t ept_step_done(vcpu_t* vcpu) {
+    ept_switch_view(vcpu, vcpu->ept_step_view);
+    vcpu->ept_stepping = false;
+    return VMEXIT_RESUME;
+}
+
+err_t ept_step_unrestricted(vcpu_t* vcpu) {
+    err_t err = NO_ERROR;
+
+    if (!vcpu->ept_stepping) {
+        CHECK_AND_RETHROW(vcpu_single_step(vcpu, ept_step_done));
+        vcpu->ept_step_view = ept_current_view(vcpu);
+        vcpu->ept_stepping = true;
+        ept_switch_view(vcpu, EPT_UNRESTRICTED_VIEW);
+    }
+
+cleanup:
+    return err;
+}
+
+bool ept_accessed_dirty_supported() {
+    return m_ept_accessed_dirty;
+}
+
+bool ept_accessed_dirty_enabled() {
+    return atomic_load_explicit(&m_accessed_dirty_enabled, memory_order_relaxed);
+}
+
+/**
+ * Turn the bits on or off in all the eptps, must hold the lock
+ */
+static void update_accessed_dirty(bool enable) {
+    if (enable == atomic_load_explicit(&m_accessed_dirty_enabled, memory_order_relaxed)) {
+        return;
+    }
+    atomic_store_explicit(&m_accessed_dirty_enabled, enable, memory_order_relaxed);
+
+    // vmfunc switches to the eptp in the list
+    size_t count = atomic_load_explicit(&m_view_count, memory_order_relaxed);
+    for (size_t view = 0; view < count; view++) {
+        if (m_eptp_list[view] != 0) {
+            m_eptp_list[view] = ept_view_eptp(view);
+        }
+    }
+
+    // every vcpu rewrites its eptp when it syncs
+    m_flush_pending = true;
+}
+
+err_t ept_enable_accessed_dirty() {
+    err_t err = NO_ERROR;
+    lock(&m_ept_lock);
+
+    CHECK_ERROR(m_ept_accessed_dirty, ERROR_UNSUPPORTED);
+    m_accessed_dirty_users++;
+    update_accessed_dirty(true);
+
+cleanup:
+    commit_batch();
+    unlock(&m_ept_lock);
+    return err;
+}
+
+void ept_disable_accessed_dirty() {
+    lock(&m_ept_lock);
+
+    ASSERT(m_accessed_dirty_users != 0);
+    m_accessed_dirty_users--;
+    update_accessed_dirty(m_accessed_dirty_users != 0);
+
+    commit_batch();
+    unlock(&m_ept_lock);
+}
+
+/**
+ * Clear the bits of every leaf that has any of them set, the leaves
+ * are given to the visitor if there is one
+ */
+static void clear_leaf_bits(ept_entry_t* table, int level, uintptr_t base, uint64_t bits,
+                            ept_accessed_visitor_t visitor, void* ctx) {
+    for (int i = 0; i < 512; i++) {
+        ept_entry_t entry = load_entry(&table[i]);
+        if (entry.raw == 0) {
+            continue;
+        }
+
+        uintptr_t address = base + i * EPT_LEVEL_SIZE(level);
+        if (level > 1 && !entry.large_page) {
+            clear_leaf_bits(entry_table(&entry), level - 1, address, bits, visitor, ctx);
+        } else if (entry.raw & bits) {
+            // the cpu sets the bits with locked operations as well
+            ept_entry_t old_entry = { .raw = __atomic_fetch_and(&table[i].raw, ~bits, __ATOMIC_ACQ_REL) };
+            if (visitor != NULL) {
+                visitor(address, EPT_LEVEL_SIZE(level), old_entry.dirty, ctx);
+            }
+        }
+    }
+}
+
+void ept_harvest_accessed(ept_accessed_visitor_t visitor, void* ctx) {
+    clear_leaf_bits(g_root_pa, EPT_LEVELS, 0, ((ept_entry_t){ .accessed = 1, .dirty = 1 }).raw, visitor, ctx);
+
+    // the cpu won't set the bits again for what is still in the tlb
+    atomic_fetch_add_explicit(&g_ept_generation, 1, memory_order_release);
+}
+
+void ept_clear_dirty() {
+    clear_leaf_bits(g_root_pa, EPT_LEVELS, 0, ((ept_entry_t){ .dirty = 1 }).raw, NULL, NULL);
+    atomic_fetch_add_explicit(&g_ept_generation, 1, memory_order_release);
+}
+
+uint64_t ept_leaf_size(uintptr_t gpa) {
+    ept_entry_t* cur = g_root_pa;
+    for (int level = EPT_LEVELS; level > 1; level--) {
+        ept_entry_t entry = load_entry(&cur[entry_index(gpa, level)]);
+        if (entry.raw == 0 || entry.large_page) {
+            return EPT_LEVEL_SIZE(level);
+        }
+        cur = entry_table(&entry);
+    }
+    return EPT_LEVEL_SIZE(1);
+}
+
+/**
+ * Copy the entries the default view got since the view copied the tables
+ * on the way to the address, returns true if anything was copied. Lock free
+ * like the rest of the fault path.
+ */
+static bool sync_view_address(ept_view_t view, uintptr_t address) {
+    ept_entry_t* cur = m_view_roots[view];
+    ept_entry_t* def = g_root_pa;
+    for (int level = EPT_LEVELS; level >= 1; level--) {
+        ept_entry_t* entry = &cur[entry_index(address, level)];
+        ept_entry_t view_entry = load_entry(entry);
+        ept_entry_t default_entry = load_entry(&def[entry_index(address, level)]);
+
+        if (view_entry.raw == 0) {
+            return default_entry.raw != 0 && install_entry(entry, view_entry, default_entry);
+        }
+
+        // shared with the default view, or a page of the view itself
+        if (!view_entry.view_owned || level == 1 || default_entry.raw == 0 || default_entry.large_page) {
+            return false;
+        }
+
+        cur = entry_table(&view_entry);
+        def = entry_table(&default_entry);
+    }
+
+    return false;
+}
+
+/**
+ * The guest tried to switch to a view that is not in the eptp list, or
+ * used a vm function we don't enable, same as the cpu would do
+ */
+static vmexit_action_t handle_vmfunc(vcpu_t* vcpu) {
+    vmx_interruption_info_t info = {
+        .vector = EXCEPT_INVALID_OPCODE,
+        .type = VMX_INTERRUPTION_TYPE_HARDWARE_EXCEPTION,
+        .valid = 1,
+    };
+    vmwrite(VMCS_FIELD_VM_ENTRY_INTR_INFO, info.raw);
+    return VMEXIT_RESUME;
+}
+
+/**
+ * Pages that had access taken away go to the access handlers. Only the
+ * holes in the memory map are left unmapped before the guest starts, map
+ * them on demand and let the guest retry the access.
+ */
+static vmexit_action_t handle_ept_violation(vcpu_t* vcpu) {
+    size_t address = vmexit_guest_physical_address(&vcpu->exit);
+    uint64_t qualification = vmexit_qualification(&vcpu->exit);
+
+    if (m_hidden_base <= address && address < m_hidden_end) {
+        WARN("guest touched our memory at %p, rip=%p", address, guest_rip(&vcpu->exit));
+        // real mode has no error codes
+        ia32_cr0_t cr0 = { .raw = vmread(VMCS_FIELD_GUEST_CR0) };
+        vmx_interruption_info_t info = {
+            .vector = EXCEPT_GP_FAULT,
+            .type = VMX_INTERRUPTION_TYPE_HARDWARE_EXCEPTION,
+            .error_code_valid = cr0.PE,
+            .valid = 1,
+        };
+        vmwrite(VMCS_FIELD_VM_ENTRY_INTR_INFO, info.raw);
+        vmwrite(VMCS_FIELD_VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+        return VMEXIT_RESUME;
+    }
+
+    // the view might just be missing what the default view mapped
+    ept_view_t view = ept_current_view(vcpu);
+    if (view != EPT_DEFAULT_VIEW && sync_view_address(view, address)) {
+        return VMEXIT_RESUME;
+    }
+
+    // a page can be restricted by more than one owner, each of them
+    // needs to see the access
+    bool handled = false;
+    vmexit_action_t action = VMEXIT_RESUME;
+    for (size_t i = 0; i < m_access_handler_count; i++) {
+        vmexit_action_t handler_action;
+        if (m_access_handlers[i](vcpu, address, qualification, &handler_action)) {
+            handled = true;
+            if (handler_action != VMEXIT_RESUME) {
+                action = handler_action;
+            }
+        }
+    }
+    if (handled) {
+        return action;
+    }
+
+    // either a hole, or the access was given back after the tlb cached
+    // the old entry, in which case the violation dropped it
+    if (EPT_VIOLATION_ENTRY_ACCESS(qualification) == 0) {
+        ept_map(address & ~(0x1000-1));
+        if (view != EPT_DEFAULT_VIEW) {
+            sync_view_address(view, address);
+        }
+    }
+    return VMEXIT_RESUME;
+}
+
+/**
+ * State of the fault storm, the rounds are separated by barriers
+ */
+static ept_entry_t* m_storm_root;
+static uint64_t m_storm_start_tsc;
+static atomic_uint_fast64_t m_storm_end_tsc;
+static atomic_size_t m_storm_waiting;
+static atomic_size_t m_storm_phase;
+
+static void storm_barrier(size_t cpu_count) {
+    size_t phase = atomic_load(&m_storm_phase);
+    if (atomic_fetch_add(&m_storm_waiting, 1) + 1 == cpu_count) {
+        atomic_store(&m_storm_waiting, 0);
+        atomic_fetch_add(&m_storm_phase, 1);
+    } else {
+        while (atomic_load(&m_storm_phase) == phase) {
+            cpu_pause();
+        }
+    }
+}
+
+void ept_fault_storm(size_t cpu, size_t cpu_count) {
+    size_t participants = 1;
+    while (true) {
+        // fresh tables for every round so every fault installs something
+        if (cpu == 0) {
+            m_storm_root = pallocz_aligned(0x1000, 0x1000);
+            atomic_store(&m_storm_end_tsc, 0);
+        }
+        storm_barrier(cpu_count);
+        if (cpu == 0) {
+            m_storm_start_tsc = __rdtsc();
+        }
+
+        if (cpu < participants && m_storm_root != NULL) {
+            // the cpus interleave their pages so they share the tables
+            // above the leaves and race on installing them
+            for (size_t i = 0; i < EPT_FAULT_STORM_FAULTS; i++) {
+                int level;
+                uintptr_t address = EPT_FAULT_STORM_BASE + (i * participants + cpu) * 0x1000;
+                if (IS_ERROR(map_address(m_storm_root, address, 1, &level))) {
+                    break;
+                }
+            }
+
+            uint64_t end_tsc = __rdtsc();
+            uint64_t last = atomic_load(&m_storm_end_tsc);
+            while (last < end_tsc) {
+                // the round ends when the slowest cpu is done
+                if (atomic_compare_exchange_weak(&m_storm_end_tsc, &last, end_tsc)) {
+                    break;
+                }
+            }
+        }
+        storm_barrier(cpu_count);
+
+        if (cpu == 0) {
+            uint64_t cycles = atomic_load(&m_storm_end_tsc) - m_storm_start_tsc;
+            uint64_t faults = EPT_FAULT_STORM_FAULTS * participants;
+            TRACE("ept fault storm: %d cpus, %lu faults in %lu cycles, %lu cycles per fault",
+                  participants, faults, cycles, cycles / faults);
+        }
+
+        if (participants == cpu_count) {
+            break;
+        }
+        participants = MIN(participants * 2, cpu_count);
+    }
+}
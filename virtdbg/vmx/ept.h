@@ -2,41 +2,288 @@
 #define __VIRTDBG_EPT_H__
 
 #include <util/except.h>
+#include <virtdbg.h>
+#include <vmx/dispatch.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+struct vcpu;
 #define EPT_WB  (6)
 /**
  * The amount of levels in the ept
  */
 #define EPT_LEVELS 4
 #define EPT_PAGEWALK(n) ((n - 1) << 3)
+#define EPT_ACCESSED_DIRTY (1 << 6)
+
+typedef union ept_entry {
+    struct {
+        uint64_t r : 1;
+        uint64_t w : 1;
+        uint64_t x : 1;
+        uint64_t mem_type : 3;
+        uint64_t ignore_pat : 1;
+        uint64_t large_page : 1;
+        uint64_t accessed : 1;
+        uint64_t dirty : 1;
+        uint64_t linear_x : 1;
 
-typedef struct ept_entry {
-    uint64_t r : 1;
-    uint64_t w : 1;
-    uint64_t x : 1;
-    uint64_t mem_type : 3;
-    uint64_t ignore_pat : 1;
-    uint64_t _reserved0 : 1;
-    uint64_t accessed : 1;
-    uint64_t dirty : 1;
-    uint64_t linear_x : 1;
-    uint64_t _reserved1 : 1;
-    uint64_t frame : 40;
-    uint64_t _reserved2 : 8;
-    uint64_t super_visor_shadow : 1;
-    uint64_t spp : 1;
-    uint64_t _reserved3 : 1;
-    uint64_t suppress_ve : 1;
+        // ignored by the cpu, the table or page belongs to a view
+        // and is not shared with the default view
+        uint64_t view_owned : 1;
+        uint64_t frame : 40;
+        uint64_t _reserved2 : 8;
+        uint64_t super_visor_shadow : 1;
+        uint64_t spp : 1;
+        uint64_t _reserved3 : 1;
+        uint64_t suppress_ve : 1;
+    };
+    uint64_t raw;
 } __attribute__((packed)) ept_entry_t;
+_Static_assert(sizeof(ept_entry_t) == sizeof(uint64_t), "invalid size for ept_entry_t");
+
+/**
+ * The size of the memory mapped by a single entry at the given level, level 1
+ * is the page table and level EPT_LEVELS is the root
+ */
+#define EPT_LEVEL_SIZE(level) (1ull << (12 + 9 * ((level) - 1)))
+
+/**
+ * The access a page gives, same bits as the entry itself
+ */
+#define EPT_ACCESS_READ     (1u << 0)
+#define EPT_ACCESS_WRITE    (1u << 1)
+#define EPT_ACCESS_EXECUTE  (1u << 2)
+#define EPT_ACCESS_ALL      (EPT_ACCESS_READ | EPT_ACCESS_WRITE | EPT_ACCESS_EXECUTE)
+
+/**
+ * The exit qualification of an ept violation, the kind of access that
+ * was done followed by the access the entry gave
+ */
+#define EPT_VIOLATION_READ          (1u << 0)
+#define EPT_VIOLATION_WRITE         (1u << 1)
+#define EPT_VIOLATION_FETCH         (1u << 2)
+#define EPT_VIOLATION_ENTRY_ACCESS(qualification) (((qualification) >> 3) & EPT_ACCESS_ALL)
+
+/**
+ * Called on an ept violation on a page that is mapped but does not give the
+ * access, returns false if the page is not one the handler restricted. Every
+ * handler that restricted the page gets the violation.
+ */
+typedef bool (*ept_access_handler_t)(struct vcpu* vcpu, uint64_t gpa, uint64_t qualification, vmexit_action_t* action);
 
 /**
- * Init our global ept
+ * Init our global ept and register the ept violation handler
  */
 err_t init_ept();
 
 /**
  * Map the given address to the guest, we only do identity mapping
- * with rwx permissions
+ * with rwx permissions and the memory type of the mtrrs. The largest page
+ * (1GB, 2MB or 4KB) that has a single memory type and does not overlap a
+ * fine range is used. Lock free, so faults on different addresses never
+ * wait for each other.
  */
 err_t ept_map(uintptr_t address);
 
+/**
+ * Make the given range always be mapped with 4KB pages, for memory that
+ * will need its own permissions or memory type. Large pages that are
+ * already mapped over it are split.
+ */
+err_t ept_add_fine_range(uintptr_t base, size_t size);
+
+/**
+ * Identity map all the entries of the memory map with the largest pages
+ * that fit, so the guest does not fault on ram or known devices. Returns
+ * the amount of bytes that were mapped.
+ */
+err_t ept_map_memmap(virtdbg_memmap_entry_t* entries, size_t count, size_t* out_mapped);
+
+/**
+ * Add a handler for violations on pages that had their access taken away,
+ * see ept_access_handler_t
+ */
+err_t ept_register_access_handler(ept_access_handler_t handler);
+
+/**
+ * The subsystems that change single pages of the default view
+ */
+typedef enum ept_owner {
+    EPT_OWNER_WATCH,
+    EPT_OWNER_BREAKPOINT,
+    EPT_OWNER_VIRTDBG,
+    EPT_OWNER_COUNT
+} ept_owner_t;
+
+/**
+ * Set the frame and access the owner wants for a single 4KB page, the page
+ * is mapped and split out of any large page first. The page gets the access
+ * all of its owners allow and the frame of the one owner that moved it, the
+ * memory type stays the same. Asking for the page itself with full access
+ * lets go of it. Taking access away is only seen by the other vcpus once
+ * they sync.
+ */
+err_t ept_claim_page(ept_owner_t owner, uintptr_t gpa, uintptr_t pa, uint8_t access);
+
+/**
+ * Take our own memory away from the guest, in every view. The guest gets a
+ * #GP if it touches it, it was told the range is reserved.
+ */
+err_t ept_hide_range(uintptr_t base, size_t size);
+
+/**
+ * Check if a page can be executable without being readable
+ */
+bool ept_execute_only_supported();
+
+/**
+ * Check if the cpu can set the accessed and dirty bits of the ept entries
+ */
+bool ept_accessed_dirty_supported();
+
+/**
+ * Make the cpu set the accessed and dirty bits of the ept entries, the
+ * vcpus pick it up on their next exit. They stay on until every user
+ * disabled them again.
+ */
+err_t ept_enable_accessed_dirty();
+void ept_disable_accessed_dirty();
+
+/**
+ * Check if the eptp has the accessed and dirty bits on
+ */
+bool ept_accessed_dirty_enabled();
+
+/**
+ * Called for every leaf of the default view that was accessed, with the
+ * size of the page it maps
+ */
+typedef void (*ept_accessed_visitor_t)(uintptr_t gpa, uint64_t size, bool dirty, void* ctx);
+
+/**
+ * Report and clear the accessed and dirty bits of all the leaves of the
+ * default view, the tlbs are flushed on the next exit of every vcpu so
+ * the bits get set again. Lock free, a page the cpu accesses while we
+ * are walking is either reported now or on the next harvest.
+ */
+void ept_harvest_accessed(ept_accessed_visitor_t visitor, void* ctx);
+
+/**
+ * Clear the dirty bits of all the leaves of the default view, so the next
+ * write to every page is logged again. Flushed the same as a harvest.
+ */
+void ept_clear_dirty();
+
+/**
+ * The size of the page that maps the address in the default view
+ */
+uint64_t ept_leaf_size(uintptr_t gpa);
+
+/**
+ * The most views there can be, the size of the eptp list
+ */
+#define EPT_MAX_VIEWS 512
+
+/**
+ * The view everything is mapped in, changed by all the functions above
+ */
+#define EPT_DEFAULT_VIEW 0
+
+/**
+ * The default view with every page that was claimed by an owner
+ * mapped back to itself with full access, see ept_step_unrestricted,
+ * except for our own memory
+ */
+#define EPT_UNRESTRICTED_VIEW 1
+
+/**
+ * A view is another ept hierarchy that shares all the tables of the default
+ * view except the ones on the way to its own pages. Every vcpu can switch to
+ * any view on its own without affecting the others.
+ */
+typedef uint16_t ept_view_t;
+
+/**
+ * Create a new view that looks just like the default view. A view the guest
+ * may switch to is put in the eptp list, so the guest can switch to it with
+ * vmfunc without exiting.
+ */
+err_t ept_create_view(bool guest_switchable, ept_view_t* out_view);
+
+/**
+ * Give a single 4KB page of the view its own frame and access, the
+ * page no longer follows the default view
+ */
+err_t ept_view_set_page(ept_view_t view, uintptr_t gpa, uintptr_t pa, uint8_t access);
+
+/**
+ * Make the page of the view follow the default view again
+ */
+err_t ept_view_reset_page(ept_view_t view, uintptr_t gpa);
+
+/**
+ * The eptp of the view, for the ept pointer of the vmcs
+ */
+uint64_t ept_view_eptp(ept_view_t view);
+
+/**
+ * The eptp list for vmfunc, only has the views the guest may switch to
+ */
+uint64_t* ept_eptp_list();
+
+/**
+ * The view the vcpu is in, the guest may have switched it with vmfunc.
+ * Must run on the vcpu itself.
+ */
+ept_view_t ept_current_view(struct vcpu* vcpu);
+
+/**
+ * Switch the vcpu to the view, the tlb entries are tagged by the view
+ * so nothing is flushed. Must run on the vcpu itself.
+ */
+void ept_switch_view(struct vcpu* vcpu, ept_view_t view);
+
+/**
+ * Run the next instruction of the vcpu in the unrestricted view and then
+ * switch back, for stepping over accesses to pages that had their access
+ * taken away without giving it back to the other vcpus. Must run on the
+ * vcpu itself.
+ */
+err_t ept_step_unrestricted(struct vcpu* vcpu);
+
+/**
+ * Bumped once for every batch of ept changes that needs a flush, every
+ * vcpu compares it with its own generation before entering the guest
+ */
+extern atomic_uint_fast64_t g_ept_generation;
+
+/**
+ * Flush the ept tlb of the current cpu if the ept changed since its last
+ * flush. Must run on the vcpu itself before entering the guest, vcpus that
+ * are running the guest will pick up changes on their next exit.
+ */
+void ept_sync(struct vcpu* vcpu);
+
+/**
+ * Run the fault storm benchmark on all the cpus at bringup, see ept_fault_storm
+ */
+#ifndef EPT_FAULT_STORM
+#define EPT_FAULT_STORM 0
+#endif
+
+/**
+ * The faults every cpu does on every round of the fault storm, and the
+ * guest physical address the faults start at (in a scratch ept)
+ */
+#define EPT_FAULT_STORM_FAULTS  4096
+#define EPT_FAULT_STORM_BASE    0x100000000ull
+
+/**
+ * Measure the fault path when all the cpus fault at once, must be called by
+ * every one of the cpu_count cpus. Runs rounds with 1, 2, 4 ... cpu_count
+ * cpus faulting on a scratch ept and traces the time of every round.
+ */
+void ept_fault_storm(size_t cpu, size_t cpu_count);
+
 #endif //__VIRTDBG_EPT_H__
@@ -0,0 +1,136 @@
+#ifndef __VIRTDBG_EXIT_INFO_H__
+#define __VIRTDBG_EXIT_INFO_H__
+
+#include <vmx/vmm.h>
+#include <stdint.h>
+
+/**
+ * The vmcs fields we cache on every exit, the first ones are read-only
+ * exit information, the rest are guest state that may also be written
+ */
+typedef enum vmexit_info_field {
+    VMEXIT_INFO_REASON,
+    VMEXIT_INFO_QUALIFICATION,
+    VMEXIT_INFO_GUEST_PHYSICAL_ADDRESS,
+    VMEXIT_INFO_GUEST_LINEAR_ADDRESS,
+    VMEXIT_INFO_INSTRUCTION_LEN,
+    VMEXIT_INFO_INTERRUPTION_INFO,
+    VMEXIT_INFO_RIP,
+    VMEXIT_INFO_RSP,
+    VMEXIT_INFO_RFLAGS,
+    VMEXIT_INFO_MAX
+} vmexit_info_field_t;
+
+/**
+ * A lazy cache of the vmcs fields of the current exit, every field is read
+ * at most once per exit and the modified guest fields are written back
+ * right before we resume
+ */
+typedef struct vmexit_info {
+    uint32_t valid;
+    uint32_t dirty;
+    uint64_t values[VMEXIT_INFO_MAX];
+} vmexit_info_t;
+
+static const uint32_t g_vmexit_info_encoding[VMEXIT_INFO_MAX] = {
+    [VMEXIT_INFO_REASON] = VMCS_FIELD_VM_EXIT_REASON,
+    [VMEXIT_INFO_QUALIFICATION] = VMCS_FIELD_EXIT_QUALIFICATION,
+    [VMEXIT_INFO_GUEST_PHYSICAL_ADDRESS] = VMCS_FIELD_GUEST_PHYSICAL_ADDRESS_FULL,
+    [VMEXIT_INFO_GUEST_LINEAR_ADDRESS] = VMCS_FIELD_GUEST_LINEAR_ADDRESS,
+    [VMEXIT_INFO_INSTRUCTION_LEN] = VMCS_FIELD_VM_EXIT_INSTRUCTION_LEN,
+    [VMEXIT_INFO_INTERRUPTION_INFO] = VMCS_FIELD_VM_EXIT_INTR_INFO,
+    [VMEXIT_INFO_RIP] = VMCS_FIELD_GUEST_RIP,
+    [VMEXIT_INFO_RSP] = VMCS_FIELD_GUEST_RSP,
+    [VMEXIT_INFO_RFLAGS] = VMCS_FIELD_GUEST_RFLAGS,
+};
+
+static inline uint64_t vmexit_info_read(vmexit_info_t* info, vmexit_info_field_t field) {
+    if (!(info->valid & (1u << field))) {
+        info->values[field] = vmread(g_vmexit_info_encoding[field]);
+        info->valid |= 1u << field;
+    }
+    return info->values[field];
+}
+
+static inline void vmexit_info_write(vmexit_info_t* info, vmexit_info_field_t field, uint64_t value) {
+    DEBUG_ASSERT(field >= VMEXIT_INFO_RIP, "Tried to write read-only exit field %d", field);
+    info->values[field] = value;
+    info->valid |= 1u << field;
+    info->dirty |= 1u << field;
+}
+
+/**
+ * Write back all the modified fields and forget everything we cached,
+ * must be called before resuming the guest
+ */
+static inline void vmexit_info_flush(vmexit_info_t* info) {
+    uint32_t dirty = info->dirty;
+    while (dirty != 0) {
+        int field = __builtin_ctz(dirty);
+        vmwrite(g_vmexit_info_encoding[field], info->values[field]);
+        dirty &= dirty - 1;
+    }
+    info->valid = 0;
+    info->dirty = 0;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Typed accessors
+//----------------------------------------------------------------------------------------------------------------------
+
+static inline vmx_vmexit_reason_t vmexit_reason(vmexit_info_t* info) {
+    return (vmx_vmexit_reason_t) { .raw = vmexit_info_read(info, VMEXIT_INFO_REASON) };
+}
+
+static inline uint64_t vmexit_qualification(vmexit_info_t* info) {
+    return vmexit_info_read(info, VMEXIT_INFO_QUALIFICATION);
+}
+
+static inline uint64_t vmexit_guest_physical_address(vmexit_info_t* info) {
+    return vmexit_info_read(info, VMEXIT_INFO_GUEST_PHYSICAL_ADDRESS);
+}
+
+static inline uint64_t vmexit_guest_linear_address(vmexit_info_t* info) {
+    return vmexit_info_read(info, VMEXIT_INFO_GUEST_LINEAR_ADDRESS);
+}
+
+static inline uint64_t vmexit_instruction_len(vmexit_info_t* info) {
+    return vmexit_info_read(info, VMEXIT_INFO_INSTRUCTION_LEN);
+}
+
+static inline vmx_interruption_info_t vmexit_interruption_info(vmexit_info_t* info) {
+    return (vmx_interruption_info_t) { .raw = vmexit_info_read(info, VMEXIT_INFO_INTERRUPTION_INFO) };
+}
+
+static inline uint64_t guest_rip(vmexit_info_t* info) {
+    return vmexit_info_read(info, VMEXIT_INFO_RIP);
+}
+
+static inline void guest_set_rip(vmexit_info_t* info, uint64_t rip) {
+    vmexit_info_write(info, VMEXIT_INFO_RIP, rip);
+}
+
+static inline uint64_t guest_rsp(vmexit_info_t* info) {
+    return vmexit_info_read(info, VMEXIT_INFO_RSP);
+}
+
+static inline void guest_set_rsp(vmexit_info_t* info, uint64_t rsp) {
+    vmexit_info_write(info, VMEXIT_INFO_RSP, rsp);
+}
+
+static inline uint64_t guest_rflags(vmexit_info_t* info) {
+    return vmexit_info_read(info, VMEXIT_INFO_RFLAGS);
+}
+
+static inline void guest_set_rflags(vmexit_info_t* info, uint64_t rflags) {
+    vmexit_info_write(info, VMEXIT_INFO_RFLAGS, rflags);
+}
+
+/**
+ * Move the guest past the instruction that caused the exit
+ */
+static inline void vmexit_skip_instruction(vmexit_info_t* info) {
+    guest_set_rip(info, guest_rip(info) + vmexit_instruction_len(info));
+}
+
+#endif //__VIRTDBG_EXIT_INFO_H__
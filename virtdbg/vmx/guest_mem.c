@@ -0,0 +1,186 @@
+#include <arch/intrin.h>
+#include <mm/pmm.h>
+#include <util/string.h>
+#include <util/defs.h>
+#include <vmx/vmm.h>
+
+#include "guest_mem.h"
+
+#define PAGE_PRESENT    (1ull << 0)
+#define PAGE_LARGE      (1ull << 7)
+#define PAGE_FRAME_MASK 0x000FFFFFFFFFF000ull
+
+/**
+ * The ram of the machine, only these ranges are read on the guest's word
+ */
+static virtdbg_memmap_entry_t* m_ram = NULL;
+static size_t m_ram_count = 0;
+
+err_t init_guest_mem(virtdbg_memmap_entry_t* entries, size_t count) {
+    err_t err = NO_ERROR;
+
+    m_ram = palloc(sizeof(virtdbg_memmap_entry_t) * count);
+    CHECK_ERROR(m_ram != NULL, ERROR_OUT_OF_RESOURCES);
+
+    for (size_t i = 0; i < count; i++) {
+        switch (entries[i].type) {
+            case VIRTDBG_MEMMAP_USABLE:
+            case VIRTDBG_MEMMAP_ACPI_RECLAIMABLE:
+            case VIRTDBG_MEMMAP_ACPI_NVS:
+            case VIRTDBG_MEMMAP_BOOTLOADER_RECLAIMABLE:
+            case VIRTDBG_MEMMAP_KERNEL_AND_MODULES:
+                m_ram[m_ram_count++] = entries[i];
+                break;
+
+            default:
+                break;
+        }
+    }
+
+cleanup:
+    return err;
+}
+
+/**
+ * Check that the range is in ram, so the guest can't make us read mmio
+ */
+static bool is_guest_ram(uintptr_t address, size_t size) {
+    for (size_t i = 0; i < m_ram_count; i++) {
+        if (m_ram[i].base <= address && address + size <= m_ram[i].base + m_ram[i].length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * 32bit paging, 4 byte entries with 4MB pages in the directory
+ */
+static bool translate_legacy(uint64_t cr3, bool pse, uint32_t address, uintptr_t* out) {
+    uintptr_t pde_address = (cr3 & 0xFFFFF000) + ((address >> 22) & 0x3FF) * 4;
+    if (!is_guest_ram(pde_address, 4)) {
+        return false;
+    }
+
+    uint32_t pde = *(uint32_t*)pde_address;
+    if (!(pde & PAGE_PRESENT)) {
+        return false;
+    }
+
+    if (pse && (pde & PAGE_LARGE)) {
+        // bits 13-20 are the high bits of the frame
+        *out = (pde & 0xFFC00000) | ((uint64_t)((pde >> 13) & 0xFF) << 32) | (address & 0x3FFFFF);
+        return true;
+    }
+
+    uintptr_t pte_address = (pde & 0xFFFFF000) + ((address >> 12) & 0x3FF) * 4;
+    if (!is_guest_ram(pte_address, 4)) {
+        return false;
+    }
+
+    uint32_t pte = *(uint32_t*)pte_address;
+    if (!(pte & PAGE_PRESENT)) {
+        return false;
+    }
+
+    *out = (pte & 0xFFFFF000) | (address & 0xFFF);
+    return true;
+}
+
+bool guest_translate(uint64_t cr3, uintptr_t address, uintptr_t* out) {
+    ia32_cr0_t cr0 = { .raw = vmread(VMCS_FIELD_GUEST_CR0) };
+    ia32_cr4_t cr4 = { .raw = vmread(VMCS_FIELD_GUEST_CR4) };
+
+    // the cpu keeps the entry control in sync with EFER.LMA on every exit
+    vmx_entry_ctls_t entry_ctls = { .raw = vmread(VMCS_FIELD_VMENTRY_CTLS) };
+
+    uintptr_t physical;
+    if (!cr0.PG) {
+        physical = address;
+    } else if (!cr4.PAE) {
+        if (!translate_legacy(cr3, cr4.PSE, address, &physical)) {
+            return false;
+        }
+    } else {
+        // pae has a 4 entry pdpt under 4GB, long mode 4 or 5 full levels
+        int top_level;
+        uint64_t table;
+        if (entry_ctls.is_guest_64bit) {
+            top_level = cr4.LA57 ? 4 : 3;
+            table = cr3 & PAGE_FRAME_MASK;
+        } else {
+            top_level = 2;
+            table = cr3 & 0xFFFFFFE0;
+            address &= 0xFFFFFFFF;
+        }
+
+        physical = 0;
+        for (int level = top_level; level >= 0; level--) {
+            size_t shift = 12 + level * 9;
+            uintptr_t entry_address = table + ((address >> shift) & 0x1FF) * 8;
+            if (!is_guest_ram(entry_address, 8)) {
+                return false;
+            }
+
+            uint64_t entry = *(uint64_t*)entry_address;
+            if (!(entry & PAGE_PRESENT)) {
+                return false;
+            }
+
+            // the pd maps 2MB pages, and the pdpt 1GB ones in long mode
+            if ((level == 1 || (level == 2 && entry_ctls.is_guest_64bit)) && (entry & PAGE_LARGE)) {
+                uint64_t page_mask = (1ull << shift) - 1;
+                physical = (entry & PAGE_FRAME_MASK & ~page_mask) | (address & page_mask);
+                break;
+            }
+
+            table = entry & PAGE_FRAME_MASK;
+            physical = table | (address & 0xFFF);
+        }
+    }
+
+    // the caller is going to access it
+    if (!is_guest_ram(physical, 1)) {
+        return false;
+    }
+
+    *out = physical;
+    return true;
+}
+
+bool guest_read(uint64_t cr3, uintptr_t address, void* buffer, size_t size) {
+    uint8_t* out = buffer;
+
+    while (size != 0) {
+        uintptr_t physical;
+        if (!guest_translate(cr3, address, &physical)) {
+            return false;
+        }
+
+        size_t chunk = MIN(size, 0x1000 - (address & 0xFFF));
+        memcpy(out, (void*)physical, chunk);
+
+        out += chunk;
+        address += chunk;
+        size -= chunk;
+    }
+
+    return true;
+}
+
+bool guest_fill(uint64_t cr3, uintptr_t address, uint8_t value, size_t size) {
+    while (size != 0) {
+        uintptr_t physical;
+        if (!guest_translate(cr3, address, &physical)) {
+            return false;
+        }
+
+        size_t chunk = MIN(size, 0x1000 - (address & 0xFFF));
+        memset((void*)physical, value, chunk);
+
+        address += chunk;
+        size -= chunk;
+    }
+
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef __VIRTDBG_GUEST_MEM_H__
+#define __VIRTDBG_GUEST_MEM_H__
+
+#include <util/except.h>
+#include <virtdbg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Remember the ram ranges of the memory map, the guest page tables
+ * and pages are only accessed if they are in one
+ */
+err_t init_guest_mem(virtdbg_memmap_entry_t* entries, size_t count);
+
+/**
+ * Translate a guest virtual address with the given guest cr3, the paging
+ * mode is taken from the current vmcs so this must run on the vcpu. The
+ * guest physical memory is identity mapped so the result can be accessed
+ * directly.
+ *
+ * Returns false if the address is not mapped or not in ram
+ */
+bool guest_translate(uint64_t cr3, uintptr_t address, uintptr_t* out);
+
+/**
+ * Read guest virtual memory, may cross pages
+ *
+ * Returns false if any of the range is not mapped
+ */
+bool guest_read(uint64_t cr3, uintptr_t address, void* buffer, size_t size);
+
+/**
+ * Fill guest virtual memory with a byte, may cross pages
+ *
+ * Returns false if any of the range is not mapped, the mapped pages
+ * before it are filled
+ */
+bool guest_fill(uint64_t cr3, uintptr_t address, uint8_t value, size_t size);
+
+#endif //__VIRTDBG_GUEST_MEM_H__
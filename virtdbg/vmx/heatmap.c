@@ -0,0 +1,190 @@
+#include <arch/cpu.h>
+#include <arch/intrin.h>
+#include <mm/pmm.h>
+#include <sync/lock.h>
+#include <util/defs.h>
+#include <util/string.h>
+#include <util/trace.h>
+#include <vmx/ept.h>
+#include <vmx/timer.h>
+#include <stdatomic.h>
+
+#include "heatmap.h"
+
+#define HEATMAP_REGION_PAGES (HEATMAP_REGION_SIZE / 0x1000)
+
+/**
+ * The share of the pages of a region that were accessed and written,
+ * averaged over the last few harvests
+ */
+typedef struct heatmap_region {
+    uint8_t accessed;
+    uint8_t dirty;
+} heatmap_region_t;
+
+/**
+ * The pages of a region seen in the current harvest
+ */
+typedef struct heatmap_count {
+    uint16_t accessed;
+    uint16_t dirty;
+} heatmap_count_t;
+
+static lock_t m_heatmap_lock = INIT_LOCK();
+static heatmap_region_t* m_regions;
+static heatmap_count_t* m_counts;
+static size_t m_region_count;
+static uint64_t m_harvests;
+static bool m_running;
+
+/**
+ * The harvest interval, the next harvest is never when stopped so the
+ * exit path only does a single compare
+ */
+static uint64_t m_interval_cycles;
+static atomic_uint_fast64_t m_next_harvest_tsc = UINT64_MAX;
+
+err_t init_heatmap(virtdbg_memmap_entry_t* entries, size_t count) {
+    uintptr_t top = 0;
+    for (size_t i = 0; i < count; i++) {
+        top = MAX(top, entries[i].base + entries[i].length);
+    }
+    m_region_count = ALIGN_UP(top, HEATMAP_REGION_SIZE) / HEATMAP_REGION_SIZE;
+    return NO_ERROR;
+}
+
+err_t heatmap_start(uint32_t interval_ms) {
+    err_t err = NO_ERROR;
+    lock(&m_heatmap_lock);
+
+    CHECK(interval_ms != 0);
+    CHECK_ERROR(ept_accessed_dirty_supported(), ERROR_UNSUPPORTED);
+
+    uint64_t tsc_hz = cpu_tsc_frequency();
+    CHECK_ERROR(tsc_hz != 0, ERROR_UNSUPPORTED, "Could not get the tsc frequency");
+
+    if (m_regions == NULL) {
+        m_regions = pallocz(sizeof(heatmap_region_t) * m_region_count);
+        CHECK_ERROR(m_regions != NULL, ERROR_OUT_OF_RESOURCES);
+        m_counts = pallocz(sizeof(heatmap_count_t) * m_region_count);
+        CHECK_ERROR(m_counts != NULL, ERROR_OUT_OF_RESOURCES);
+    }
+
+    if (!m_running) {
+        CHECK_AND_RETHROW(ept_enable_accessed_dirty());
+        m_running = true;
+    }
+
+    m_interval_cycles = tsc_hz / 1000 * interval_ms;
+    atomic_store_explicit(&m_next_harvest_tsc, __rdtsc() + m_interval_cycles, memory_order_relaxed);
+
+    // make sure there is an exit to harvest on even if the guest is quiet
+    CHECK_AND_RETHROW(timer_start(TIMER_HEATMAP, m_interval_cycles));
+
+    TRACE("heatmap: harvesting %lu regions every %dms", m_region_count, interval_ms);
+
+cleanup:
+    unlock(&m_heatmap_lock);
+    return err;
+}
+
+void heatmap_stop() {
+    lock(&m_heatmap_lock);
+
+    atomic_store_explicit(&m_next_harvest_tsc, UINT64_MAX, memory_order_relaxed);
+    timer_stop(TIMER_HEATMAP);
+    if (m_running) {
+        ept_disable_accessed_dirty();
+        m_running = false;
+    }
+
+    unlock(&m_heatmap_lock);
+}
+
+void heatmap_clear() {
+    lock(&m_heatmap_lock);
+
+    if (m_regions != NULL) {
+        memset(m_regions, 0, sizeof(heatmap_region_t) * m_region_count);
+    }
+    m_harvests = 0;
+
+    unlock(&m_heatmap_lock);
+}
+
+static void count_accessed(uintptr_t gpa, uint64_t size, bool dirty, void* ctx) {
+    size_t pages = MIN(size, HEATMAP_REGION_SIZE) / 0x1000;
+
+    // a 1GB page covers a bunch of regions
+    size_t region = gpa / HEATMAP_REGION_SIZE;
+    for (uint64_t covered = 0; covered < size && region < m_region_count; covered += HEATMAP_REGION_SIZE) {
+        m_counts[region].accessed += pages;
+        if (dirty) {
+            m_counts[region].dirty += pages;
+        }
+        region++;
+    }
+}
+
+void heatmap_scan() {
+    lock(&m_heatmap_lock);
+
+    if (m_regions == NULL) {
+        goto cleanup;
+    }
+
+    ept_harvest_accessed(count_accessed, NULL);
+
+    for (size_t i = 0; i < m_region_count; i++) {
+        heatmap_region_t* region = &m_regions[i];
+        uint8_t accessed = m_counts[i].accessed * 255 / HEATMAP_REGION_PAGES;
+        uint8_t dirty = m_counts[i].dirty * 255 / HEATMAP_REGION_PAGES;
+
+        // a moving average that forgets a region about 4 harvests
+        // after the guest stopped touching it
+        region->accessed = (region->accessed * 3 + accessed) / 4;
+        region->dirty = (region->dirty * 3 + dirty) / 4;
+
+        m_counts[i] = (heatmap_count_t){ 0 };
+    }
+    m_harvests++;
+
+cleanup:
+    unlock(&m_heatmap_lock);
+}
+
+void heatmap_poll(uint64_t tsc) {
+    uint64_t next = atomic_load_explicit(&m_next_harvest_tsc, memory_order_relaxed);
+    if (tsc < next) {
+        return;
+    }
+
+    // only the vcpu that moves the deadline harvests
+    if (!atomic_compare_exchange_strong_explicit(&m_next_harvest_tsc, &next, tsc + m_interval_cycles,
+                                                 memory_order_relaxed, memory_order_relaxed)) {
+        return;
+    }
+
+    heatmap_scan();
+}
+
+void heatmap_dump(void (*write_line)(const char* line, void* ctx), void* ctx) {
+    char line[64];
+    lock(&m_heatmap_lock);
+
+    ksnprintf(line, sizeof(line), "# %lu harvests, %luMB regions: base accessed dirty",
+              m_harvests, HEATMAP_REGION_SIZE / (1024 * 1024));
+    write_line(line, ctx);
+
+    for (size_t i = 0; m_regions != NULL && i < m_region_count; i++) {
+        heatmap_region_t* region = &m_regions[i];
+        if (region->accessed == 0 && region->dirty == 0) {
+            continue;
+        }
+
+        ksnprintf(line, sizeof(line), "%lx %d %d", i * HEATMAP_REGION_SIZE, region->accessed, region->dirty);
+        write_line(line, ctx);
+    }
+
+    unlock(&m_heatmap_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef __VIRTDBG_HEATMAP_H__
+#define __VIRTDBG_HEATMAP_H__
+
+#include <util/except.h>
+#include <virtdbg.h>
+#include <stdint.h>
+
+/**
+ * The size of the memory every heatmap entry covers
+ */
+#define HEATMAP_REGION_SIZE (2ull * 1024 * 1024)
+
+/**
+ * Size the heatmap to cover all of the memory map
+ */
+err_t init_heatmap(virtdbg_memmap_entry_t* entries, size_t count);
+
+/**
+ * Turn on the ept accessed and dirty bits and harvest them every
+ * interval, nothing the guest does traps. The vcpu timer makes sure
+ * there is an exit to harvest on every interval.
+ *
+ * Only the default ept view is harvested, the other views are only
+ * used to step a single instruction over watched or breakpoint pages
+ * so what the guest touches in them is left out.
+ */
+err_t heatmap_start(uint32_t interval_ms);
+
+/**
+ * Stop harvesting and let go of the accessed and dirty bits, the
+ * heatmap is kept
+ */
+void heatmap_stop();
+
+/**
+ * Throw away the heatmap
+ */
+void heatmap_clear();
+
+/**
+ * Harvest the bits right now instead of waiting for the interval
+ */
+void heatmap_scan();
+
+/**
+ * Harvest the bits if the interval passed, called on every exit, the
+ * first vcpu that sees it does the harvest
+ */
+void heatmap_poll(uint64_t tsc);
+
+/**
+ * Output the regions the guest touched, one line for every region with
+ * the base and how much of it was accessed and written (0-255), every
+ * line is given to the callback without a new line
+ */
+void heatmap_dump(void (*write_line)(const char* line, void* ctx), void* ctx);
+
+#endif //__VIRTDBG_HEATMAP_H__
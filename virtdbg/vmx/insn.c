@@ -0,0 +1,169 @@
+#include <util/defs.h>
+#include <vmx/guest_mem.h>
+#include <vmx/vcpu.h>
+#include <vmx/vmm.h>
+
+#include "insn.h"
+
+/**
+ * The longest an x86 instruction can be
+ */
+#define INSN_MAX_LENGTH 15
+
+/**
+ * The code segment L and D/B bits in the vmcs access rights
+ */
+#define CS_AR_LONG_MODE (1u << 13)
+#define CS_AR_DEFAULT_BIG (1u << 14)
+
+/**
+ * Read as much of the instruction as is mapped, it may end right
+ * before an unmapped page
+ */
+static size_t read_insn(vcpu_t* vcpu, uint8_t* code) {
+    uint64_t cr3 = vmread(VMCS_FIELD_GUEST_CR3);
+    uintptr_t rip = vmread(VMCS_FIELD_GUEST_CS_BASE) + guest_rip(&vcpu->exit);
+
+    size_t first = MIN(INSN_MAX_LENGTH, 0x1000 - (rip & 0xFFF));
+    if (!guest_read(cr3, rip, code, first)) {
+        return 0;
+    }
+    if (first < INSN_MAX_LENGTH && guest_read(cr3, rip + first, code + first, INSN_MAX_LENGTH - first)) {
+        return INSN_MAX_LENGTH;
+    }
+    return first;
+}
+
+/**
+ * The size of the two byte opcodes, the sse ones depend on the mandatory prefix
+ */
+static size_t two_byte_access_size(uint8_t op, uint8_t modrm, size_t opsize, bool rex_w, uint8_t rep, bool opsize_prefix) {
+    if (op >= 0x40 && op <= 0x4F) {
+        // cmovcc
+        return opsize;
+    }
+    if (op >= 0x90 && op <= 0x9F) {
+        // setcc
+        return 1;
+    }
+
+    switch (op) {
+        case 0xB6: case 0xBE: case 0xB0: case 0xC0: return 1;
+        case 0xB7: case 0xBF: return 2;
+        case 0xAF: case 0xB1: case 0xC1: case 0xBA: return opsize;
+
+        // cmpxchg8b/16b
+        case 0xC7: return ((modrm >> 3) & 7) == 1 ? (rex_w ? 16 : 8) : 0;
+
+        // movups/movss/movsd/movupd
+        case 0x10: case 0x11:
+            return rep == 0xF3 ? 4 : rep == 0xF2 ? 8 : 16;
+
+        // movaps/movapd, movntps/movntpd
+        case 0x28: case 0x29: case 0x2B: return 16;
+
+        // movq/movdqa/movdqu
+        case 0x6F: case 0x7F: return (opsize_prefix || rep == 0xF3) ? 16 : 8;
+        case 0xE7: return opsize_prefix ? 16 : 8;
+        case 0xD6: return 8;
+
+        // movd/movq
+        case 0x6E: return rex_w ? 8 : 4;
+        case 0x7E: return rep == 0xF3 ? 8 : rex_w ? 8 : 4;
+
+        default: return 0;
+    }
+}
+
+size_t insn_access_size(vcpu_t* vcpu) {
+    uint8_t code[INSN_MAX_LENGTH];
+    size_t length = read_insn(vcpu, code);
+
+    uint32_t cs_ar = vmread(VMCS_FIELD_GUEST_CS_AR_BYTES);
+    bool long_mode = cs_ar & CS_AR_LONG_MODE;
+    bool big = long_mode || (cs_ar & CS_AR_DEFAULT_BIG);
+
+    // the prefixes, only the operand size and rep ones matter
+    size_t i = 0;
+    bool opsize_prefix = false;
+    uint8_t rep = 0;
+    for (; i < length; i++) {
+        uint8_t c = code[i];
+        if (c == 0x66) {
+            opsize_prefix = true;
+        } else if (c == 0xF2 || c == 0xF3) {
+            rep = c;
+        } else if (c != 0x67 && c != 0xF0 && c != 0x2E && c != 0x36 &&
+                   c != 0x3E && c != 0x26 && c != 0x64 && c != 0x65) {
+            break;
+        }
+    }
+
+    bool rex_w = false;
+    if (long_mode && i < length && (code[i] & 0xF0) == 0x40) {
+        rex_w = code[i] & 0x08;
+        i++;
+    }
+
+    // need the opcode and whatever may be after it
+    if (i + 2 >= length) {
+        return 0;
+    }
+    uint8_t op = code[i];
+    uint8_t modrm = code[i + 1];
+    uint8_t reg = (modrm >> 3) & 7;
+
+    size_t opsize = rex_w ? 8 : (big != opsize_prefix) ? 4 : 2;
+    size_t stack = long_mode ? (opsize_prefix ? 2 : 8) : opsize;
+
+    if (op == 0x0F) {
+        return two_byte_access_size(code[i + 1], code[i + 2], opsize, rex_w, rep, opsize_prefix);
+    }
+
+    // add/or/adc/sbb/and/sub/xor/cmp with a memory operand
+    if (op < 0x40 && (op & 7) < 4) {
+        return (op & 1) ? opsize : 1;
+    }
+
+    // push/pop of a register
+    if (op >= 0x50 && op <= 0x5F) {
+        return stack;
+    }
+
+    switch (op) {
+        case 0x80: case 0x82: case 0x84: case 0x86: case 0x88: case 0x8A:
+        case 0xC0: case 0xC6: case 0xD0: case 0xD2: case 0xF6: case 0xFE:
+        case 0xA0: case 0xA2:
+        case 0xA4: case 0xA6: case 0xAA: case 0xAC: case 0xAE:
+            return 1;
+
+        case 0x81: case 0x83: case 0x85: case 0x87: case 0x89: case 0x8B:
+        case 0xC1: case 0xC7: case 0xD1: case 0xD3: case 0xF7:
+        case 0x69: case 0x6B:
+        case 0xA1: case 0xA3:
+        case 0xA5: case 0xA7: case 0xAB: case 0xAD: case 0xAF:
+            return opsize;
+
+        // movsxd
+        case 0x63: return long_mode ? 4 : 0;
+
+        // mov to and from a segment register
+        case 0x8C: case 0x8E: return 2;
+
+        // call/ret and pop r/m
+        case 0xE8: case 0xC2: case 0xC3: case 0x8F:
+            return stack;
+
+        // inc/dec, near call/jmp and push, the far ones are not known
+        case 0xFF:
+            if (reg <= 1) {
+                return opsize;
+            } else if (reg == 2 || reg == 4 || reg == 6) {
+                return stack;
+            }
+            return 0;
+
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef __VIRTDBG_INSN_H__
+#define __VIRTDBG_INSN_H__
+
+#include <stddef.h>
+
+struct vcpu;
+
+/**
+ * Decode how many bytes the instruction at the guest rip accesses in
+ * memory, only the common general purpose and sse moves are known and
+ * anything else (x87, avx, bit tests with a register offset) gives 0
+ */
+size_t insn_access_size(struct vcpu* vcpu);
+
+#endif //__VIRTDBG_INSN_H__
@@ -0,0 +1,158 @@
+#include <drivers/serial.h>
+#include <arch/intrin.h>
+#include <util/string.h>
+#include <mm/pmm.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+#include <vmx/guest_mem.h>
+#include <vmx/vmm.h>
+
+#include "io_bitmap.h"
+
+//! Vol 3C, Table 27-5. Exit Qualification for I/O Instructions
+typedef union vmx_io_exit_qualification {
+    struct {
+        uint64_t size : 3;
+        uint64_t in : 1;
+        uint64_t string : 1;
+        uint64_t rep : 1;
+        uint64_t immediate : 1;
+        uint64_t _reserved0 : 9;
+        uint64_t port : 16;
+        uint64_t _reserved1 : 32;
+    };
+    uint64_t raw;
+} vmx_io_exit_qualification_t;
+
+//! Vol 3C, Table 27-8. Format of the VM-Exit Instruction-Information Field as Used for INS and OUTS
+typedef union vmx_io_instruction_info {
+    struct {
+        uint32_t _reserved0 : 7;
+        uint32_t address_size : 3;
+#define VMX_ADDRESS_SIZE_16BIT  0
+#define VMX_ADDRESS_SIZE_32BIT  1
+#define VMX_ADDRESS_SIZE_64BIT  2
+        uint32_t _reserved1 : 5;
+        uint32_t segment : 3;
+        uint32_t _reserved2 : 14;
+    };
+    uint32_t raw;
+} vmx_io_instruction_info_t;
+
+/**
+ * The ports every new vcpu intercepts, same layout as the
+ * io bitmaps themselves
+ */
+static uint8_t* m_io_intercepts;
+
+static err_t set_bits(uint8_t* bitmap, uint16_t port, size_t count, bool value) {
+    err_t err = NO_ERROR;
+
+    CHECK(bitmap != NULL);
+    CHECK(port + count <= 0x10000, "port range %x+%x is out of range", port, count);
+
+    for (size_t i = port; i < port + count; i++) {
+        if (value) {
+            bitmap[i / 8] |= 1 << (i % 8);
+        } else {
+            bitmap[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+
+cleanup:
+    return err;
+}
+
+static vmexit_action_t handle_io_instruction(vcpu_t* vcpu);
+
+err_t init_io_bitmap() {
+    err_t err = NO_ERROR;
+
+    m_io_intercepts = pallocz(IO_BITMAP_SIZE);
+    CHECK_ERROR(m_io_intercepts != NULL, ERROR_OUT_OF_RESOURCES);
+
+    // the debugger talks over this one
+    CHECK_AND_RETHROW(io_bitmap_intercept(SERIAL_BASE, SERIAL_PORT_COUNT));
+
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_IO_INSTRUCTION, handle_io_instruction));
+
+cleanup:
+    return err;
+}
+
+err_t io_bitmap_intercept(uint16_t port, size_t count) {
+    return set_bits(m_io_intercepts, port, count, true);
+}
+
+err_t init_vcpu_io_bitmap(vcpu_t* vcpu) {
+    err_t err = NO_ERROR;
+
+    // bitmap A is the first page and bitmap B is the second page
+    vcpu->io_bitmap = pallocz_aligned(IO_BITMAP_SIZE, 0x1000);
+    CHECK_ERROR(vcpu->io_bitmap != NULL, ERROR_OUT_OF_RESOURCES);
+    memcpy(vcpu->io_bitmap, m_io_intercepts, IO_BITMAP_SIZE);
+
+cleanup:
+    return err;
+}
+
+err_t vcpu_io_intercept(vcpu_t* vcpu, uint16_t port, size_t count, bool intercept) {
+    return set_bits(vcpu->io_bitmap, port, count, intercept);
+}
+
+/**
+ * Update a register the way an instruction with the given address size
+ * does, a 32bit one zero extends and a 16bit one keeps the upper bits
+ */
+static uint64_t set_address_register(uint64_t reg, uint64_t value, uint64_t mask) {
+    if (mask == 0xFFFF) {
+        return (reg & ~mask) | (value & mask);
+    }
+    return value & mask;
+}
+
+/**
+ * The hypervisor owned ports look like an empty bus to the guest
+ */
+static vmexit_action_t handle_io_instruction(vcpu_t* vcpu) {
+    vmx_io_exit_qualification_t qual = { .raw = vmexit_qualification(&vcpu->exit) };
+    size_t size = qual.size + 1;
+
+    if (qual.string) {
+        vmx_io_instruction_info_t info = { .raw = vmread(VMCS_FIELD_INSTRUCTION_INFO) };
+        uint64_t mask = info.address_size == VMX_ADDRESS_SIZE_16BIT ? 0xFFFF :
+                        info.address_size == VMX_ADDRESS_SIZE_32BIT ? 0xFFFFFFFF : UINT64_MAX;
+
+        size_t count = qual.rep ? (vcpu->guest.rcx & mask) : 1;
+        ia32_rflags_t rflags = { .raw = guest_rflags(&vcpu->exit) };
+        uint64_t delta = (rflags.DF ? -1 : 1) * (int64_t)(count * size);
+
+        if (qual.in) {
+            // the bus floats high, ins always goes through es, going
+            // down fills the elements below rdi, all of them are 0xFF so
+            // the order does not matter, unmapped memory is skipped
+            uint64_t rdi = vcpu->guest.rdi & mask;
+            uint64_t first = rflags.DF ? ((rdi - (count - 1) * size) & mask) : rdi;
+            if (count != 0) {
+                guest_fill(vmread(VMCS_FIELD_GUEST_CR3), vmread(VMCS_FIELD_GUEST_ES_BASE) + first, 0xFF, count * size);
+            }
+            vcpu->guest.rdi = set_address_register(vcpu->guest.rdi, rdi + delta, mask);
+        } else {
+            // nothing takes the data, just move past it
+            vcpu->guest.rsi = set_address_register(vcpu->guest.rsi, vcpu->guest.rsi + delta, mask);
+        }
+        if (qual.rep) {
+            vcpu->guest.rcx = set_address_register(vcpu->guest.rcx, 0, mask);
+        }
+    } else if (qual.in) {
+        // nothing is connected, the bus floats high, a 32bit
+        // in zero extends like any other 32bit operation
+        if (size == 4) {
+            vcpu->guest.rax = 0xFFFFFFFF;
+        } else {
+            vcpu->guest.rax |= (1ull << (size * 8)) - 1;
+        }
+    }
+
+    return VMEXIT_ADVANCE;
+}
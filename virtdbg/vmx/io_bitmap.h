@@ -0,0 +1,38 @@
+#ifndef __VIRTDBG_IO_BITMAP_H__
+#define __VIRTDBG_IO_BITMAP_H__
+
+#include <util/except.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct vcpu;
+
+/**
+ * The size of io bitmaps A and B together, a bit per port
+ */
+#define IO_BITMAP_SIZE (0x10000 / 8)
+
+/**
+ * Setup the set of ports intercepted by default on every vcpu, this
+ * includes the ports owned by the hypervisor itself, and register the
+ * io exit handler
+ */
+err_t init_io_bitmap();
+
+/**
+ * Intercept the given port range on every vcpu that is initialized
+ * from now on
+ */
+err_t io_bitmap_intercept(uint16_t port, size_t count);
+
+/**
+ * Allocate the io bitmaps of a vcpu from the default intercepts
+ */
+err_t init_vcpu_io_bitmap(struct vcpu* vcpu);
+
+/**
+ * Change the interception of a port range only on the given vcpu
+ */
+err_t vcpu_io_intercept(struct vcpu* vcpu, uint16_t port, size_t count, bool intercept);
+
+#endif //__VIRTDBG_IO_BITMAP_H__
@@ -0,0 +1,233 @@
+#include <arch/intrin.h>
+#include <arch/msr.h>
+#include <util/defs.h>
+
+#include "mem_type.h"
+
+#define MEM_TYPE_MAX_RANGES 128
+
+/**
+ * A range of physical memory with a single type, the ranges are sorted
+ * and together cover the whole physical address space
+ */
+typedef struct mem_type_range {
+    uint64_t base;
+
+    // inclusive, so the last range can reach the end of the address space
+    uint64_t last;
+
+    uint8_t type;
+
+    // covered by a variable mtrr, overlapping variable mtrrs are combined
+    bool variable;
+} mem_type_range_t;
+
+static mem_type_range_t m_ranges[MEM_TYPE_MAX_RANGES];
+static size_t m_range_count = 0;
+
+/**
+ * The type of memory covered by two variable mtrrs, anything the sdm
+ * leaves undefined is treated as uncachable
+ */
+static uint8_t combine_variable(uint8_t a, uint8_t b) {
+    if (a == b) {
+        return a;
+    } else if (a == MEM_TYPE_UC || b == MEM_TYPE_UC) {
+        return MEM_TYPE_UC;
+    } else if ((a == MEM_TYPE_WT && b == MEM_TYPE_WB) || (a == MEM_TYPE_WB && b == MEM_TYPE_WT)) {
+        return MEM_TYPE_WT;
+    } else {
+        return MEM_TYPE_UC;
+    }
+}
+
+/**
+ * Split the range containing the address so a range starts right at it
+ */
+static err_t split_at(uint64_t address) {
+    err_t err = NO_ERROR;
+
+    size_t i = 0;
+    while (m_ranges[i].last < address) {
+        i++;
+    }
+
+    if (m_ranges[i].base == address) {
+        goto cleanup;
+    }
+
+    CHECK_ERROR(m_range_count < MEM_TYPE_MAX_RANGES, ERROR_OUT_OF_RESOURCES);
+    for (size_t j = m_range_count; j > i + 1; j--) {
+        m_ranges[j] = m_ranges[j - 1];
+    }
+    m_range_count++;
+
+    m_ranges[i + 1] = m_ranges[i];
+    m_ranges[i + 1].base = address;
+    m_ranges[i].last = address - 1;
+
+cleanup:
+    return err;
+}
+
+/**
+ * Join neighbouring ranges that ended up with the same type
+ */
+static void merge_ranges() {
+    size_t count = 1;
+    for (size_t i = 1; i < m_range_count; i++) {
+        mem_type_range_t* prev = &m_ranges[count - 1];
+        if (prev->type == m_ranges[i].type && prev->variable == m_ranges[i].variable) {
+            prev->last = m_ranges[i].last;
+        } else {
+            m_ranges[count++] = m_ranges[i];
+        }
+    }
+    m_range_count = count;
+}
+
+static err_t set_type(uint64_t base, uint64_t last, uint8_t type, bool variable) {
+    err_t err = NO_ERROR;
+
+    CHECK_AND_RETHROW(split_at(base));
+    if (last != UINT64_MAX) {
+        CHECK_AND_RETHROW(split_at(last + 1));
+    }
+
+    for (size_t i = 0; i < m_range_count; i++) {
+        mem_type_range_t* range = &m_ranges[i];
+        if (range->base < base || range->last > last) {
+            continue;
+        }
+
+        if (variable && range->variable) {
+            range->type = combine_variable(range->type, type);
+        } else {
+            range->type = type;
+        }
+        range->variable = variable;
+    }
+
+    merge_ranges();
+
+cleanup:
+    return err;
+}
+
+/**
+ * Every fixed mtrr holds the types of 8 consecutive ranges
+ */
+static err_t read_fixed_mtrr(uint32_t msr, uint64_t base, uint64_t size) {
+    err_t err = NO_ERROR;
+
+    uint64_t types = __rdmsr(msr);
+    for (int i = 0; i < 8; i++) {
+        uint64_t range_base = base + i * size;
+        CHECK_AND_RETHROW(set_type(range_base, range_base + size - 1, (types >> (i * 8)) & 0xFF, false));
+    }
+
+cleanup:
+    return err;
+}
+
+static uint64_t get_physical_address_mask() {
+    uint32_t regs[4];
+    int width = 36;
+
+    __cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000008) {
+        __cpuid(0x80000008, 0, regs);
+        width = regs[0] & 0xFF;
+    }
+
+    return (1ull << width) - 1;
+}
+
+err_t init_mem_types() {
+    err_t err = NO_ERROR;
+
+    TRACE("Initializing memory types");
+
+    msr_mtrrcap_t cap = { .raw = __rdmsr(MSR_IA32_MTRRCAP) };
+    msr_mtrr_def_type_t def_type = { .raw = __rdmsr(MSR_IA32_MTRR_DEF_TYPE) };
+
+    // with the mtrrs disabled all of memory is uncachable
+    m_ranges[0] = (mem_type_range_t){
+        .base = 0,
+        .last = UINT64_MAX,
+        .type = def_type.enable ? def_type.type : MEM_TYPE_UC,
+    };
+    m_range_count = 1;
+
+    if (def_type.enable) {
+        uint64_t address_mask = get_physical_address_mask();
+        for (int i = 0; i < cap.variable_count; i++) {
+            uint64_t physmask = __rdmsr(MSR_IA32_MTRR_PHYSMASK(i));
+            if (!(physmask & MSR_IA32_MTRR_PHYSMASK_VALID)) {
+                continue;
+            }
+
+            // we only support masks that make a single range
+            uint64_t physbase = __rdmsr(MSR_IA32_MTRR_PHYSBASE(i));
+            uint64_t base = physbase & address_mask & ~0xFFFull;
+            uint64_t last = base + ((~physmask & address_mask) | 0xFFF);
+            CHECK_AND_RETHROW(set_type(base, last, physbase & 0xFF, true));
+        }
+
+        // the fixed ranges take precedence over the variable ones
+        if (cap.fixed_supported && def_type.fixed_enable) {
+            CHECK_AND_RETHROW(read_fixed_mtrr(MSR_IA32_MTRR_FIX64K_00000, 0x00000, 0x10000));
+            CHECK_AND_RETHROW(read_fixed_mtrr(MSR_IA32_MTRR_FIX16K_80000, 0x80000, 0x4000));
+            CHECK_AND_RETHROW(read_fixed_mtrr(MSR_IA32_MTRR_FIX16K_A0000, 0xA0000, 0x4000));
+            for (int i = 0; i < 8; i++) {
+                CHECK_AND_RETHROW(read_fixed_mtrr(MSR_IA32_MTRR_FIX4K_C0000 + i, 0xC0000 + i * 0x8000, 0x1000));
+            }
+        }
+    }
+
+    // the combining is done, only the type matters from now on
+    for (size_t i = 0; i < m_range_count; i++) {
+        m_ranges[i].variable = false;
+    }
+    merge_ranges();
+
+    for (size_t i = 0; i < m_range_count; i++) {
+        TRACE("\t%p-%p: %d", m_ranges[i].base, m_ranges[i].last, m_ranges[i].type);
+    }
+
+cleanup:
+    return err;
+}
+
+err_t mem_type_override(uint64_t base, uint64_t size, uint8_t type) {
+    err_t err = NO_ERROR;
+
+    CHECK(size != 0);
+    uint64_t last = ALIGN_UP(base + size, 0x1000) - 1;
+    base &= ~0xFFFull;
+    CHECK_AND_RETHROW(set_type(base, last, type, false));
+
+cleanup:
+    return err;
+}
+
+bool mem_type_of(uint64_t base, uint64_t size, uint8_t* type) {
+    uint64_t last = base + size - 1;
+
+    bool found = false;
+    for (size_t i = 0; i < m_range_count; i++) {
+        mem_type_range_t* range = &m_ranges[i];
+        if (range->last < base || range->base > last) {
+            continue;
+        }
+
+        if (found && *type != range->type) {
+            return false;
+        }
+
+        *type = range->type;
+        found = true;
+    }
+
+    return found;
+}
@@ -0,0 +1,37 @@
+#ifndef __VIRTDBG_MEM_TYPE_H__
+#define __VIRTDBG_MEM_TYPE_H__
+
+#include <util/except.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * The memory types, the same encoding is used by the mtrrs, the pat
+ * and the ept
+ */
+#define MEM_TYPE_UC     0
+#define MEM_TYPE_WC     1
+#define MEM_TYPE_WT     4
+#define MEM_TYPE_WP     5
+#define MEM_TYPE_WB     6
+
+/**
+ * Build the index of the physical memory types from the fixed and variable
+ * mtrrs of the current cpu, the firmware sets them the same on all cpus
+ */
+err_t init_mem_types();
+
+/**
+ * Force a memory type on a range regardless of the mtrrs, for example a
+ * framebuffer that should be write combining. Must be done before the
+ * range is mapped to the guest.
+ */
+err_t mem_type_override(uint64_t base, uint64_t size, uint8_t type);
+
+/**
+ * Get the memory type of a range, returns false if the range is made of
+ * more than a single type and needs to be mapped with smaller pages
+ */
+bool mem_type_of(uint64_t base, uint64_t size, uint8_t* type);
+
+#endif //__VIRTDBG_MEM_TYPE_H__
@@ -0,0 +1,202 @@
+#include <arch/intrin.h>
+#include <arch/msr.h>
+#include <arch/idt.h>
+#include <mm/pmm.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+#include <vmx/vmm.h>
+
+#include "msr_bitmap.h"
+
+#define MSR_LOW_START   0x00000000
+#define MSR_LOW_END     0x00001FFF
+#define MSR_HIGH_START  0xC0000000
+#define MSR_HIGH_END    0xC0001FFF
+
+//
+// The layout of the bitmap, each region is 1KB with a bit per msr
+//
+#define MSR_BITMAP_READ_LOW     0x000
+#define MSR_BITMAP_READ_HIGH    0x400
+#define MSR_BITMAP_WRITE_LOW    0x800
+#define MSR_BITMAP_WRITE_HIGH   0xC00
+
+uint8_t* g_msr_bitmap;
+
+static void set_bit(size_t offset, uint32_t bit, bool value) {
+    uint8_t* byte = &g_msr_bitmap[offset + bit / 8];
+    if (value) {
+        *byte |= 1 << (bit % 8);
+    } else {
+        *byte &= ~(1 << (bit % 8));
+    }
+}
+
+err_t msr_bitmap_intercept(uint32_t msr, bool read, bool write) {
+    err_t err = NO_ERROR;
+
+    CHECK(g_msr_bitmap != NULL);
+
+    if (msr <= MSR_LOW_END) {
+        set_bit(MSR_BITMAP_READ_LOW, msr - MSR_LOW_START, read);
+        set_bit(MSR_BITMAP_WRITE_LOW, msr - MSR_LOW_START, write);
+    } else if (MSR_HIGH_START <= msr && msr <= MSR_HIGH_END) {
+        set_bit(MSR_BITMAP_READ_HIGH, msr - MSR_HIGH_START, read);
+        set_bit(MSR_BITMAP_WRITE_HIGH, msr - MSR_HIGH_START, write);
+    } else {
+        CHECK_FAIL_ERROR(ERROR_UNSUPPORTED, "msr %x is outside of the msr bitmap", msr);
+    }
+
+cleanup:
+    return err;
+}
+
+static vmexit_action_t handle_msr_read(vcpu_t* vcpu);
+static vmexit_action_t handle_msr_write(vcpu_t* vcpu);
+
+err_t init_msr_bitmap() {
+    err_t err = NO_ERROR;
+
+    // start with everything passed through
+    g_msr_bitmap = pallocz_aligned(0x1000, 0x1000);
+    CHECK_ERROR(g_msr_bitmap != NULL, ERROR_OUT_OF_RESOURCES);
+
+    // the guest efer lives in the vmcs and is not saved on exit, so
+    // we must see every write to it
+    CHECK_AND_RETHROW(msr_bitmap_intercept(MSR_IA32_EFER, false, true));
+
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_MSR_READ, handle_msr_read));
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_MSR_WRITE, handle_msr_write));
+
+cleanup:
+    return err;
+}
+
+/**
+ * The bits of the msrs the vm entry checks, a guest write that sets any of
+ * the reserved ones would fail the entry
+ */
+#define EFER_VALID_BITS     ((1ull << 0) | (1ull << 8) | (1ull << 10) | (1ull << 11))
+#define DEBUGCTL_VALID_BITS ((1ull << 0) | (1ull << 1) | (0x3FFull << 6))
+
+static bool is_canonical(uint64_t address) {
+    return (uint64_t)(((int64_t)address << 16) >> 16) == address;
+}
+
+/**
+ * Give the guest the #GP the cpu would have given it
+ */
+static void inject_gp() {
+    vmx_interruption_info_t info = {
+        .vector = EXCEPT_GP_FAULT,
+        .type = VMX_INTERRUPTION_TYPE_HARDWARE_EXCEPTION,
+        .error_code_valid = 1,
+        .valid = 1,
+    };
+    vmwrite(VMCS_FIELD_VM_ENTRY_INTR_INFO, info.raw);
+    vmwrite(VMCS_FIELD_VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+}
+
+/**
+ * Emulate a rdmsr of an intercepted msr
+ */
+static vmexit_action_t handle_msr_read(vcpu_t* vcpu) {
+    uint32_t msr = vcpu->guest.rcx;
+    uint64_t value;
+
+    // msrs that are switched on entry/exit are taken from the
+    // vmcs, everything else is shared with the host
+    switch (msr) {
+        case MSR_IA32_EFER: value = vmread(VMCS_FIELD_GUEST_EFER_FULL); break;
+        case MSR_IA32_DEBUGCTL: value = vmread(VMCS_FIELD_GUEST_IA32_DEBUGCTL_FULL); break;
+        case MSR_IA32_FS_BASE: value = vmread(VMCS_FIELD_GUEST_FS_BASE); break;
+        case MSR_IA32_GS_BASE: value = vmread(VMCS_FIELD_GUEST_GS_BASE); break;
+        case MSR_IA32_SYSENTER_CS: value = vmread(VMCS_FIELD_GUEST_SYSENTER_CS); break;
+        case MSR_IA32_SYSENTER_ESP: value = vmread(VMCS_FIELD_GUEST_SYSENTER_ESP); break;
+        case MSR_IA32_SYSENTER_EIP: value = vmread(VMCS_FIELD_GUEST_SYSENTER_EIP); break;
+        default: {
+            // msrs outside of the bitmap always exit, including
+            // ones the cpu doesn't have
+            if (!__rdmsr_safe(msr, &value)) {
+                inject_gp();
+                return VMEXIT_RESUME;
+            }
+        } break;
+    }
+
+    vcpu->guest.rax = value & 0xFFFFFFFF;
+    vcpu->guest.rdx = value >> 32;
+
+    return VMEXIT_ADVANCE;
+}
+
+/**
+ * Emulate a wrmsr of an intercepted msr
+ */
+static vmexit_action_t handle_msr_write(vcpu_t* vcpu) {
+    uint32_t msr = vcpu->guest.rcx;
+    uint64_t value = (vcpu->guest.rax & 0xFFFFFFFF) | (vcpu->guest.rdx << 32);
+
+    // the vmcs fields are checked on entry, a bad value must fault
+    // in the guest instead of failing the entry
+    bool valid = true;
+    switch (msr) {
+        case MSR_IA32_EFER: {
+            valid = (value & ~EFER_VALID_BITS) == 0;
+            if (valid) {
+                // LMA is controlled by the cpu, keep it as is
+                msr_efer_t old = { .raw = vmread(VMCS_FIELD_GUEST_EFER_FULL) };
+                msr_efer_t efer = { .raw = value };
+                efer.long_mode_active = old.long_mode_active;
+                vmwrite(VMCS_FIELD_GUEST_EFER_FULL, efer.raw);
+            }
+        } break;
+
+        case MSR_IA32_DEBUGCTL: {
+            valid = (value & ~DEBUGCTL_VALID_BITS) == 0;
+            if (valid) {
+                vmwrite(VMCS_FIELD_GUEST_IA32_DEBUGCTL_FULL, value);
+            }
+        } break;
+
+        case MSR_IA32_FS_BASE: {
+            valid = is_canonical(value);
+            if (valid) {
+                vmwrite(VMCS_FIELD_GUEST_FS_BASE, value);
+            }
+        } break;
+
+        case MSR_IA32_GS_BASE: {
+            valid = is_canonical(value);
+            if (valid) {
+                vmwrite(VMCS_FIELD_GUEST_GS_BASE, value);
+            }
+        } break;
+
+        case MSR_IA32_SYSENTER_ESP: {
+            valid = is_canonical(value);
+            if (valid) {
+                vmwrite(VMCS_FIELD_GUEST_SYSENTER_ESP, value);
+            }
+        } break;
+
+        case MSR_IA32_SYSENTER_EIP: {
+            valid = is_canonical(value);
+            if (valid) {
+                vmwrite(VMCS_FIELD_GUEST_SYSENTER_EIP, value);
+            }
+        } break;
+
+        case MSR_IA32_SYSENTER_CS: vmwrite(VMCS_FIELD_GUEST_SYSENTER_CS, value & 0xFFFFFFFF); break;
+
+        // the rest is shared with the host, the cpu checks the value
+        default: valid = __wrmsr_safe(msr, value); break;
+    }
+
+    if (!valid) {
+        inject_gp();
+        return VMEXIT_RESUME;
+    }
+
+    return VMEXIT_ADVANCE;
+}
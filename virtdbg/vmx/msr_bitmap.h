@@ -0,0 +1,27 @@
+#ifndef __VIRTDBG_MSR_BITMAP_H__
+#define __VIRTDBG_MSR_BITMAP_H__
+
+#include <util/except.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * The msr bitmap shared by all the vcpus, every msr that is not
+ * intercepted in it is passed directly to the guest
+ */
+extern uint8_t* g_msr_bitmap;
+
+/**
+ * Allocate the msr bitmap, set the default interceptions and register
+ * the msr exit handlers
+ */
+err_t init_msr_bitmap();
+
+/**
+ * Choose whether guest reads and writes to the given msr cause a vmexit,
+ * msrs outside of the low (0x0-0x1FFF) and high (0xC0000000-0xC0001FFF)
+ * ranges always exit and can not be passed through.
+ */
+err_t msr_bitmap_intercept(uint32_t msr, bool read, bool write);
+
+#endif //__VIRTDBG_MSR_BITMAP_H__
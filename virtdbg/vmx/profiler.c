@@ -0,0 +1,165 @@
+#include <arch/intrin.h>
+#include <arch/cpu.h>
+#include <mm/pmm.h>
+#include <vmx/guest_mem.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+#include <vmx/timer.h>
+#include <vmx/vmm.h>
+
+#include "profiler.h"
+
+/**
+ * The code segment L bit in the vmcs access rights
+ */
+#define CS_AR_LONG_MODE (1u << 13)
+
+/**
+ * The tsc frequency and the sampling period in tsc cycles, used
+ * for the timestamps and periods of the dump
+ */
+static uint64_t m_tsc_hz;
+static uint64_t m_period_cycles;
+
+static vmexit_action_t take_sample(vcpu_t* vcpu);
+
+err_t init_profiler() {
+    timer_set_handler(TIMER_PROFILER, take_sample);
+    return NO_ERROR;
+}
+
+err_t profiler_start(uint32_t hz, uint8_t callchain_depth) {
+    err_t err = NO_ERROR;
+
+    CHECK(hz != 0);
+    CHECK(callchain_depth <= PROFILER_MAX_CALLCHAIN);
+
+    m_tsc_hz = cpu_tsc_frequency();
+    CHECK_ERROR(m_tsc_hz != 0, ERROR_UNSUPPORTED, "Could not get the tsc frequency");
+    m_period_cycles = m_tsc_hz / hz;
+
+    for (size_t i = 0; i < g_vcpu_count; i++) {
+        vcpu_t* vcpu = g_vcpus[i];
+        if (vcpu == NULL) {
+            continue;
+        }
+
+        profiler_t* profiler = &vcpu->profiler;
+        if (profiler->samples == NULL) {
+            profiler->samples = pallocz(sizeof(profiler_sample_t) * PROFILER_SAMPLES);
+            CHECK_ERROR(profiler->samples != NULL, ERROR_OUT_OF_RESOURCES);
+        }
+
+        profiler->callchain_depth = callchain_depth;
+    }
+
+    CHECK_AND_RETHROW(timer_start(TIMER_PROFILER, m_period_cycles));
+
+    TRACE("profiler: sampling at %dHz (%lu cycles)", hz, m_period_cycles);
+
+cleanup:
+    return err;
+}
+
+void profiler_stop() {
+    timer_stop(TIMER_PROFILER);
+}
+
+void profiler_clear() {
+    for (size_t i = 0; i < g_vcpu_count; i++) {
+        vcpu_t* vcpu = g_vcpus[i];
+        if (vcpu == NULL) {
+            continue;
+        }
+
+        atomic_store_explicit(&vcpu->profiler.count, 0, memory_order_relaxed);
+        vcpu->profiler.lost = 0;
+    }
+}
+
+void profiler_dump(void (*write_line)(const char* line, void* ctx), void* ctx) {
+    char line[128];
+
+    for (size_t i = 0; i < g_vcpu_count; i++) {
+        vcpu_t* vcpu = g_vcpus[i];
+        if (vcpu == NULL || vcpu->profiler.samples == NULL) {
+            continue;
+        }
+
+        size_t count = atomic_load_explicit(&vcpu->profiler.count, memory_order_acquire);
+        for (size_t j = 0; j < count; j++) {
+            profiler_sample_t* sample = &vcpu->profiler.samples[j];
+
+            // the address space takes the place of the process
+            uint64_t pid = sample->cr3 >> 12;
+            uint64_t seconds = sample->tsc / m_tsc_hz;
+            uint64_t micros = (sample->tsc % m_tsc_hz) * 1000000 / m_tsc_hz;
+            ksnprintf(line, sizeof(line), "guest %lu/%lu [%03d] %lu.%06lu: %lu cpu-clock:",
+                      pid, pid, vcpu->id, seconds, micros, m_period_cycles);
+            write_line(line, ctx);
+
+            ksnprintf(line, sizeof(line), "\t%lx [unknown] ([unknown])", sample->rip);
+            write_line(line, ctx);
+            for (size_t k = 0; k < sample->callchain_len; k++) {
+                ksnprintf(line, sizeof(line), "\t%lx [unknown] ([unknown])", sample->callchain[k]);
+                write_line(line, ctx);
+            }
+
+            write_line("", ctx);
+        }
+
+        if (vcpu->profiler.lost != 0) {
+            ksnprintf(line, sizeof(line), "# cpu %d lost %lu samples", vcpu->id, vcpu->profiler.lost);
+            write_line(line, ctx);
+        }
+    }
+}
+
+/**
+ * Follow the guest frame pointers, only done for 64bit code
+ */
+static size_t walk_callchain(vcpu_t* vcpu, uint64_t cr3, uint64_t* callchain, size_t depth) {
+    if (!(vmread(VMCS_FIELD_GUEST_CS_AR_BYTES) & CS_AR_LONG_MODE)) {
+        return 0;
+    }
+
+    uint64_t rbp = vcpu->guest.rbp;
+    size_t len = 0;
+    while (len < depth && rbp != 0 && (rbp & 7) == 0) {
+        // saved rbp followed by the return address
+        uint64_t frame[2];
+        if (!guest_read(cr3, rbp, frame, sizeof(frame)) || frame[1] == 0) {
+            break;
+        }
+        callchain[len++] = frame[1];
+
+        // frames only go up the stack, anything else is garbage
+        if (frame[0] <= rbp) {
+            break;
+        }
+        rbp = frame[0];
+    }
+
+    return len;
+}
+
+/**
+ * Take a sample, called by the timer every period
+ */
+static vmexit_action_t take_sample(vcpu_t* vcpu) {
+    profiler_t* profiler = &vcpu->profiler;
+
+    size_t count = atomic_load_explicit(&profiler->count, memory_order_relaxed);
+    if (count < PROFILER_SAMPLES) {
+        profiler_sample_t* sample = &profiler->samples[count];
+        sample->tsc = __rdtsc();
+        sample->rip = guest_rip(&vcpu->exit);
+        sample->cr3 = vmread(VMCS_FIELD_GUEST_CR3);
+        sample->callchain_len = walk_callchain(vcpu, sample->cr3, sample->callchain, profiler->callchain_depth);
+        atomic_store_explicit(&profiler->count, count + 1, memory_order_release);
+    } else {
+        profiler->lost++;
+    }
+
+    return VMEXIT_RESUME;
+}
@@ -0,0 +1,69 @@
+#ifndef __VIRTDBG_PROFILER_H__
+#define __VIRTDBG_PROFILER_H__
+
+#include <util/except.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct vcpu;
+
+/**
+ * The amount of samples each vcpu can hold until they are cleared
+ */
+#define PROFILER_SAMPLES        1024
+
+/**
+ * The max depth of the frame pointer call chain of a sample
+ */
+#define PROFILER_MAX_CALLCHAIN  8
+
+typedef struct profiler_sample {
+    uint64_t tsc;
+    uint64_t rip;
+    uint64_t cr3;
+    uint64_t callchain_len;
+    uint64_t callchain[PROFILER_MAX_CALLCHAIN];
+} profiler_sample_t;
+
+/**
+ * The per-vcpu profiler state, the samples are taken from the vcpu timer
+ */
+typedef struct profiler {
+    // how many return addresses to record on every sample
+    uint8_t callchain_depth;
+
+    // the samples taken so far, allocated on first start
+    profiler_sample_t* samples;
+    atomic_size_t count;
+    uint64_t lost;
+} profiler_t;
+
+/**
+ * Take the samples from the preemption timer
+ */
+err_t init_profiler();
+
+/**
+ * Start sampling all the vcpus at the given frequency, a call chain of up
+ * to callchain_depth frames is recorded by following the guest frame pointers
+ */
+err_t profiler_start(uint32_t hz, uint8_t callchain_depth);
+
+/**
+ * Stop sampling on all the vcpus, the samples are kept
+ */
+void profiler_stop();
+
+/**
+ * Throw away all the samples taken so far
+ */
+void profiler_clear();
+
+/**
+ * Output the samples of all the vcpus in the format of `perf script`,
+ * every line is given to the callback without a new line
+ */
+void profiler_dump(void (*write_line)(const char* line, void* ctx), void* ctx);
+
+#endif //__VIRTDBG_PROFILER_H__
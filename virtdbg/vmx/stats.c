@@ -0,0 +1,39 @@
+#include <util/string.h>
+#include <util/except.h>
+
+#include "stats.h"
+
+void vmexit_stats_reset(vmexit_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void vmexit_stats_dump(vmexit_stats_t* stats, void (*write_line)(const char* line, void* ctx), void* ctx) {
+    uint64_t total = 0;
+    char line[256];
+
+    write_line("           count       avg cycles  reason", ctx);
+    for (int reason = 0; reason < VMEXIT_REASONS_MAX; reason++) {
+        uint64_t count = stats->count[reason];
+        if (count == 0) {
+            continue;
+        }
+        total += count;
+
+        ksnprintf(line, sizeof(line), "%16lu %16lu  %s", count, stats->cycles[reason] / count, vmexit_reason_str(reason));
+        write_line(line, ctx);
+
+        // format the non-empty buckets into a single line
+        size_t off = ksnprintf(line, sizeof(line), "                                ");
+        for (int bucket = 0; bucket < VMEXIT_STATS_BUCKETS; bucket++) {
+            uint32_t hits = stats->histogram[reason][bucket];
+            if (hits == 0 || off >= sizeof(line)) {
+                continue;
+            }
+            off += ksnprintf(line + off, sizeof(line) - off, " 2^%d:%u", bucket, hits);
+        }
+        write_line(line, ctx);
+    }
+
+    ksnprintf(line, sizeof(line), "%16lu total exits", total);
+    write_line(line, ctx);
+}
@@ -0,0 +1,55 @@
+#ifndef __VIRTDBG_STATS_H__
+#define __VIRTDBG_STATS_H__
+
+#include <vmx/vmm.h>
+#include <util/defs.h>
+#include <stdint.h>
+
+/**
+ * The amount of log2 buckets in every latency histogram, bucket n counts
+ * the exits that took [2^n, 2^(n+1)) cycles, the last one takes everything
+ * above that
+ */
+#define VMEXIT_STATS_BUCKETS 32
+
+/**
+ * Per-vcpu exit counters and latency histograms, the latency of an exit is
+ * the time from the exit stub until we resume the guest. The cpuid exits
+ * served by the stub itself never get here and are not counted.
+ */
+typedef struct vmexit_stats {
+    uint64_t count[VMEXIT_REASONS_MAX];
+    uint64_t cycles[VMEXIT_REASONS_MAX];
+    uint32_t histogram[VMEXIT_REASONS_MAX][VMEXIT_STATS_BUCKETS];
+} vmexit_stats_t;
+
+/**
+ * Account a single exit, called on every exit so keep it cheap
+ */
+static inline void vmexit_stats_record(vmexit_stats_t* stats, uint16_t reason, uint64_t cycles) {
+    if (reason >= VMEXIT_REASONS_MAX) {
+        return;
+    }
+
+    size_t bucket = cycles == 0 ? 0 : LOG2(cycles);
+    if (bucket >= VMEXIT_STATS_BUCKETS) {
+        bucket = VMEXIT_STATS_BUCKETS - 1;
+    }
+
+    stats->count[reason]++;
+    stats->cycles[reason] += cycles;
+    stats->histogram[reason][bucket]++;
+}
+
+/**
+ * Clear all the counters
+ */
+void vmexit_stats_reset(vmexit_stats_t* stats);
+
+/**
+ * Output the counters and histograms as a table, only reasons that were
+ * hit are shown, every line is given to the callback without a new line
+ */
+void vmexit_stats_dump(vmexit_stats_t* stats, void (*write_line)(const char* line, void* ctx), void* ctx);
+
+#endif //__VIRTDBG_STATS_H__
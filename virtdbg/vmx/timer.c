@@ -0,0 +1,127 @@
+#include <arch/intrin.h>
+#include <arch/msr.h>
+#include <util/defs.h>
+#include <vmx/vcpu.h>
+#include <vmx/vmm.h>
+
+#include "timer.h"
+
+static vmexit_handler_t m_handlers[TIMER_USER_COUNT];
+
+static vmexit_action_t handle_preemption_timer(vcpu_t* vcpu);
+
+err_t init_timer() {
+    return vmexit_register_handler(VMEXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED, handle_preemption_timer);
+}
+
+void timer_set_handler(timer_user_t user, vmexit_handler_t handler) {
+    m_handlers[user] = handler;
+}
+
+/**
+ * Tell all the vcpus to apply the periods on their next exit
+ */
+static void set_period(timer_user_t user, uint32_t period) {
+    for (size_t i = 0; i < g_vcpu_count; i++) {
+        vcpu_t* vcpu = g_vcpus[i];
+        if (vcpu == NULL) {
+            continue;
+        }
+
+        vcpu->timer.period[user] = period;
+        atomic_store_explicit(&vcpu->timer.pending, true, memory_order_release);
+        vcpu_set_exit_work(vcpu);
+    }
+}
+
+err_t timer_start(timer_user_t user, uint64_t period_cycles) {
+    err_t err = NO_ERROR;
+
+    CHECK(user < TIMER_USER_COUNT);
+
+    // we need the timer to keep counting across other exits
+    uint64_t allowed_pinbased = __rdmsr(MSR_IA32_VMX_PINBASED_CTLS) >> 32;
+    uint64_t allowed_exit = __rdmsr(MSR_IA32_VMX_EXIT_CTLS) >> 32;
+    CHECK_ERROR(((vmx_pinbased_ctls_t){ .raw = allowed_pinbased }).preemption_timer, ERROR_UNSUPPORTED);
+    CHECK_ERROR(((vmx_exit_ctls_t){ .raw = allowed_exit }).save_preemption_timer, ERROR_UNSUPPORTED);
+
+    // the timer counts down every 2^ratio tsc cycles
+    msr_vmx_misc_t misc = { .raw = __rdmsr(MSR_IA32_VMX_MISC) };
+    uint64_t period = period_cycles >> misc.vmtimer_ratio;
+    CHECK(period != 0 && period <= UINT32_MAX, "period of %lu cycles is out of range", period_cycles);
+
+    set_period(user, period);
+
+cleanup:
+    return err;
+}
+
+void timer_stop(timer_user_t user) {
+    set_period(user, 0);
+}
+
+/**
+ * Arm the timer for the closest user, or turn it off if there is none
+ */
+static void timer_arm(vcpu_t* vcpu) {
+    vcpu_timer_t* timer = &vcpu->timer;
+
+    timer->armed = 0;
+    for (int user = 0; user < TIMER_USER_COUNT; user++) {
+        if (timer->period[user] != 0 && (timer->armed == 0 || timer->left[user] < timer->armed)) {
+            timer->armed = timer->left[user];
+        }
+    }
+
+    if (timer->armed != 0) {
+        vmwrite(VMCS_FIELD_GUEST_PREEMPTION_TIMER, timer->armed);
+    }
+}
+
+void timer_apply(vcpu_t* vcpu) {
+    vcpu_timer_t* timer = &vcpu->timer;
+    atomic_store_explicit(&timer->pending, false, memory_order_relaxed);
+
+    bool enable = false;
+    for (int user = 0; user < TIMER_USER_COUNT; user++) {
+        timer->left[user] = timer->period[user];
+        enable |= timer->period[user] != 0;
+    }
+
+    vmx_pinbased_ctls_t pinbased_ctls = { .raw = vmread(VMCS_FIELD_PINBASED_CTLS) };
+    pinbased_ctls.preemption_timer = enable;
+    vmwrite(VMCS_FIELD_PINBASED_CTLS, pinbased_ctls.raw);
+
+    vmx_exit_ctls_t exit_ctls = { .raw = vmread(VMCS_FIELD_VMEXIT_CTLS) };
+    exit_ctls.save_preemption_timer = enable;
+    vmwrite(VMCS_FIELD_VMEXIT_CTLS, exit_ctls.raw);
+
+    timer_arm(vcpu);
+}
+
+/**
+ * Call the users that are due and re-arm the timer
+ */
+static vmexit_action_t handle_preemption_timer(vcpu_t* vcpu) {
+    vcpu_timer_t* timer = &vcpu->timer;
+    vmexit_action_t action = VMEXIT_RESUME;
+
+    for (int user = 0; user < TIMER_USER_COUNT; user++) {
+        if (timer->period[user] == 0) {
+            continue;
+        }
+
+        timer->left[user] -= MIN(timer->left[user], timer->armed);
+        if (timer->left[user] == 0) {
+            timer->left[user] = timer->period[user];
+            if (m_handlers[user] != NULL) {
+                action = m_handlers[user](vcpu);
+            }
+        }
+    }
+
+    // the saved timer value is zero now
+    timer_arm(vcpu);
+
+    return action;
+}
@@ -0,0 +1,68 @@
+#ifndef __VIRTDBG_TIMER_H__
+#define __VIRTDBG_TIMER_H__
+
+#include <util/except.h>
+#include <vmx/dispatch.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+struct vcpu;
+
+/**
+ * Everyone who needs the guest to exit periodically, the preemption
+ * timer runs at the closest deadline and every user is called on its
+ * own period
+ */
+typedef enum timer_user {
+    TIMER_PROFILER,
+    TIMER_HEATMAP,
+    TIMER_GDB,
+    TIMER_USER_COUNT
+} timer_user_t;
+
+/**
+ * The per-vcpu preemption timer state, the periods are written by whoever
+ * controls the users and applied by the vcpu itself on its next exit
+ */
+typedef struct vcpu_timer {
+    // the period of every user in timer ticks, zero when off
+    uint32_t period[TIMER_USER_COUNT];
+
+    // the ticks left until every user is due
+    uint32_t left[TIMER_USER_COUNT];
+
+    // the ticks the timer was armed with
+    uint32_t armed;
+
+    // a period changed and needs to be applied to the vmcs
+    atomic_bool pending;
+} vcpu_timer_t;
+
+/**
+ * Register the preemption timer exit handler
+ */
+err_t init_timer();
+
+/**
+ * Set the handler called when the user is due, may be NULL if the user
+ * only needs the exit itself
+ */
+void timer_set_handler(timer_user_t user, vmexit_handler_t handler);
+
+/**
+ * Call the user every period on all the vcpus, the period is rounded down
+ * to the resolution of the timer
+ */
+err_t timer_start(timer_user_t user, uint64_t period_cycles);
+
+/**
+ * Stop calling the user on all the vcpus
+ */
+void timer_stop(timer_user_t user);
+
+/**
+ * Apply a pending period change, must run on the vcpu itself
+ */
+void timer_apply(struct vcpu* vcpu);
+
+#endif //__VIRTDBG_TIMER_H__
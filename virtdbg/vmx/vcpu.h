@@ -0,0 +1,126 @@
+#ifndef __VIRTDBG_VCPU_H__
+#define __VIRTDBG_VCPU_H__
+
+#include <vmx/exit_info.h>
+#include <vmx/cpuid.h>
+#include <vmx/profiler.h>
+#include <vmx/timer.h>
+#include <vmx/ept.h>
+#include <vmx/watch.h>
+#include <vmx/breakpoint.h>
+#include <vmx/dirty.h>
+#include <vmx/dispatch.h>
+#include <vmx/stats.h>
+#include <vmx/vmm.h>
+#include <sync/lock.h>
+#include <virtdbg.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * The size of the stack each vcpu handles its exits on
+ */
+#define HOST_STACK_SIZE (4096 * 2)
+
+/**
+ * The per-cpu state of the hypervisor
+ */
+typedef struct vcpu {
+    // the guest general purpose registers, must be first since the
+    // vmx stubs access it through the vcpu pointer
+    alignas(CACHELINE_SIZE) guest_state_t guest;
+
+    // the precomputed cpuid responses, used by the cpuid fast path
+    // in the vmx stubs so must come right after the registers
+    cpuid_entry_t cpuid[CPUID_ENTRY_COUNT];
+
+    // the ept generation the tlb of this cpu was last flushed at, the
+    // cpuid fast path takes the slow path if it is behind
+    uint64_t ept_generation;
+
+    // someone left work for the next exit, the cpuid fast path takes
+    // the slow path so exit_handler does it
+    atomic_bool exit_work;
+
+    // the vmcs of this cpu
+    vmcs_t vmcs;
+
+    // the index of this cpu in the initial guest states
+    uint8_t id;
+
+    // the vpid tagging the guest tlb entries, zero when not supported
+    uint16_t vpid;
+
+    // stepping in the unrestricted view, and the view to go back to
+    bool ept_stepping;
+    ept_view_t ept_step_view;
+
+    // io bitmaps A and B, one after the other
+    uint8_t* io_bitmap;
+
+    // the cached vmcs fields of the current exit
+    vmexit_info_t exit;
+
+    // the handler of every exit reason on this vcpu
+    vmexit_handler_t exit_handlers[VMEXIT_REASONS_MAX];
+
+    // the handlers waiting for the guest to do a single instruction
+    vmexit_handler_t step_handlers[VMEXIT_MAX_STEP_HANDLERS];
+    uint8_t step_handler_count;
+
+    // the stack exits are handled on, the vcpu pointer is at the top
+    void* host_stack;
+
+    // state of the exit round trip measurement done at launch
+    struct {
+        uint32_t remaining;
+        uint64_t start_tsc;
+        uint64_t guest_rip;
+    } roundtrip;
+
+    // the preemption timer shared by the profiler and the heatmap
+    vcpu_timer_t timer;
+
+    // the guest sampling profiler
+    profiler_t profiler;
+
+    // exit counters and latency histograms
+    vmexit_stats_t stats;
+
+    // the watchpoint hit this vcpu reports after its step
+    watch_vcpu_t watch;
+
+    // the breakpoint pages this vcpu is stepping over
+    breakpoint_vcpu_t breakpoints;
+
+    // the page modification log of this vcpu
+    dirty_vcpu_t dirty;
+} vcpu_t;
+
+_Static_assert(offsetof(vcpu_t, guest) == 0, "the vmx stubs expect the guest registers at the start");
+_Static_assert(offsetof(vcpu_t, cpuid) == 128, "the vmx stubs expect the cpuid table after the registers");
+_Static_assert(offsetof(vcpu_t, ept_generation) == 2176, "the vmx stubs expect the ept generation after the cpuid table");
+_Static_assert(offsetof(vcpu_t, exit_work) == 2184, "the vmx stubs expect the exit work after the ept generation");
+
+/**
+ * Make the next exit of the vcpu go through exit_handler, call after
+ * setting any of the pending flags it looks at
+ */
+static inline void vcpu_set_exit_work(vcpu_t* vcpu) {
+    atomic_store_explicit(&vcpu->exit_work, true, memory_order_release);
+}
+
+/**
+ * The most vcpus we can have, the id is a byte
+ */
+#define MAX_VCPUS 256
+
+/**
+ * All the vcpus by id, an entry may still be NULL while the cpus
+ * are being brought up
+ */
+extern vcpu_t* g_vcpus[MAX_VCPUS];
+extern size_t g_vcpu_count;
+
+#endif //__VIRTDBG_VCPU_H__
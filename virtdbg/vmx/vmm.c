@@ -3,15 +3,49 @@
 #include <arch/intrin.h>
 #include <stdint.h>
 #include <vmx/ept.h>
+#include <vmx/vcpu.h>
+#include <vmx/msr_bitmap.h>
+#include <vmx/io_bitmap.h>
+#include <vmx/cpuid.h>
+#include <vmx/profiler.h>
+#include <vmx/timer.h>
+#include <vmx/heatmap.h>
+#include <vmx/dirty.h>
+#include <vmx/dispatch.h>
+#include <gdb/gdb.h>
 #include <stddef.h>
 #include <util/except.h>
 #include <virtdbg.h>
 #include <arch/gdt.h>
 #include <arch/idt.h>
 #include <arch/msr.h>
+#include <stdatomic.h>
 
-extern void vm_resume(guest_state_t *t);
-extern ept_entry_t* g_root_pa;
+extern __attribute__((noreturn)) void vmx_launch(vcpu_t* vcpu);
+extern void vmx_exit_stub();
+extern void vmx_roundtrip_probe();
+
+static vmexit_action_t handle_roundtrip_probe(vcpu_t* vcpu);
+
+/**
+ * The amount of exit round trips done by the probe at launch
+ */
+#define ROUNDTRIP_PROBE_ITERATIONS 1000
+
+vcpu_t* g_vcpus[MAX_VCPUS];
+size_t g_vcpu_count;
+
+/**
+ * Bring up timing, see vmm_start_bringup
+ */
+static uint64_t m_bringup_start_tsc;
+static size_t m_bringup_cpu_count;
+static atomic_size_t m_bringup_launched;
+
+void vmm_start_bringup(size_t cpu_count) {
+    m_bringup_cpu_count = cpu_count;
+    m_bringup_start_tsc = __rdtsc();
+}
 
 //enable vmx operation
 err_t vmxon() {
@@ -56,40 +90,103 @@ cleanup:
     return err;
 }
 
-static inline void vmptrld(uintptr_t vmcs) {
-    uint8_t ret;
-    asm volatile (
-        "vmptrld %[pa];"
-        "setna %[ret];"
-        : [ret]"=rm"(ret)
-        : [pa]"m"(vmcs)
-        : "cc", "memory");
-    ASSERT(!ret, "Error loading VMCS pointer at %X", vmcs);
+/**
+ * The ept and vpid capabilities of the cpu
+ */
+static msr_vmx_ept_vpid_cap_t m_ept_vpid_cap;
+
+typedef enum invvpid_type {
+    INVVPID_INDIVIDUAL_ADDRESS = 0,
+    INVVPID_SINGLE_CONTEXT = 1,
+    INVVPID_ALL_CONTEXT = 2,
+    INVVPID_SINGLE_CONTEXT_RETAIN_GLOBALS = 3,
+} invvpid_type_t;
+
+static void invvpid(invvpid_type_t type, uint16_t vpid, uintptr_t address) {
+    struct {
+        uint64_t vpid;
+        uint64_t address;
+    } descriptor = { vpid, address };
+
+    asm volatile("invvpid %1, %0" : : "r"((uint64_t)type), "m"(descriptor) : "memory");
 }
 
-static inline void vmwrite(uint64_t encoding, uint64_t value) {
-    uint8_t ret;
-    asm volatile (
-        "vmwrite %1, %2;"
-        "setna %[ret]"
-        : [ret]"=rm"(ret)
-        : "rm"(value), "r"(encoding)
-        : "cc", "memory");
-    ASSERT(!ret, "Error writing to %X", encoding);
+void vpid_flush_context(vcpu_t* vcpu) {
+    if (vcpu->vpid == 0) {
+        // every entry and exit flushes anyways
+        return;
+    }
+
+    if (m_ept_vpid_cap.invvpid_single_context) {
+        invvpid(INVVPID_SINGLE_CONTEXT, vcpu->vpid, 0);
+    } else {
+        invvpid(INVVPID_ALL_CONTEXT, 0, 0);
+    }
 }
 
-static inline uint64_t vmread(uint64_t encoding) {
-    uint64_t tmp;
-    uint8_t ret;
-    asm volatile(
-        "vmread %[encoding], %[value];"
-        "setna %[ret];"
-        : [value]"=rm"(tmp), [ret]"=rm"(ret)
-        : [encoding]"r"(encoding)
-        : "cc", "memory");
-    ASSERT(!ret, "Error reading from %X", encoding);
-
-    return tmp;
+/**
+ * Put the vcpu in the state a cpu is in after an INIT and have it wait for
+ * a SIPI, the guest starts its aps like it would on a real machine
+ */
+static void vcpu_wait_for_sipi(vcpu_t* vcpu) {
+    // real mode at the reset vector, the unrestricted guest can run it
+    vmwrite(VMCS_FIELD_GUEST_CS_SELECTOR, 0xF000);
+    vmwrite(VMCS_FIELD_GUEST_CS_BASE, 0xFFFF0000);
+    vmwrite(VMCS_FIELD_GUEST_CS_LIMIT, 0xFFFF);
+    vmwrite(VMCS_FIELD_GUEST_CS_AR_BYTES, REAL_CODE_ACCESS_RIGHT);
+
+    static const uint64_t data_segments[][4] = {
+        { VMCS_FIELD_GUEST_DS_SELECTOR, VMCS_FIELD_GUEST_DS_BASE, VMCS_FIELD_GUEST_DS_LIMIT, VMCS_FIELD_GUEST_DS_AR_BYTES },
+        { VMCS_FIELD_GUEST_ES_SELECTOR, VMCS_FIELD_GUEST_ES_BASE, VMCS_FIELD_GUEST_ES_LIMIT, VMCS_FIELD_GUEST_ES_AR_BYTES },
+        { VMCS_FIELD_GUEST_FS_SELECTOR, VMCS_FIELD_GUEST_FS_BASE, VMCS_FIELD_GUEST_FS_LIMIT, VMCS_FIELD_GUEST_FS_AR_BYTES },
+        { VMCS_FIELD_GUEST_GS_SELECTOR, VMCS_FIELD_GUEST_GS_BASE, VMCS_FIELD_GUEST_GS_LIMIT, VMCS_FIELD_GUEST_GS_AR_BYTES },
+        { VMCS_FIELD_GUEST_SS_SELECTOR, VMCS_FIELD_GUEST_SS_BASE, VMCS_FIELD_GUEST_SS_LIMIT, VMCS_FIELD_GUEST_SS_AR_BYTES },
+    };
+    for (size_t i = 0; i < ARRAY_LEN(data_segments); i++) {
+        vmwrite(data_segments[i][0], 0);
+        vmwrite(data_segments[i][1], 0);
+        vmwrite(data_segments[i][2], 0xFFFF);
+        vmwrite(data_segments[i][3], REAL_DATA_ACCESS_RIGHT);
+    }
+
+    vmwrite(VMCS_FIELD_GUEST_LDTR_SELECTOR, 0);
+    vmwrite(VMCS_FIELD_GUEST_LDTR_BASE, 0);
+    vmwrite(VMCS_FIELD_GUEST_LDTR_LIMIT, 0xFFFF);
+    vmwrite(VMCS_FIELD_GUEST_LDTR_AR_BYTES, LDTR_ACCESS_RIGHT);
+    vmwrite(VMCS_FIELD_GUEST_TR_SELECTOR, 0);
+    vmwrite(VMCS_FIELD_GUEST_TR_BASE, 0);
+    vmwrite(VMCS_FIELD_GUEST_TR_LIMIT, 0xFFFF);
+    vmwrite(VMCS_FIELD_GUEST_TR_AR_BYTES, TR_ACCESS_RIGHT);
+    vmwrite(VMCS_FIELD_GUEST_GDTR_BASE, 0);
+    vmwrite(VMCS_FIELD_GUEST_GDTR_LIMIT, 0xFFFF);
+    vmwrite(VMCS_FIELD_GUEST_IDTR_BASE, 0);
+    vmwrite(VMCS_FIELD_GUEST_IDTR_LIMIT, 0xFFFF);
+
+    // CD, NW and ET like the cpu sets them, plus whatever vmx needs
+    // besides PE and PG which the unrestricted guest may clear
+    ia32_cr0_t cr0 = { .raw = __rdmsr(MSR_IA32_VMX_CR0_FIXED0) | 0x60000010 };
+    cr0.PE = 0;
+    cr0.PG = 0;
+    vmwrite(VMCS_FIELD_GUEST_CR0, cr0.raw);
+    vmwrite(VMCS_FIELD_GUEST_CR3, 0);
+    vmwrite(VMCS_FIELD_GUEST_CR4, __rdmsr(MSR_IA32_VMX_CR4_FIXED0));
+    vmwrite(VMCS_FIELD_GUEST_EFER_FULL, 0);
+    vmwrite(VMCS_FIELD_GUEST_DR7, 0x400);
+
+    vmx_entry_ctls_t entry_ctls = { .raw = vmread(VMCS_FIELD_VMENTRY_CTLS) };
+    entry_ctls.is_guest_64bit = 0;
+    vmwrite(VMCS_FIELD_VMENTRY_CTLS, entry_ctls.raw);
+
+    // edx has the cpu signature
+    uint32_t regs[4];
+    __cpuid(1, 0, regs);
+    vcpu->guest = (guest_state_t){ .rdx = regs[0] };
+
+    vmwrite(VMCS_FIELD_GUEST_RIP, 0xFFF0);
+    vmwrite(VMCS_FIELD_GUEST_RSP, 0);
+    vmwrite(VMCS_FIELD_GUEST_RFLAGS, 1 << 1);
+    vmwrite(VMCS_FIELD_GUEST_INTERRUPTIBILITY_INFO, 0);
+    vmwrite(VMCS_FIELD_GUEST_ACTIVITY_STATE, GUEST_ACTIVITY_WAIT_FOR_SIPI);
 }
 
 static err_t validate_controls(uint32_t ctls, uint64_t msr_ctls) {
@@ -106,8 +203,9 @@ cleanup:
     return err;
 }
 
-err_t init_vmcs(vmcs_t* vmcs, initial_guest_state_t* state) {
+err_t init_vmcs(vcpu_t* vcpu, initial_guest_state_t* state) {
     err_t err = NO_ERROR;
+    vmcs_t* vmcs = &vcpu->vmcs;
     msr_vmx_basic_t vmx_basic = { .raw = __rdmsr(MSR_IA32_VMX_BASIC) };
 
     // Allocate a vmcs region
@@ -138,9 +236,24 @@ err_t init_vmcs(vmcs_t* vmcs, initial_guest_state_t* state) {
     uint64_t allowed_procbased_ctls = __rdmsr(MSR_IA32_VMX_PROCBASED_CTLS);
     vmx_procbased_ctls_t procbased_ctls = { .raw = (allowed_procbased_ctls & 0xFFFFFFFF) & (allowed_procbased_ctls >> 32) };
     procbased_ctls.use_procased2 = 1;
+    procbased_ctls.use_msr_bitmaps = 1;
+    procbased_ctls.use_io_bitmaps = 1;
     CHECK_AND_RETHROW(validate_controls(procbased_ctls.raw, allowed_procbased_ctls));
     vmwrite(VMCS_FIELD_PROCBASED_CTLS, procbased_ctls.raw);
 
+    //
+    // only the msrs that are intercepted in the bitmap will exit
+    //
+    vmwrite(VMCS_FIELD_MSR_BITMAP_FULL, (uintptr_t)g_msr_bitmap);
+
+    //
+    // same for io ports, the guest gets direct access to anything
+    // that is not owned by the hypervisor
+    //
+    CHECK_AND_RETHROW(init_vcpu_io_bitmap(vcpu));
+    vmwrite(VMCS_FIELD_IO_BITMAP_A_FULL, (uintptr_t)vcpu->io_bitmap);
+    vmwrite(VMCS_FIELD_IO_BITMAP_B_FULL, (uintptr_t)vcpu->io_bitmap + 0x1000);
+
     //
     // from this we only really need to enable EPT so we can map stuff on demand (saves space)
     // and so we can have unrestricted guest, so the kernel can do whatever it wants
@@ -149,13 +262,55 @@ err_t init_vmcs(vmcs_t* vmcs, initial_guest_state_t* state) {
     vmx_procbased_ctls2_t procbased_ctls2 = { .raw = (allowed_procbased_ctls2 & 0xFFFFFFFF) & (allowed_procbased_ctls2 >> 32) };
     procbased_ctls2.enable_ept = 1;
     procbased_ctls2.unrestricted_guest = 1;
+
+    //
+    // tag the guest tlb entries with a vpid so they are not flushed on every
+    // entry and exit, vpid 0 belongs to the host
+    //
+    vmx_procbased_ctls2_t supported_procbased_ctls2 = { .raw = allowed_procbased_ctls2 >> 32 };
+    m_ept_vpid_cap.raw = __rdmsr(MSR_IA32_VMX_EPT_VPID_CAP);
+    if (supported_procbased_ctls2.enable_vpid && m_ept_vpid_cap.invvpid) {
+        procbased_ctls2.enable_vpid = 1;
+        vcpu->vpid = vcpu->id + 1;
+    }
+
+    //
+    // let the guest switch between the ept views it was given with vmfunc
+    // without exiting, the rest of the eptp list is invalid and exits
+    //
+    if (supported_procbased_ctls2.enable_vm_func &&
+        (__rdmsr(MSR_IA32_VMX_VMFUNC) & MSR_IA32_VMX_VMFUNC_EPTP_SWITCHING)) {
+        procbased_ctls2.enable_vm_func = 1;
+    }
+
     CHECK_AND_RETHROW(validate_controls(procbased_ctls2.raw, allowed_procbased_ctls2));
     vmwrite(VMCS_FIELD_PROCBASED_CTLS2, procbased_ctls2.raw);
 
+    if (vcpu->vpid != 0) {
+        // make sure nothing stale is left with our tag
+        vmwrite(VMCS_FIELD_VPID, vcpu->vpid);
+        vpid_flush_context(vcpu);
+    }
+
+    if (procbased_ctls2.enable_vm_func) {
+        vmwrite(VMCS_FIELD_VM_FUNCTION_CONTROL_FULL, MSR_IA32_VMX_VMFUNC_EPTP_SWITCHING);
+        vmwrite(VMCS_FIELD_EPTP_LIST_ADDR_FULL, (uintptr_t)ept_eptp_list());
+    }
+
+    //
+    // exits we don't have a handler for will assert
     //
-    // we don't want to exit on any exception
+    init_vcpu_dispatch(vcpu);
+
+    //
+    // cpuid always exits, most of it is served from this table
     //
-    vmwrite(VMCS_FIELD_EXCEPTION_BITMAP, 0);
+    init_vcpu_cpuid(vcpu);
+
+    //
+    // only exit on the exceptions someone wants to handle
+    //
+    vmwrite(VMCS_FIELD_EXCEPTION_BITMAP, vmexit_exception_bitmap());
 
     //
     // Setup the vmexit controls, just tell it we are a 64bit host
@@ -181,7 +336,7 @@ err_t init_vmcs(vmcs_t* vmcs, initial_guest_state_t* state) {
     //
     // Setup the EPT
     //
-    vmwrite(VMCS_FIELD_EPT_POINTER_FULL, (uintptr_t)g_root_pa | EPT_WB | EPT_PAGEWALK(EPT_LEVELS));
+    vmwrite(VMCS_FIELD_EPT_POINTER_FULL, ept_view_eptp(EPT_DEFAULT_VIEW));
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Set the guest state
@@ -297,12 +452,43 @@ err_t init_vmcs(vmcs_t* vmcs, initial_guest_state_t* state) {
     };
     vmwrite(VMCS_FIELD_HOST_EFER_FULL, efer.raw);
 
+    // every exit goes to the same stub on the vcpu's own stack, the vcpu
+    // pointer sits at the top of the stack so the stub can find it
+    vcpu->host_stack = pallocz_aligned(HOST_STACK_SIZE, 16);
+    CHECK_ERROR(vcpu->host_stack != NULL, ERROR_OUT_OF_RESOURCES);
+    uintptr_t host_rsp = (uintptr_t)vcpu->host_stack + HOST_STACK_SIZE - 16;
+    *(vcpu_t**)host_rsp = vcpu;
+    vmwrite(VMCS_FIELD_HOST_RSP, host_rsp);
+    vmwrite(VMCS_FIELD_HOST_RIP, (uintptr_t)vmx_exit_stub);
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // launch the VM, execution will resume at exit_handler
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    extern void vmlaunch_first(guest_state_t* t);
-    vmlaunch_first(&state->gprstate);
+    vcpu->guest = state->gprstate;
+
+    // the aps wait for the guest to start them
+    if (vcpu->id != 0) {
+        msr_vmx_misc_t misc = { .raw = __rdmsr(MSR_IA32_VMX_MISC) };
+        CHECK_ERROR(misc.wait_for_sipi_activity_State_supported, ERROR_UNSUPPORTED);
+        vcpu_wait_for_sipi(vcpu);
+    }
+
+    // run the probe first, it will continue to the real guest
+    // code once it is done
+    if (vcpu->id == 0) {
+        vcpu->roundtrip.remaining = ROUNDTRIP_PROBE_ITERATIONS + 1;
+        vcpu->roundtrip.guest_rip = state->rip;
+        vmwrite(VMCS_FIELD_GUEST_RIP, (uintptr_t)vmx_roundtrip_probe);
+        CHECK_AND_RETHROW(vcpu_set_exit_handler(vcpu, VMEXIT_REASON_VMCALL, handle_roundtrip_probe));
+    }
+
+    if (atomic_fetch_add(&m_bringup_launched, 1) + 1 == m_bringup_cpu_count) {
+        TRACE("all %d cpus are up after %lu cycles", m_bringup_cpu_count, __rdtsc() - m_bringup_start_tsc);
+    }
+
+    ept_sync(vcpu);
+    vmx_launch(vcpu);
 
 cleanup:
     return err;
@@ -371,46 +557,154 @@ static const char* m_vmexit_strings[VMEXIT_REASONS_MAX] = {
 	[VMEXIT_REASON_PCOMMIT] = "VMEXIT_REASON_PCOMMIT",
 };
 
-void exit_handler(guest_state_t *s) {
-    while (1) {
-        size_t error = vmread(VMCS_FIELD_VM_INSTRUCTION_ERROR);
-        if (error) {
-            TRACE("VM entry error: %x", error);
-        }
-
-        vmx_vmexit_reason_t reason = { .raw = vmread(VMCS_FIELD_VM_EXIT_REASON) };
-
-        uint16_t exit_reason = reason.exit_reason;
-        switch (exit_reason) {
-            case VMEXIT_REASON_EPT_VIOLATION: {
-                size_t address = vmread(0x00002400);
-                ept_map(address & ~(0x1000-1));
-            } break;
-
-            case VMEXIT_REASON_HLT: {
-                TRACE("Guest invoked HLT, halting...");
-                asm("hlt");
-            } break;
-
-            case VMEXIT_REASON_EXCEPTION_NMI: {
-                TRACE("Guest got NMI, ignoring");
-            } break;
-
-            default: {
-                if (exit_reason < VMEXIT_REASONS_MAX) {
-                    ASSERT(0, "Unhandled vmexit: %s (0x%04x)", m_vmexit_strings[exit_reason], reason);
-                } else {
-                    ASSERT(0, "unknown vmexit: 0x%04x", reason.exit_reason);
-                }
-            } break;
-        }
-
-        ASSERT(!reason.entry_failed, "VMX Entry Failed");
-
-        vm_resume(s);
-
-        //VMX sets out gdt and idt limits to all 1s, so fix that
-        __lgdt(g_gdt);
-        __lidt(g_idt);
+const char* vmexit_reason_str(uint16_t reason) {
+    if (reason >= VMEXIT_REASONS_MAX || m_vmexit_strings[reason] == NULL) {
+        return "<unknown>";
+    }
+    return m_vmexit_strings[reason];
+}
+
+/**
+ * Called by the vmx stubs when vmlaunch/vmresume fail instead of entering the guest
+ */
+__attribute__((noreturn, used))
+void vm_entry_failed(vcpu_t* vcpu) {
+    ASSERT(0, "VM entry failed on cpu #%d: error %d", vcpu->id, vmread(VMCS_FIELD_VM_INSTRUCTION_ERROR));
+    __builtin_unreachable();
+}
+
+/**
+ * The probe does a vmcall in a loop, measure how long the round trips
+ * take and then send the guest to its real entry point. Only installed
+ * on the vcpu while the probe runs.
+ */
+static vmexit_action_t handle_roundtrip_probe(vcpu_t* vcpu) {
+    // the first exit starts the clock
+    if (vcpu->roundtrip.remaining-- == ROUNDTRIP_PROBE_ITERATIONS + 1) {
+        vcpu->roundtrip.start_tsc = __rdtsc();
+    }
+
+    if (vcpu->roundtrip.remaining != 0) {
+        return VMEXIT_ADVANCE;
     }
+
+    uint64_t cycles = __rdtsc() - vcpu->roundtrip.start_tsc;
+    TRACE("cpu #%d: exit round trip takes %lu cycles", vcpu->id, cycles / ROUNDTRIP_PROBE_ITERATIONS);
+
+    guest_set_rip(&vcpu->exit, vcpu->roundtrip.guest_rip);
+    vmexit_stats_reset(&vcpu->stats);
+
+    // the guest's own vmcalls go back to whoever handles them
+    vcpu_set_exit_handler(vcpu, VMEXIT_REASON_VMCALL, NULL);
+    return VMEXIT_RESUME;
+}
+
+/**
+ * The guest sees a cpu without vmx, where a vmcall is #UD
+ */
+static vmexit_action_t handle_vmcall(vcpu_t* vcpu) {
+    vmx_interruption_info_t info = {
+        .vector = EXCEPT_INVALID_OPCODE,
+        .type = VMX_INTERRUPTION_TYPE_HARDWARE_EXCEPTION,
+        .valid = 1,
+    };
+    vmwrite(VMCS_FIELD_VM_ENTRY_INTR_INFO, info.raw);
+    return VMEXIT_RESUME;
+}
+
+/**
+ * The guest resets a cpu, usually the first step of starting an ap
+ */
+static vmexit_action_t handle_init(vcpu_t* vcpu) {
+    vcpu_wait_for_sipi(vcpu);
+
+    // keep the cache in line with what was written behind its back
+    guest_set_rip(&vcpu->exit, 0xFFF0);
+    guest_set_rsp(&vcpu->exit, 0);
+    guest_set_rflags(&vcpu->exit, 1 << 1);
+    return VMEXIT_RESUME;
+}
+
+/**
+ * Start the cpu at the page the guest gave in the SIPI
+ */
+static vmexit_action_t handle_sipi(vcpu_t* vcpu) {
+    uint8_t vector = vmexit_qualification(&vcpu->exit) & 0xFF;
+    vmwrite(VMCS_FIELD_GUEST_CS_SELECTOR, vector << 8);
+    vmwrite(VMCS_FIELD_GUEST_CS_BASE, vector << 12);
+    guest_set_rip(&vcpu->exit, 0);
+    vmwrite(VMCS_FIELD_GUEST_ACTIVITY_STATE, GUEST_ACTIVITY_ACTIVE);
+    return VMEXIT_RESUME;
+}
+
+static vmexit_action_t handle_hlt(vcpu_t* vcpu) {
+    TRACE("Guest invoked HLT, halting...");
+    asm("hlt");
+    return VMEXIT_RESUME;
+}
+
+static vmexit_action_t handle_exception_nmi(vcpu_t* vcpu) {
+    vmx_interruption_info_t info = vmexit_interruption_info(&vcpu->exit);
+    if (info.type == VMX_INTERRUPTION_TYPE_NMI) {
+        TRACE("Guest got NMI, ignoring");
+        return VMEXIT_RESUME;
+    }
+
+    return vmexit_dispatch_exception(vcpu, info.vector);
+}
+
+err_t init_vmm() {
+    err_t err = NO_ERROR;
+
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_VMCALL, handle_vmcall));
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_INIT, handle_init));
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_SIPI, handle_sipi));
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_HLT, handle_hlt));
+    CHECK_AND_RETHROW(vmexit_register_handler(VMEXIT_REASON_EXCEPTION_NMI, handle_exception_nmi));
+
+cleanup:
+    return err;
+}
+
+/**
+ * Called by vmx_exit_stub with the guest registers already saved in the vcpu
+ * and the tsc the stub read, handles a single exit and returns to the stub
+ * which resumes the guest
+ */
+__attribute__((used))
+void exit_handler(vcpu_t* vcpu, uint64_t exit_tsc) {
+    // we are on the slow path now, the exchange orders it before the
+    // loads of the pending flags below
+    atomic_exchange_explicit(&vcpu->exit_work, false, memory_order_acq_rel);
+
+    vmx_vmexit_reason_t reason = vmexit_reason(&vcpu->exit);
+    ASSERT(!reason.entry_failed, "VMX Entry Failed: %s", vmexit_reason_str(reason.exit_reason));
+
+    uint16_t exit_reason = reason.exit_reason;
+    vmexit_dispatch(vcpu, exit_reason);
+
+    // a user of the timer was started or stopped
+    if (atomic_load_explicit(&vcpu->timer.pending, memory_order_acquire)) {
+        timer_apply(vcpu);
+    }
+
+    // harvest the ept accessed bits if it is time
+    heatmap_poll(exit_tsc);
+
+    // gdb may want to stop the guest
+    gdb_poll(vcpu, exit_tsc);
+
+    // write back whatever the handlers changed
+    vmexit_info_flush(&vcpu->exit);
+
+    // catch up with ept changes made since the last entry
+    ept_sync(vcpu);
+
+    // dirty logging was started or stopped, or someone wants the log,
+    // after the ept sync since the log needs the eptp dirty bits
+    if (atomic_load_explicit(&vcpu->dirty.pending, memory_order_acquire)) {
+        dirty_apply(vcpu);
+    }
+
+    vmexit_stats_record(&vcpu->stats, exit_reason, __rdtsc() - exit_tsc);
 }
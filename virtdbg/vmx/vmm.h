@@ -281,6 +281,7 @@ typedef enum vmexit_reason {
 	VMEXIT_REASON_APIC_WRITE = 56,
 	VMEXIT_REASON_RDRAND = 57,
 	VMEXIT_REASON_INVPCID = 58,
+	VMEXIT_REASON_VMFUNC = 59,
 	VMEXIT_REASON_RDSEED = 61,
 	VMEXIT_REASON_PML_FULL = 62,
 	VMEXIT_REASON_XSAVES = 63,
@@ -424,16 +425,105 @@ typedef union vmx_vmexit_reason {
 } vmx_vmexit_reason_t;
 _Static_assert(sizeof(vmx_vmexit_reason_t) == sizeof(uint32_t), "invalid size for vmx_vmexit_reason_t");
 
+//! Vol 3C, 24.9.2 Information for VM Exits Due to Vectored Events
+typedef union vmx_interruption_info {
+    struct {
+        uint32_t vector : 8;
+        uint32_t type : 3;
+#define VMX_INTERRUPTION_TYPE_EXTERNAL              0
+#define VMX_INTERRUPTION_TYPE_NMI                   2
+#define VMX_INTERRUPTION_TYPE_HARDWARE_EXCEPTION    3
+#define VMX_INTERRUPTION_TYPE_SOFTWARE_EXCEPTION    6
+        uint32_t error_code_valid : 1;
+        uint32_t nmi_unblocking : 1;
+        uint32_t _reserved0 : 18;
+        uint32_t valid : 1;
+    };
+    uint32_t raw;
+} vmx_interruption_info_t;
+_Static_assert(sizeof(vmx_interruption_info_t) == sizeof(uint32_t), "invalid size for vmx_interruption_info_t");
+
 #define DATA_ACCESS_RIGHT  (0x3 | 1 << 4 | 1 << 7)
 #define CODE_ACCESS_RIGHT  (0x3 | 1 << 4 | 1 << 7 | 1 << 13)
 #define LDTR_ACCESS_RIGHT  (0x2 | 1 << 7)
 #define TR_ACCESS_RIGHT    (11 | 1 << 7)
 
+/**
+ * The access rights of the real mode segments after an INIT
+ */
+#define REAL_CODE_ACCESS_RIGHT  (0xB | 1 << 4 | 1 << 7)
+#define REAL_DATA_ACCESS_RIGHT  (0x3 | 1 << 4 | 1 << 7)
+
+/**
+ * The guest activity states we use
+ */
+#define GUEST_ACTIVITY_ACTIVE           0
+#define GUEST_ACTIVITY_WAIT_FOR_SIPI    3
+
 typedef struct vmcs {
     uintptr_t region;
 } vmcs_t;
 
+static inline void vmptrld(uintptr_t vmcs) {
+    uint8_t ret;
+    asm volatile (
+        "vmptrld %[pa];"
+        "setna %[ret];"
+        : [ret]"=rm"(ret)
+        : [pa]"m"(vmcs)
+        : "cc", "memory");
+    ASSERT(!ret, "Error loading VMCS pointer at %X", vmcs);
+}
+
+static inline void vmwrite(uint64_t encoding, uint64_t value) {
+    uint8_t ret;
+    asm volatile (
+        "vmwrite %1, %2;"
+        "setna %[ret]"
+        : [ret]"=rm"(ret)
+        : "rm"(value), "r"(encoding)
+        : "cc", "memory");
+    ASSERT(!ret, "Error writing to %X", encoding);
+}
+
+static inline uint64_t vmread(uint64_t encoding) {
+    uint64_t tmp;
+    uint8_t ret;
+    asm volatile(
+        "vmread %[encoding], %[value];"
+        "setna %[ret];"
+        : [value]"=rm"(tmp), [ret]"=rm"(ret)
+        : [encoding]"r"(encoding)
+        : "cc", "memory");
+    ASSERT(!ret, "Error reading from %X", encoding);
+
+    return tmp;
+}
+
+struct vcpu;
+
+/**
+ * Register the exit handlers of the vmm itself
+ */
+err_t init_vmm();
+
 err_t vmxon();
-err_t init_vmcs(vmcs_t* vmcs, initial_guest_state_t* state);
+err_t init_vmcs(struct vcpu* vcpu, initial_guest_state_t* state);
+
+/**
+ * Start timing the bring up of the given amount of cpus, the time it
+ * took is reported once the last of them enters the guest
+ */
+void vmm_start_bringup(size_t cpu_count);
+
+/**
+ * Flush all the guest linear mappings of the vcpu
+ */
+void vpid_flush_context(struct vcpu* vcpu);
+
+/**
+ * Get the name of the given exit reason
+ */
+const char* vmexit_reason_str(uint16_t reason);
 
 #endif
@@ -1,152 +1,194 @@
-%define GUEST_RIP 0x0000681E
-%define HOST_RIP  0x00006c16
-%define HOST_RSP  0x00006c14
-%define GUEST_RSP 0x0000681C
+; offsets in guest_state_t, which is the first thing in vcpu_t
+%define GUEST_RAX 0
+%define GUEST_RBX 8
+%define GUEST_RCX 16
+%define GUEST_RDX 24
+%define GUEST_RSI 32
+%define GUEST_RDI 40
+%define GUEST_RBP 48
+%define GUEST_R8  56
+%define GUEST_R9  64
+%define GUEST_R10 72
+%define GUEST_R11 80
+%define GUEST_R12 88
+%define GUEST_R13 96
+%define GUEST_R14 104
+%define GUEST_R15 112
 
-global vmlaunch_first
-global  vm_resume
+; the cpuid table follows the registers, see cpuid.h
+%define VCPU_CPUID 128
+%define CPUID_ENTRY_SHIFT 5
+%define CPUID_ENTRY_FLAGS 16
+%define CPUID_ENTRY_SUBLEAF 20
+%define CPUID_ENTRY_PRESENT 1
+%define CPUID_ENTRY_INDEXED 2
+%define CPUID_BASIC_COUNT 32
+%define CPUID_EXTENDED_BASE 0x80000000
+%define CPUID_EXTENDED_COUNT 32
+
+; right after the cpuid table, see vcpu.h
+%define VCPU_EPT_GENERATION 2176
+%define VCPU_EXIT_WORK 2184
+
+%define VMCS_FIELD_VM_EXIT_REASON 0x4402
+%define VMCS_FIELD_VM_EXIT_INSTRUCTION_LEN 0x440c
+%define VMCS_FIELD_GUEST_RIP 0x681e
+%define VMEXIT_REASON_CPUID 10
+
+global vmx_launch
+global vmx_exit_stub
+global vmx_roundtrip_probe
 extern exit_handler
+extern vm_entry_failed
+extern g_ept_generation
+
+; load the guest registers from the vcpu in rdi, rdi itself goes last
+%macro LOAD_GUEST_GPRS 0
+mov rax, [rdi + GUEST_RAX]
+mov rbx, [rdi + GUEST_RBX]
+mov rcx, [rdi + GUEST_RCX]
+mov rdx, [rdi + GUEST_RDX]
+mov rsi, [rdi + GUEST_RSI]
+mov rbp, [rdi + GUEST_RBP]
+mov r8,  [rdi + GUEST_R8]
+mov r9,  [rdi + GUEST_R9]
+mov r10, [rdi + GUEST_R10]
+mov r11, [rdi + GUEST_R11]
+mov r12, [rdi + GUEST_R12]
+mov r13, [rdi + GUEST_R13]
+mov r14, [rdi + GUEST_R14]
+mov r15, [rdi + GUEST_R15]
+mov rdi, [rdi + GUEST_RDI]
+%endmacro
 
 section .text
-vmlaunch_first:
+
+;
+; void vmx_launch(vcpu_t* vcpu)
+;
+; The host state (including HOST_RSP and HOST_RIP) must already be in
+; the vmcs, if the launch works all exits go to vmx_exit_stub
+;
+vmx_launch:
 push rdi
-; set host rip and rsp
-mov rcx, HOST_RSP
-vmwrite rcx, rsp
-mov rcx, GUEST_RSP
-vmwrite rcx, rsp
-mov rcx, HOST_RIP
-mov rsi, hexit
-vmwrite rcx, rsi
-mov rcx, GUEST_RIP
-mov rsi, cont
-vmwrite rcx, rsi
+LOAD_GUEST_GPRS
+vmlaunch
 
+; only reached if vmlaunch failed
 mov rdi, [rsp]
+call vm_entry_failed
 
-mov rbx, [rdi + 8]
-mov rcx, [rdi + 16]
-mov rdx, [rdi + 24]
-mov rsi, [rdi + 32]
-mov rbp, [rdi + 48]
-mov r8,  [rdi + 56]
-mov r9,  [rdi + 64]
-mov r10, [rdi + 72]
-mov r11, [rdi + 80]
-mov r12, [rdi + 88]
-mov r13, [rdi + 96]
-mov r14, [rdi + 104]
-mov r15, [rdi + 112]
-mov rax, [rdi]
-mov rdi, [rdi + 40]
-vmlaunch
-
-hexit:
+;
+; HOST_RIP of every vcpu, HOST_RSP points to the top of the vcpu host
+; stack where the vcpu pointer is stored, so nothing has to be written
+; to the vmcs on the way in or out.
+;
+; The exit sets the host gdtr and idtr limits to 0xffff, which covers
+; our tables anyways, so they are not reloaded.
+;
+; cpuid exits that hit the vcpu cpuid table are served right here
+; without saving the guest registers or going through exit_handler,
+; unless the ept changed or someone left work for exit_handler.
+;
+vmx_exit_stub:
 push rdi
-mov rdi, [rsp + 8]
-mov [rdi], rax
-mov [rdi + 8], rbx
-mov [rdi + 16], rcx
-mov [rdi + 24], rdx
-mov [rdi + 32], rsi
-mov [rdi + 48], rbp
-mov [rdi + 56], r8
-mov [rdi + 64], r9
-mov [rdi + 72], r10
-mov [rdi + 80], r11
-mov [rdi + 88], r12
-mov [rdi + 96], r13
-mov [rdi + 104], r14
-mov [rdi + 112], r15
-pop r8
-pop r9
-mov [r9 + 40], r8
-pop rdi
-jmp exit_handler
+push rsi
 
-cont:
-hlt
-jmp $
+mov rdi, VMCS_FIELD_VM_EXIT_REASON
+vmread rsi, rdi
+cmp esi, VMEXIT_REASON_CPUID
+jne .slow_path
 
+; the tlb has to be flushed or a pending change applied
+mov rdi, [rsp + 16]
+cmp byte [rdi + VCPU_EXIT_WORK], 0
+jne .slow_path
+mov rsi, [rel g_ept_generation]
+cmp rsi, [rdi + VCPU_EPT_GENERATION]
+jne .slow_path
 
-vm_resume:
-push rax
-push rbx
-push rcx
-push rdx
-push rsi
-push rdi
-push rbp
-push r8
-push r9
-push r10
-push r11
-push r12
-push r13
-push r14
-push r15
+; find the entry of the leaf in eax
+mov esi, eax
+cmp esi, CPUID_BASIC_COUNT
+jb .lookup
+sub esi, CPUID_EXTENDED_BASE
+cmp esi, CPUID_EXTENDED_COUNT
+jae .slow_path
+add esi, CPUID_BASIC_COUNT
 
-push rdi
-mov rcx, HOST_RSP
-mov rdx, HOST_RIP
+.lookup:
+shl rsi, CPUID_ENTRY_SHIFT
+lea rsi, [rdi + VCPU_CPUID + rsi]
+test dword [rsi + CPUID_ENTRY_FLAGS], CPUID_ENTRY_PRESENT
+jz .slow_path
+test dword [rsi + CPUID_ENTRY_FLAGS], CPUID_ENTRY_INDEXED
+jz .hit
+cmp ecx, [rsi + CPUID_ENTRY_SUBLEAF]
+jne .slow_path
 
-vmwrite rcx, rsp
-mov rdi, res
-vmwrite rdx, rdi
+.hit:
+; cpuid overwrites all of these anyways, so use them to skip the instruction
+mov rax, VMCS_FIELD_GUEST_RIP
+vmread rbx, rax
+mov rax, VMCS_FIELD_VM_EXIT_INSTRUCTION_LEN
+vmread rcx, rax
+add rbx, rcx
+mov rax, VMCS_FIELD_GUEST_RIP
+vmwrite rax, rbx
 
-mov rdi, [rsp]
+; the 32bit moves zero the upper halves like cpuid does
+mov eax, [rsi + 0]
+mov ebx, [rsi + 4]
+mov ecx, [rsi + 8]
+mov edx, [rsi + 12]
 
-mov rbx, [rdi + 8]
-mov rcx, [rdi + 16]
-mov rdx, [rdi + 24]
-mov rsi, [rdi + 32]
-mov rbp, [rdi + 48]
-mov r8,  [rdi + 56]
-mov r9,  [rdi + 64]
-mov r10, [rdi + 72]
-mov r11, [rdi + 80]
-mov r12, [rdi + 88]
-mov r13, [rdi + 96]
-mov r14, [rdi + 104]
-mov r15, [rdi + 112]
-mov rax, [rdi]
-mov rdi, [rdi + 40]
-vmresume
-res:
-push rdi
-mov rdi, [rsp + 8]
-mov [rdi], rax
-mov [rdi + 8], rbx
-mov [rdi + 16], rcx
-mov [rdi + 24], rdx
-mov [rdi + 32], rsi
-mov [rdi + 48], rbp
-mov [rdi + 56], r8
-mov [rdi + 64], r9
-mov [rdi + 72], r10
-mov [rdi + 80], r11
-mov [rdi + 88], r12
-mov [rdi + 96], r13
-mov [rdi + 104], r14
-mov [rdi + 112], r15
-pop r8
-pop r9
-mov [r9 + 40], r8
-
-pop r15
-pop r14
-pop r13
-pop r12
-pop r11
-pop r10
-pop r9
-pop r8
-pop rbp
+pop rsi
 pop rdi
+vmresume
+
+; only reached if vmresume failed
+mov rdi, [rsp]
+call vm_entry_failed
+
+.slow_path:
 pop rsi
-pop rdx
-pop rcx
-pop rbx
-pop rax
+mov rdi, [rsp + 8]
+mov [rdi + GUEST_RAX], rax
+mov [rdi + GUEST_RBX], rbx
+mov [rdi + GUEST_RCX], rcx
+mov [rdi + GUEST_RDX], rdx
+mov [rdi + GUEST_RSI], rsi
+mov [rdi + GUEST_RBP], rbp
+mov [rdi + GUEST_R8],  r8
+mov [rdi + GUEST_R9],  r9
+mov [rdi + GUEST_R10], r10
+mov [rdi + GUEST_R11], r11
+mov [rdi + GUEST_R12], r12
+mov [rdi + GUEST_R13], r13
+mov [rdi + GUEST_R14], r14
+mov [rdi + GUEST_R15], r15
+pop qword [rdi + GUEST_RDI]
+
+; the exit is timed from here, rax and rdx are saved already
+rdtsc
+shl rdx, 32
+or rax, rdx
+mov rsi, rax
+
+; rsp is back at HOST_RSP which is 16 byte aligned
+call exit_handler
+
+mov rdi, [rsp]
+LOAD_GUEST_GPRS
+vmresume
+
+; only reached if vmresume failed
+mov rdi, [rsp]
+call vm_entry_failed
 
-ret
+;
+; Guest code used to measure the cost of an exit round trip
+;
+vmx_roundtrip_probe:
+vmcall
+jmp vmx_roundtrip_probe
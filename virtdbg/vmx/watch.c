@@ -0,0 +1,301 @@
+#include <mm/pmm.h>
+#include <sync/lock.h>
+#include <util/defs.h>
+#include <util/string.h>
+#include <vmx/ept.h>
+#include <vmx/vcpu.h>
+#include <vmx/dispatch.h>
+#include <vmx/insn.h>
+
+#include "watch.h"
+
+/**
+ * The watched pages are kept in a hash table by their address, so an
+ * exit only has to look at the ranges of its own page
+ */
+#define WATCH_BUCKETS 256
+
+typedef struct watch_range {
+    struct watch_range* next;
+    uint64_t address;
+    uint64_t gpa;
+    size_t length;
+    watch_type_t type;
+} watch_range_t;
+
+typedef struct watch_page {
+    struct watch_page* next;
+    uint64_t gpa;
+    watch_range_t* ranges;
+} watch_page_t;
+
+static lock_t m_watch_lock = INIT_LOCK();
+static watch_page_t* m_buckets[WATCH_BUCKETS];
+
+/**
+ * The pmm can't free, so removed entries are kept for reuse
+ */
+static watch_page_t* m_free_pages;
+static watch_range_t* m_free_ranges;
+
+static watch_hit_handler_t m_hit_handler;
+
+static size_t page_bucket(uint64_t gpa) {
+    uint64_t frame = gpa >> 12;
+    return (frame ^ (frame >> 8) ^ (frame >> 16)) % WATCH_BUCKETS;
+}
+
+/**
+ * Get the link pointing to the page, points to NULL if it is not watched
+ */
+static watch_page_t** find_page(uint64_t gpa) {
+    watch_page_t** link = &m_buckets[page_bucket(gpa)];
+    while (*link != NULL && (*link)->gpa != gpa) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * The access the guest can have to the page without missing a watched access
+ */
+static uint8_t page_access(watch_page_t* page) {
+    watch_type_t types = 0;
+    for (watch_range_t* range = page->ranges; range != NULL; range = range->next) {
+        types |= range->type;
+    }
+
+    uint8_t access = EPT_ACCESS_ALL;
+    if (types & WATCH_WRITE) {
+        access &= ~EPT_ACCESS_WRITE;
+    }
+    if (types & WATCH_READ) {
+        // a page can't be writable without being readable
+        access &= ~(EPT_ACCESS_READ | EPT_ACCESS_WRITE);
+        if (!ept_execute_only_supported()) {
+            access &= ~EPT_ACCESS_EXECUTE;
+        }
+    }
+
+    return access;
+}
+
+/**
+ * Give the page its access in the ept, and throw it away once it is
+ * not watched anymore, must hold the lock
+ */
+static err_t update_page(watch_page_t** link) {
+    err_t err = NO_ERROR;
+    watch_page_t* page = *link;
+
+    CHECK_AND_RETHROW(ept_claim_page(EPT_OWNER_WATCH, page->gpa, page->gpa, page_access(page)));
+
+    if (page->ranges == NULL) {
+        *link = page->next;
+        page->next = m_free_pages;
+        m_free_pages = page;
+    }
+
+cleanup:
+    return err;
+}
+
+void watch_set_hit_handler(watch_hit_handler_t handler) {
+    m_hit_handler = handler;
+}
+
+err_t watch_insert(uint64_t address, uint64_t gpa, size_t length, watch_type_t type) {
+    err_t err = NO_ERROR;
+    lock(&m_watch_lock);
+
+    CHECK(length != 0 && (gpa & 0xFFF) + length <= 0x1000, "watched range must be inside a single page");
+    CHECK(type != 0 && (type & ~WATCH_ACCESS) == 0);
+
+    // we step over the accesses that don't hit
+    CHECK_ERROR(vcpu_single_step_supported(), ERROR_UNSUPPORTED);
+
+    watch_range_t* range = m_free_ranges;
+    if (range != NULL) {
+        m_free_ranges = range->next;
+    } else {
+        range = palloc(sizeof(watch_range_t));
+        CHECK_ERROR(range != NULL, ERROR_OUT_OF_RESOURCES);
+    }
+
+    watch_page_t** link = find_page(gpa & ~0xFFFull);
+    if (*link == NULL) {
+        watch_page_t* page = m_free_pages;
+        if (page != NULL) {
+            m_free_pages = page->next;
+        } else {
+            page = palloc(sizeof(watch_page_t));
+            CHECK_ERROR(page != NULL, ERROR_OUT_OF_RESOURCES);
+        }
+
+        *page = (watch_page_t){ .gpa = gpa & ~0xFFFull };
+        *link = page;
+    }
+
+    *range = (watch_range_t){
+        .next = (*link)->ranges,
+        .address = address,
+        .gpa = gpa,
+        .length = length,
+        .type = type,
+    };
+    (*link)->ranges = range;
+
+    CHECK_AND_RETHROW(update_page(link));
+
+cleanup:
+    unlock(&m_watch_lock);
+    return err;
+}
+
+/**
+ * Take the matching ranges out of the page, returns if anything was removed
+ */
+static bool remove_ranges(watch_page_t* page, uint64_t address, watch_type_t type) {
+    bool removed = false;
+
+    watch_range_t** link = &page->ranges;
+    while (*link != NULL) {
+        watch_range_t* range = *link;
+        if (range->address == address && range->type == type) {
+            *link = range->next;
+            range->next = m_free_ranges;
+            m_free_ranges = range;
+            removed = true;
+        } else {
+            link = &range->next;
+        }
+    }
+
+    return removed;
+}
+
+err_t watch_remove(uint64_t address, watch_type_t type) {
+    err_t err = NO_ERROR;
+    lock(&m_watch_lock);
+
+    bool found = false;
+    for (size_t i = 0; i < WATCH_BUCKETS; i++) {
+        watch_page_t** link = &m_buckets[i];
+        while (*link != NULL) {
+            watch_page_t* page = *link;
+            if (remove_ranges(page, address, type)) {
+                found = true;
+                CHECK_AND_RETHROW(update_page(link));
+            }
+
+            // the page may have been unlinked
+            if (*link == page) {
+                link = &page->next;
+            }
+        }
+    }
+
+    CHECK_ERROR(found, ERROR_NOT_FOUND);
+
+cleanup:
+    unlock(&m_watch_lock);
+    return err;
+}
+
+/**
+ * The access is done, report the hit
+ */
+static vmexit_action_t watch_step_done(vcpu_t* vcpu) {
+    if (vcpu->watch.maybe_hit) {
+        vcpu->watch.maybe_hit = false;
+
+        uint8_t* after = (uint8_t*)vcpu->watch.maybe_gpa;
+        for (size_t i = 0; i < vcpu->watch.maybe_length; i++) {
+            if (after[i] != vcpu->watch.maybe_before[i]) {
+                vcpu->watch.hit = true;
+                break;
+            }
+        }
+    }
+
+    if (vcpu->watch.hit) {
+        vcpu->watch.hit = false;
+        if (m_hit_handler != NULL) {
+            m_hit_handler(vcpu, vcpu->watch.hit_address, vcpu->watch.hit_type);
+        }
+    }
+
+    return VMEXIT_RESUME;
+}
+
+/**
+ * An access to a watched page, check if it hits any of the ranges and then
+ * do the access in the unrestricted view, the other vcpus still can't touch
+ * the page without us seeing it. The misses never leave the exit handler.
+ */
+static bool handle_watch_access(vcpu_t* vcpu, uint64_t gpa, uint64_t qualification, vmexit_action_t* action) {
+    err_t err = NO_ERROR;
+    bool handled = false;
+    lock(&m_watch_lock);
+
+    watch_page_t** link = find_page(gpa & ~0xFFFull);
+    if (*link == NULL) {
+        goto cleanup;
+    }
+    handled = true;
+    watch_page_t* page = *link;
+
+    // the exit only tells us the first byte of the access, the size comes
+    // from the instruction. If it is not known a read is only matched by
+    // its first byte, and a write by anything it may reach which is then
+    // checked once it is done.
+    size_t size = insn_access_size(vcpu);
+    size_t window = size != 0 ? size : WATCH_ACCESS_WINDOW;
+
+    vcpu->watch.hit = false;
+    vcpu->watch.maybe_hit = false;
+    for (watch_range_t* range = page->ranges; range != NULL; range = range->next) {
+        if (gpa + window <= range->gpa || gpa >= range->gpa + range->length) {
+            continue;
+        }
+
+        bool write = (qualification & EPT_VIOLATION_WRITE) && (range->type & WATCH_WRITE);
+        bool read = (qualification & EPT_VIOLATION_READ) && (range->type & WATCH_READ) &&
+                    (size != 0 || gpa >= range->gpa);
+        if (!write && !read) {
+            continue;
+        }
+
+        if (size == 0 && gpa < range->gpa && !read) {
+            if (!vcpu->watch.maybe_hit) {
+                vcpu->watch.maybe_hit = true;
+                vcpu->watch.maybe_gpa = range->gpa;
+                vcpu->watch.maybe_length = MIN(range->length, gpa + window - range->gpa);
+                memcpy(vcpu->watch.maybe_before, (void*)range->gpa, vcpu->watch.maybe_length);
+                vcpu->watch.hit_address = range->address;
+                vcpu->watch.hit_type = range->type;
+            }
+            continue;
+        }
+
+        vcpu->watch.hit = true;
+        vcpu->watch.maybe_hit = false;
+        vcpu->watch.hit_address = range->address;
+        vcpu->watch.hit_type = range->type;
+        break;
+    }
+
+    CHECK_AND_RETHROW(ept_step_unrestricted(vcpu));
+    CHECK_AND_RETHROW(vcpu_single_step(vcpu, watch_step_done));
+
+cleanup:
+    unlock(&m_watch_lock);
+    ASSERT(!IS_ERROR(err), "Failed to step over a watched page");
+
+    *action = VMEXIT_RESUME;
+    return handled;
+}
+
+err_t init_watch() {
+    return ept_register_access_handler(handle_watch_access);
+}
@@ -0,0 +1,68 @@
+#ifndef __VIRTDBG_WATCH_H__
+#define __VIRTDBG_WATCH_H__
+
+#include <util/except.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct vcpu;
+
+typedef enum watch_type {
+    WATCH_WRITE = 1 << 0,
+    WATCH_READ = 1 << 1,
+    WATCH_ACCESS = WATCH_WRITE | WATCH_READ,
+} watch_type_t;
+
+/**
+ * The exit doesn't tell the size of the access, a write the instruction
+ * decoder doesn't know is taken to be up to the largest single access the
+ * cpu does (a 64 byte zmm store)
+ */
+#define WATCH_ACCESS_WINDOW 64
+
+/**
+ * The per-vcpu watchpoint state
+ */
+typedef struct watch_vcpu {
+    // a watchpoint was hit, reported once the access is done
+    bool hit;
+    watch_type_t hit_type;
+    uint64_t hit_address;
+
+    // a write that started before a watched range and may have reached
+    // into it, only a hit if the watched bytes changed
+    bool maybe_hit;
+    uint8_t maybe_length;
+    uint64_t maybe_gpa;
+    uint8_t maybe_before[WATCH_ACCESS_WINDOW];
+} watch_vcpu_t;
+
+/**
+ * Called after the guest did an access that hit a watchpoint
+ */
+typedef void (*watch_hit_handler_t)(struct vcpu* vcpu, uint64_t address, watch_type_t type);
+
+/**
+ * Register the ept access handler of the watchpoints
+ */
+err_t init_watch();
+
+/**
+ * Set who gets the watchpoint hits
+ */
+void watch_set_hit_handler(watch_hit_handler_t handler);
+
+/**
+ * Watch a range of guest physical memory, the range must be inside a single
+ * page. The address is what gets reported on a hit, a watchpoint that covers
+ * multiple pages is inserted once for every page with the same address.
+ */
+err_t watch_insert(uint64_t address, uint64_t gpa, size_t length, watch_type_t type);
+
+/**
+ * Remove all the ranges that were inserted with the address and type
+ */
+err_t watch_remove(uint64_t address, watch_type_t type);
+
+#endif //__VIRTDBG_WATCH_H__